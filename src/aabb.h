@@ -3,11 +3,23 @@
 #include "ray.h"
 #include "vec.h"
 
+#include <algorithm>
+
 struct aabb {
   aabb() {}
 
   aabb(const point3& a, const point3& b) : min(a), max(b) {}
 
+  // An inverted box that any surrounding() call will replace.
+  static aabb empty() {
+    return aabb(point3(INFINITY, INFINITY, INFINITY),
+                point3(-INFINITY, -INFINITY, -INFINITY));
+  }
+
+  bool is_empty() const {
+    return min.x() > max.x() || min.y() > max.y() || min.z() > max.z();
+  }
+
   bool overlaps(const aabb& other) const {
     return (min.x() <= other.max.x() && max.x() >= other.min.x()) &&
            (min.y() <= other.max.y() && max.y() >= other.min.y()) &&
@@ -29,6 +41,15 @@ struct aabb {
     return true;
   }
 
+  real_t surface_area() const {
+    if (is_empty())
+      return 0.0;
+    auto d = max - min;
+    return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+  }
+
+  point3 centroid() const { return (min + max) * 0.5; }
+
   real_t volume() const {
     auto d = max - min;
     return d.x() * d.y() * d.z();
@@ -56,11 +77,15 @@ struct aabb {
   }
 
   aabb surrounding(const aabb& other) const {
-    point3 small(fmin(min.x(), other.min.x()), fmin(min.y(), other.min.y()),
-                 fmin(min.z(), other.min.z()));
+    // std::min/max instead of fmin/fmax, they compile to single instructions
+    // and the BVH builder calls this in its innermost loops.
+    point3 small(std::min(min.x(), other.min.x()),
+                 std::min(min.y(), other.min.y()),
+                 std::min(min.z(), other.min.z()));
 
-    point3 big(fmax(max.x(), other.max.x()), fmax(max.y(), other.max.y()),
-               fmax(max.z(), other.max.z()));
+    point3 big(std::max(max.x(), other.max.x()),
+               std::max(max.y(), other.max.y()),
+               std::max(max.z(), other.max.z()));
 
     return aabb(small, big);
   }
@@ -0,0 +1,50 @@
+#include "arena.h"
+
+// stl
+#include <algorithm>
+#include <cassert>
+
+namespace {
+
+std::byte* new_block(size_t size) {
+  return static_cast<std::byte*>(
+    ::operator new(size, std::align_val_t(arena::max_alignment)));
+}
+
+void delete_block(std::byte* data) {
+  ::operator delete(data, std::align_val_t(arena::max_alignment));
+}
+
+}  // namespace
+
+arena::~arena() {
+  for (auto& b : blocks)
+    delete_block(b.data);
+}
+
+void* arena::allocate(size_t bytes, size_t alignment) {
+  assert(alignment <= max_alignment);
+  size_t start = (offset + alignment - 1) & ~(alignment - 1);
+  if (blocks.empty() || start + bytes > blocks.back().size) {
+    // Oversized requests get a block of their own.
+    const size_t size = std::max(block_size, bytes);
+    blocks.push_back({new_block(size), size});
+    start = 0;
+  }
+  offset = start + bytes;
+  used += bytes;
+  ++live;
+  return blocks.back().data + start;
+}
+
+bool arena::reset() {
+  if (live > 0)
+    return false;
+  for (size_t i = 1; i < blocks.size(); ++i)
+    delete_block(blocks[i].data);
+  if (blocks.size() > 1)
+    blocks.resize(1);
+  offset = 0;
+  used = 0;
+  return true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+// stl
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Bump allocator for the objects of one scene. Allocations are carved out of
+// large blocks in order, so objects made one after another sit next to each
+// other, and their memory is never freed one by one. Objects made with make()
+// are ordinary shared_ptrs with the control block in the same slot, so they
+// are still destroyed one by one when their last owner lets go; only
+// freeing the memory is batched.
+//
+// Allocation is not thread-safe; scenes are built on one thread, and the BVH
+// builder uses one arena per thread.
+struct arena {
+  static constexpr size_t default_block_size = size_t(1) << 20;
+  static constexpr size_t max_alignment = 64;
+
+  explicit arena(size_t block_size = default_block_size)
+      : block_size(block_size) {}
+
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+  ~arena();
+
+  void* allocate(size_t bytes, size_t alignment);
+
+  // The memory is not reused, but counting what is returned tells reset()
+  // when nothing made in the arena is alive any more.
+  void deallocate(void*, size_t) { --live; }
+
+  // Releases the blocks, keeping the first for the next scene. Refuses, and
+  // returns false, while objects made in the arena are still alive, so it
+  // comes after they are destroyed and does not replace that.
+  bool reset();
+
+  size_t live_objects() const { return live; }
+
+  template <typename T, typename... Args>
+  std::shared_ptr<T> make(Args&&... args);
+
+  size_t bytes_used() const { return used; }
+
+ protected:
+  struct block {
+    std::byte* data;
+    size_t size;
+  };
+
+  std::vector<block> blocks;
+  size_t block_size;
+  size_t offset = 0;  // Into blocks.back()
+  size_t used = 0;
+  std::atomic<size_t> live = 0;
+};
+
+template <typename T>
+struct arena_allocator {
+  using value_type = T;
+
+  explicit arena_allocator(arena* owner) : owner(owner) {}
+
+  template <typename U>
+  arena_allocator(const arena_allocator<U>& other) : owner(other.owner) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(owner->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, size_t n) { owner->deallocate(p, n * sizeof(T)); }
+
+  template <typename U>
+  bool operator==(const arena_allocator<U>& other) const {
+    return owner == other.owner;
+  }
+
+  arena* owner;
+};
+
+template <typename T, typename... Args>
+std::shared_ptr<T> arena::make(Args&&... args) {
+  return std::allocate_shared<T>(arena_allocator<T>(this),
+                                 std::forward<Args>(args)...);
+}
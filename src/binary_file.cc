@@ -0,0 +1,44 @@
+#include "binary_file.h"
+
+#include "linear_bvh.h"
+
+// stl
+#include <filesystem>
+#include <fstream>
+
+binary_file_header make_file_header(const char (&magic)[8], uint32_t version) {
+  binary_file_header header = {};
+  std::memcpy(header.magic, magic, sizeof(header.magic));
+  header.version = version;
+  header.node_size = sizeof(linear_bvh_node);
+  return header;
+}
+
+bool check_file_header(const binary_file_header& header,
+                       const char (&magic)[8], uint32_t version) {
+  return std::memcmp(header.magic, magic, sizeof(header.magic)) == 0 &&
+         header.version == version &&
+         header.node_size == sizeof(linear_bvh_node);
+}
+
+bool counts_fit(size_t file_size, std::initializer_list<uint64_t> counts) {
+  for (uint64_t count : counts) {
+    if (count > file_size)
+      return false;
+  }
+  return true;
+}
+
+bool write_file_atomically(const std::string& path,
+                           const std::function<void(std::ostream&)>& write) {
+  const auto temp = path + ".tmp";
+  {
+    std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+    write(out);
+    if (!out)
+      return false;
+  }
+  std::error_code ec;
+  std::filesystem::rename(temp, path, ec);
+  return !ec;
+}
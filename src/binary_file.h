@@ -0,0 +1,48 @@
+#pragma once
+
+#include "mapped_file.h"
+
+// stl
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <ostream>
+#include <string>
+
+// Common start of the BVH cache and mesh files, which store linear_bvh nodes
+// as they are in memory.
+struct binary_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;  // Catches layout changes without a version bump
+};
+
+static_assert(sizeof(binary_file_header) == 16, "keep the headers aligned");
+
+binary_file_header make_file_header(const char (&magic)[8], uint32_t version);
+
+// True if header was written with this magic, version and node layout.
+bool check_file_header(const binary_file_header& header,
+                       const char (&magic)[8], uint32_t version);
+
+// True if no count exceeds the file size. Checked before the section offsets
+// are computed from the counts, so that those can not overflow.
+bool counts_fit(size_t file_size, std::initializer_list<uint64_t> counts);
+
+// Copies the header out of the file and checks its common part. Header has to
+// start with a binary_file_header named file.
+template <typename Header>
+bool read_file_header(const mapped_file& file, const char (&magic)[8],
+                      uint32_t version, Header& header) {
+  if (file.size < sizeof(Header))
+    return false;
+  std::memcpy(&header, file.data, sizeof(Header));
+  return check_file_header(header.file, magic, version);
+}
+
+// Calls write on a temporary file next to path and renames it over path, so
+// that a crash never leaves a truncated file behind. Returns false if any
+// write or the rename failed.
+bool write_file_atomically(const std::string& path,
+                           const std::function<void(std::ostream&)>& write);
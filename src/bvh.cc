@@ -1,70 +1,668 @@
 #include "bvh.h"
 
+#include "arena.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <iostream>
+#include <mutex>
 
-std::shared_ptr<bvh_node> bvh_node::build(
-  std::vector<std::shared_ptr<hittable>>& objects, real_t time0, real_t time1) {
-  // Build the tree by merging the bounding volumes of the two nearest
-  // bounding volumes, until there is only the root node left. If the
-  // object's bounding box can not be computed, then it is not included in the tree.
-  bool stop = false;
-  while (!stop) {
-    real_t min_distance = std::numeric_limits<real_t>::max();
-    int min_i = -1;
-    int min_j = -1;
-    for (size_t i = 0; i < objects.size(); ++i) {
-      aabb box_i;
-      if (!objects[i]->bounding_box(time0, time1, box_i))
+namespace {
+
+constexpr size_t bin_count = 16;
+// Past this depth ranges are split at the object median, which bounds the
+// depth of degenerate inputs so iterative traversal fits a fixed stack.
+constexpr size_t max_sah_depth = 64;
+// Cost of visiting an interior node relative to one primitive intersection.
+constexpr real_t traversal_cost = 1.0;
+constexpr real_t intersection_cost = 1.0;
+// Ranges at least this large are binned by several tasks at once.
+constexpr size_t parallel_bin_threshold = 1 << 16;
+constexpr size_t parallel_bin_chunk = 1 << 14;
+// Ranges at least this large are split off into their own task.
+constexpr size_t task_threshold = 1 << 12;
+// Spatial splits are only tried where the children of the best object split
+// overlap by at least this fraction of the root surface area.
+constexpr real_t spatial_split_overlap = 1e-5;
+// Block size of the node arenas, small enough for the many small trees of
+// meshes and nested lists.
+constexpr size_t node_block_size = size_t(1) << 16;
+
+// Tells the node arenas of one build from those of earlier ones.
+std::atomic<uint64_t> next_build_id{1};
+
+struct build_ref {
+  aabb box;
+  point3 centroid;
+  size_t index;  // Into the objects vector
+};
+
+struct bin {
+  aabb box = aabb::empty();
+  size_t count = 0;
+};
+
+using bin_set = std::array<std::array<bin, bin_count>, 3>;
+
+struct split {
+  int axis = -1;
+  size_t bin = 0;
+  real_t cost = INFINITY;
+};
+
+struct spatial_bin {
+  aabb box = aabb::empty();
+  size_t entries = 0;  // References starting in this bin
+  size_t exits = 0;    // References ending in this bin
+};
+
+using spatial_bin_set = std::array<std::array<spatial_bin, bin_count>, 3>;
+
+// How a range is turned into a node.
+struct range_split {
+  aabb bounds;
+  bool leaf = false;
+  size_t mid = 0;
+  int axis = 0;
+};
+
+struct range_bounds {
+  aabb bounds = aabb::empty();
+  aabb centroid_bounds = aabb::empty();
+
+  void merge(const range_bounds& other) {
+    bounds = bounds.surrounding(other.bounds);
+    centroid_bounds = centroid_bounds.surrounding(other.centroid_bounds);
+  }
+};
+
+using object_list = std::vector<std::shared_ptr<hittable>>;
+
+size_t bin_index(const build_ref& ref, int axis, real_t cmin, real_t scale) {
+  return std::min(static_cast<size_t>((ref.centroid[axis] - cmin) * scale),
+                  bin_count - 1);
+}
+
+int largest_axis(const aabb& box) {
+  auto d = box.max - box.min;
+  if (d.x() >= d.y() && d.x() >= d.z())
+    return 0;
+  return d.y() >= d.z() ? 1 : 2;
+}
+
+range_bounds compute_bounds(const std::vector<build_ref>& refs, size_t begin,
+                            size_t end) {
+  range_bounds rb;
+  for (size_t i = begin; i < end; ++i) {
+    rb.bounds = rb.bounds.surrounding(refs[i].box);
+    rb.centroid_bounds =
+      rb.centroid_bounds.surrounding(aabb(refs[i].centroid, refs[i].centroid));
+  }
+  return rb;
+}
+
+void fill_bins(const std::vector<build_ref>& refs, size_t begin, size_t end,
+               const aabb& centroid_bounds, bin_set& bins) {
+  for (int axis = 0; axis < 3; ++axis) {
+    real_t cmin = centroid_bounds.min[axis];
+    real_t extent = centroid_bounds.max[axis] - cmin;
+    if (extent <= 0)
+      continue;
+    real_t scale = bin_count / extent;
+    for (size_t i = begin; i < end; ++i) {
+      auto& b = bins[axis][bin_index(refs[i], axis, cmin, scale)];
+      b.box = b.box.surrounding(refs[i].box);
+      ++b.count;
+    }
+  }
+}
+
+split evaluate_bins(const bin_set& bins, const aabb& bounds) {
+  split best;
+  const real_t area = bounds.surface_area();
+  for (int axis = 0; axis < 3; ++axis) {
+    // Sweep from the right to get the area and count of every right side,
+    // then from the left evaluating each plane between two bins.
+    std::array<real_t, bin_count> right_area;
+    std::array<size_t, bin_count> right_count;
+    aabb acc = aabb::empty();
+    size_t count = 0;
+    for (size_t b = bin_count - 1; b > 0; --b) {
+      acc = acc.surrounding(bins[axis][b].box);
+      count += bins[axis][b].count;
+      right_area[b] = acc.surface_area();
+      right_count[b] = count;
+    }
+    acc = aabb::empty();
+    count = 0;
+    for (size_t b = 0; b < bin_count - 1; ++b) {
+      acc = acc.surrounding(bins[axis][b].box);
+      count += bins[axis][b].count;
+      if (count == 0 || right_count[b + 1] == 0)
         continue;
-      for (size_t j = i + 1; j < objects.size(); ++j) {
-        aabb box_j;
-        if (!objects[j]->bounding_box(time0, time1, box_j))
-          continue;
-        real_t dst = box_i.distance_sq(box_j);
-        if (dst < min_distance) {
-          min_distance = dst;
-          min_i = i;
-          min_j = j;
-        }
+      real_t cost = traversal_cost + intersection_cost *
+                                       (acc.surface_area() * count +
+                                        right_area[b + 1] * right_count[b + 1]) /
+                                       area;
+      if (cost < best.cost) {
+        best.axis = axis;
+        best.bin = b;
+        best.cost = cost;
       }
     }
-    if (min_i == -1 || min_j == -1) {
-      stop = true;
+  }
+  return best;
+}
+
+// Bounds of the two sides of an object split.
+std::pair<aabb, aabb> split_bounds(const bin_set& bins, const split& s) {
+  aabb left = aabb::empty();
+  aabb right = aabb::empty();
+  for (size_t b = 0; b < bin_count; ++b) {
+    auto& side = b <= s.bin ? left : right;
+    side = side.surrounding(bins[s.axis][b].box);
+  }
+  return {left, right};
+}
+
+// Bins of a spatial split of bounds along axis.
+struct spatial_grid {
+  spatial_grid(const aabb& bounds, int axis)
+      : origin(bounds.min[axis]),
+        extent(bounds.max[axis] - bounds.min[axis]),
+        scale(bin_count / extent) {}
+
+  size_t bin(real_t x) const {
+    real_t b = std::floor((x - origin) * scale);
+    return static_cast<size_t>(std::clamp(b, 0.0, real_t(bin_count - 1)));
+  }
+
+  // Position of the plane between bin b and b + 1.
+  real_t plane(size_t b) const { return origin + (b + 1) * extent / bin_count; }
+
+  real_t origin, extent, scale;
+};
+
+aabb clip(aabb box, int axis, real_t lo, real_t hi) {
+  box.min[axis] = std::max(box.min[axis], lo);
+  box.max[axis] = std::min(box.max[axis], hi);
+  // Rounding in the bin lookup can leave an empty slab; keep the box valid.
+  box.max[axis] = std::max(box.max[axis], box.min[axis]);
+  return box;
+}
+
+// Bins the references by the bins their boxes overlap. A reference is
+// clipped to every bin it spans, so that it counts once per side of each
+// candidate plane.
+void fill_spatial_bins(const std::vector<build_ref>& refs, const aabb& bounds,
+                       spatial_bin_set& bins) {
+  for (int axis = 0; axis < 3; ++axis) {
+    if (bounds.max[axis] <= bounds.min[axis])
       continue;
+    spatial_grid grid(bounds, axis);
+    for (const auto& ref : refs) {
+      size_t first = grid.bin(ref.box.min[axis]);
+      size_t last = grid.bin(ref.box.max[axis]);
+      ++bins[axis][first].entries;
+      ++bins[axis][last].exits;
+      for (size_t b = first; b <= last; ++b) {
+        real_t lo = b == 0 ? -INFINITY : grid.plane(b - 1);
+        real_t hi = b == bin_count - 1 ? INFINITY : grid.plane(b);
+        auto& bin_box = bins[axis][b].box;
+        bin_box = bin_box.surrounding(clip(ref.box, axis, lo, hi));
+      }
     }
-    aabb box_i;
-    objects[min_i]->bounding_box(time0, time1, box_i);
-    aabb box_j;
-    objects[min_j]->bounding_box(time0, time1, box_j);
-    objects.push_back(std::make_shared<bvh_node>(objects[min_i], objects[min_j],
-                                                 box_i.surrounding(box_j)));
-    objects.erase(objects.begin() + min_j);
-    objects.erase(objects.begin() + min_i);
   }
+}
 
-  // If there is only one object left, then it is the root node.
-  std::shared_ptr<hittable> left, right;
-  aabb box;
-  if (objects.size() == 1) {
-    left = objects[0];
-  } else if (objects.size() == 2) {
-    left = objects[0];
-    right = objects[1];
-    left->bounding_box(time0, time1, box);
-    aabb right_box;
-    right->bounding_box(time0, time1, right_box);
-    box = box.surrounding(right_box);
+split evaluate_spatial_bins(const spatial_bin_set& bins, const aabb& bounds) {
+  split best;
+  const real_t area = bounds.surface_area();
+  for (int axis = 0; axis < 3; ++axis) {
+    std::array<real_t, bin_count> right_area;
+    std::array<size_t, bin_count> right_count;
+    aabb acc = aabb::empty();
+    size_t count = 0;
+    for (size_t b = bin_count - 1; b > 0; --b) {
+      acc = acc.surrounding(bins[axis][b].box);
+      count += bins[axis][b].exits;
+      right_area[b] = acc.surface_area();
+      right_count[b] = count;
+    }
+    acc = aabb::empty();
+    count = 0;
+    for (size_t b = 0; b < bin_count - 1; ++b) {
+      acc = acc.surrounding(bins[axis][b].box);
+      count += bins[axis][b].entries;
+      if (count == 0 || right_count[b + 1] == 0)
+        continue;
+      real_t cost = traversal_cost + intersection_cost *
+                                       (acc.surface_area() * count +
+                                        right_area[b + 1] * right_count[b + 1]) /
+                                       area;
+      if (cost < best.cost) {
+        best.axis = axis;
+        best.bin = b;
+        best.cost = cost;
+      }
+    }
+  }
+  return best;
+}
+
+struct builder {
+  const object_list& objects;
+  std::vector<build_ref>& refs;
+  size_t max_leaf_size;
+  thread_pool* pool;
+  // References that spatial splits may still add. Shared by all tasks.
+  std::atomic<int64_t> split_budget{0};
+  real_t root_area = 0;
+  // The nodes are made in one arena per thread, as arenas are not
+  // thread-safe, and nodes made by the same task end up next to each other.
+  const uint64_t build_id = next_build_id++;
+  std::vector<std::unique_ptr<arena>> arenas;
+  std::mutex arenas_mutex;
+
+  arena& local_arena() {
+    thread_local uint64_t arena_build_id = 0;
+    thread_local arena* local = nullptr;
+    if (arena_build_id != build_id) {
+      std::lock_guard lock(arenas_mutex);
+      arenas.push_back(std::make_unique<arena>(node_block_size));
+      local = arenas.back().get();
+      arena_build_id = build_id;
+    }
+    return *local;
+  }
+
+  template <typename... Args>
+  std::shared_ptr<bvh_node> make_node(Args&&... args) {
+    return local_arena().make<bvh_node>(std::forward<Args>(args)...);
+  }
+
+  // Decides between a leaf and a split for the range, and partitions the
+  // references around the split. With parallel set, large ranges are binned
+  // on the pool; that waits for the pool, so only the calling thread may ask
+  // for it.
+  range_split split_range(size_t begin, size_t end, size_t depth,
+                          bool parallel) {
+    const size_t count = end - begin;
+    parallel = parallel && pool && count >= parallel_bin_threshold;
+    const size_t chunks = (count + parallel_bin_chunk - 1) / parallel_bin_chunk;
+
+    range_bounds rb;
+    if (parallel) {
+      std::vector<range_bounds> chunk_bounds(chunks);
+      for_each_chunk(begin, end, [&](size_t c, size_t cb, size_t ce) {
+        chunk_bounds[c] = compute_bounds(refs, cb, ce);
+      });
+      for (const auto& b : chunk_bounds)
+        rb.merge(b);
+    } else {
+      rb = compute_bounds(refs, begin, end);
+    }
+
+    range_split rs;
+    rs.bounds = rb.bounds;
+    if (count == 1) {
+      rs.leaf = true;
+      return rs;
+    }
+
+    split best;
+    if (depth < max_sah_depth) {
+      bin_set bins;
+      if (parallel) {
+        std::vector<bin_set> chunk_bins(chunks);
+        for_each_chunk(begin, end, [&](size_t c, size_t cb, size_t ce) {
+          fill_bins(refs, cb, ce, rb.centroid_bounds, chunk_bins[c]);
+        });
+        for (const auto& cbins : chunk_bins) {
+          for (int axis = 0; axis < 3; ++axis) {
+            for (size_t b = 0; b < bin_count; ++b) {
+              auto& dst = bins[axis][b];
+              dst.box = dst.box.surrounding(cbins[axis][b].box);
+              dst.count += cbins[axis][b].count;
+            }
+          }
+        }
+      } else {
+        fill_bins(refs, begin, end, rb.centroid_bounds, bins);
+      }
+      best = evaluate_bins(bins, rb.bounds);
+    }
+    if (count <= max_leaf_size && intersection_cost * count <= best.cost) {
+      rs.leaf = true;
+      return rs;
+    }
+
+    const aabb& centroid_bounds = rb.centroid_bounds;
+    int axis = largest_axis(centroid_bounds);
+    size_t mid = begin;
+    if (best.axis != -1) {
+      axis = best.axis;
+      const real_t cmin = centroid_bounds.min[axis];
+      const real_t scale =
+        bin_count / (centroid_bounds.max[axis] - centroid_bounds.min[axis]);
+      auto it = std::partition(refs.begin() + begin, refs.begin() + end,
+                               [&](const build_ref& ref) {
+                                 return bin_index(ref, axis, cmin, scale) <=
+                                        best.bin;
+                               });
+      mid = it - refs.begin();
+    }
+    // No SAH split was found (all centroids coincide, or we are too deep), or
+    // the partition degenerated; the leaf is too big, so split at the median.
+    if (mid == begin || mid == end) {
+      mid = begin + count / 2;
+      std::nth_element(refs.begin() + begin, refs.begin() + mid,
+                       refs.begin() + end,
+                       [axis](const build_ref& a, const build_ref& b) {
+                         return a.centroid[axis] < b.centroid[axis];
+                       });
+    }
+    rs.mid = mid;
+    rs.axis = axis;
+    return rs;
+  }
+
+  // Runs f(chunk, begin, end) for every chunk of the range on the pool and
+  // waits for all of them.
+  template <typename F>
+  void for_each_chunk(size_t begin, size_t end, F&& f) {
+    size_t c = 0;
+    for (size_t cb = begin; cb < end; cb += parallel_bin_chunk, ++c) {
+      size_t ce = std::min(cb + parallel_bin_chunk, end);
+      pool->enqueue([&f, c, cb, ce]() { f(c, cb, ce); });
+    }
+    pool->wait();
+  }
+
+  std::shared_ptr<bvh_node> make_leaf(size_t begin, size_t end,
+                                      const aabb& bounds) {
+    object_list leaf_objects;
+    leaf_objects.reserve(end - begin);
+    for (size_t i = begin; i < end; ++i)
+      leaf_objects.push_back(objects[refs[i].index]);
+    return make_node(std::move(leaf_objects), bounds);
+  }
+
+  std::shared_ptr<bvh_node> build(size_t begin, size_t end, size_t depth) {
+    auto rs = split_range(begin, end, depth, false);
+    if (rs.leaf)
+      return make_leaf(begin, end, rs.bounds);
+    auto left = build(begin, rs.mid, depth + 1);
+    auto right = build(rs.mid, end, depth + 1);
+    return make_node(std::move(left), std::move(right), rs.bounds, rs.axis);
+  }
+
+  // Builds the subtree on a worker. Large children are handed to other
+  // workers instead of being waited for; they fill in their slot when done.
+  void build_task(size_t begin, size_t end, size_t depth,
+                  std::shared_ptr<bvh_node>& slot) {
+    if (end - begin < task_threshold) {
+      slot = build(begin, end, depth);
+      return;
+    }
+    auto rs = split_range(begin, end, depth, false);
+    if (rs.leaf) {
+      slot = make_leaf(begin, end, rs.bounds);
+      return;
+    }
+    slot = make_node(nullptr, nullptr, rs.bounds, rs.axis);
+    enqueue_task(begin, rs.mid, depth + 1, slot->left);
+    enqueue_task(rs.mid, end, depth + 1, slot->right);
+  }
+
+  void enqueue_task(size_t begin, size_t end, size_t depth,
+                    std::shared_ptr<bvh_node>& slot) {
+    pool->enqueue([this, begin, end, depth, &slot]() {
+      build_task(begin, end, depth, slot);
+    });
+  }
+
+  struct pending_range {
+    size_t begin, end, depth;
+    std::shared_ptr<bvh_node>* slot;
+  };
+
+  // Splits the top levels on the calling thread, binning on the pool. The
+  // smaller ranges are only collected, and become tasks once nothing needs
+  // to wait on the pool anymore.
+  void build_top(size_t begin, size_t end, size_t depth,
+                 std::shared_ptr<bvh_node>& slot,
+                 std::vector<pending_range>& pending) {
+    if (end - begin < parallel_bin_threshold) {
+      pending.push_back({begin, end, depth, &slot});
+      return;
+    }
+    auto rs = split_range(begin, end, depth, true);
+    if (rs.leaf) {
+      slot = make_leaf(begin, end, rs.bounds);
+      return;
+    }
+    slot = make_node(nullptr, nullptr, rs.bounds, rs.axis);
+    build_top(begin, rs.mid, depth + 1, slot->left, pending);
+    build_top(rs.mid, end, depth + 1, slot->right, pending);
+  }
+
+  // Splits a node of the spatial split build. The references are moved into
+  // left and right; references straddling a spatial split go to both sides,
+  // clipped to the split plane.
+  range_split split_spatial(std::vector<build_ref>& node_refs, size_t depth,
+                            std::vector<build_ref>& left,
+                            std::vector<build_ref>& right) {
+    const size_t count = node_refs.size();
+    const auto rb = compute_bounds(node_refs, 0, count);
+    range_split rs;
+    rs.bounds = rb.bounds;
+    if (count == 1) {
+      rs.leaf = true;
+      return rs;
+    }
+
+    split best;
+    split spatial;
+    if (depth < max_sah_depth) {
+      bin_set bins;
+      fill_bins(node_refs, 0, count, rb.centroid_bounds, bins);
+      best = evaluate_bins(bins, rb.bounds);
+      // Only worth trying where the object split leaves the children
+      // overlapping.
+      real_t overlap = rb.bounds.surface_area();
+      if (best.axis != -1) {
+        auto [l, r] = split_bounds(bins, best);
+        auto both = l.intersect(r);
+        overlap = both.is_empty() ? 0 : both.surface_area();
+      }
+      if (split_budget.load(std::memory_order_relaxed) > 0 &&
+          overlap > spatial_split_overlap * root_area) {
+        spatial_bin_set spatial_bins;
+        fill_spatial_bins(node_refs, rb.bounds, spatial_bins);
+        spatial = evaluate_spatial_bins(spatial_bins, rb.bounds);
+      }
+    }
+    if (count <= max_leaf_size &&
+        intersection_cost * count <= std::min(best.cost, spatial.cost)) {
+      rs.leaf = true;
+      return rs;
+    }
+
+    if (spatial.axis != -1 && spatial.cost < best.cost) {
+      const int axis = spatial.axis;
+      const spatial_grid grid(rb.bounds, axis);
+      const real_t plane = grid.plane(spatial.bin);
+      size_t straddling = 0;
+      for (const auto& ref : node_refs) {
+        straddling += grid.bin(ref.box.min[axis]) <= spatial.bin &&
+                      grid.bin(ref.box.max[axis]) > spatial.bin;
+      }
+      const auto extra = static_cast<int64_t>(straddling);
+      if (split_budget.fetch_sub(extra) >= extra) {
+        for (const auto& ref : node_refs) {
+          bool in_left = grid.bin(ref.box.min[axis]) <= spatial.bin;
+          bool in_right = grid.bin(ref.box.max[axis]) > spatial.bin;
+          if (in_left && in_right) {
+            aabb l = clip(ref.box, axis, -INFINITY, plane);
+            aabb r = clip(ref.box, axis, plane, INFINITY);
+            left.push_back({l, l.centroid(), ref.index});
+            right.push_back({r, r.centroid(), ref.index});
+          } else {
+            (in_left ? left : right).push_back(ref);
+          }
+        }
+        node_refs = {};
+        rs.axis = axis;
+        return rs;
+      }
+      split_budget.fetch_add(extra);
+    }
+
+    // Object split, with the same fallback to the median as split_range.
+    const aabb& centroid_bounds = rb.centroid_bounds;
+    int axis = largest_axis(centroid_bounds);
+    auto mid = node_refs.begin();
+    if (best.axis != -1) {
+      axis = best.axis;
+      const real_t cmin = centroid_bounds.min[axis];
+      const real_t scale =
+        bin_count / (centroid_bounds.max[axis] - centroid_bounds.min[axis]);
+      mid = std::partition(node_refs.begin(), node_refs.end(),
+                           [&](const build_ref& ref) {
+                             return bin_index(ref, axis, cmin, scale) <=
+                                    best.bin;
+                           });
+    }
+    if (mid == node_refs.begin() || mid == node_refs.end()) {
+      mid = node_refs.begin() + count / 2;
+      std::nth_element(node_refs.begin(), mid, node_refs.end(),
+                       [axis](const build_ref& a, const build_ref& b) {
+                         return a.centroid[axis] < b.centroid[axis];
+                       });
+    }
+    left.assign(node_refs.begin(), mid);
+    right.assign(mid, node_refs.end());
+    node_refs = {};
+    rs.axis = axis;
+    return rs;
+  }
+
+  std::shared_ptr<bvh_node> make_leaf(const std::vector<build_ref>& node_refs,
+                                      const aabb& bounds) {
+    object_list leaf_objects;
+    leaf_objects.reserve(node_refs.size());
+    for (const auto& ref : node_refs)
+      leaf_objects.push_back(objects[ref.index]);
+    return make_node(std::move(leaf_objects), bounds);
+  }
+
+  // Builds a subtree of the spatial split build. With a pool, large children
+  // become tasks that fill in their slot when done.
+  void build_spatial(std::vector<build_ref> node_refs, size_t depth,
+                     std::shared_ptr<bvh_node>& slot) {
+    std::vector<build_ref> left, right;
+    auto rs = split_spatial(node_refs, depth, left, right);
+    if (rs.leaf) {
+      slot = make_leaf(node_refs, rs.bounds);
+      return;
+    }
+    slot = make_node(nullptr, nullptr, rs.bounds, rs.axis);
+    build_spatial_child(std::move(left), depth + 1, slot->left);
+    build_spatial_child(std::move(right), depth + 1, slot->right);
+  }
+
+  void build_spatial_child(std::vector<build_ref> node_refs, size_t depth,
+                           std::shared_ptr<bvh_node>& slot) {
+    if (!pool || node_refs.size() < task_threshold) {
+      build_spatial(std::move(node_refs), depth, slot);
+      return;
+    }
+    pool->enqueue([this, node_refs = std::move(node_refs), depth,
+                   &slot]() mutable {
+      build_spatial(std::move(node_refs), depth, slot);
+    });
+  }
+
+  std::shared_ptr<bvh_node> build_parallel() {
+    std::shared_ptr<bvh_node> root;
+    std::vector<pending_range> pending;
+    build_top(0, refs.size(), 0, root, pending);
+    for (const auto& p : pending) {
+      enqueue_task(p.begin, p.end, p.depth, *p.slot);
+    }
+    pool->wait();
+    return root;
+  }
+};
+
+real_t node_cost(const bvh_node& node, real_t traversal_cost,
+                 real_t intersection_cost) {
+  real_t area = node.box.surface_area();
+  if (node.is_leaf())
+    return area * intersection_cost * node.objects.size();
+  return area * traversal_cost +
+         node_cost(*node.left, traversal_cost, intersection_cost) +
+         node_cost(*node.right, traversal_cost, intersection_cost);
+}
+
+}  // namespace
+
+std::shared_ptr<bvh_node> bvh_node::build(
+  const std::vector<std::shared_ptr<hittable>>& objects, real_t time0,
+  real_t time1, size_t max_leaf_size, thread_pool* pool,
+  real_t spatial_split_budget) {
+  std::vector<build_ref> refs;
+  refs.reserve(objects.size());
+  for (size_t i = 0; i < objects.size(); ++i) {
+    aabb box;
+    if (!objects[i]->bounding_box(time0, time1, box))
+      continue;
+    refs.push_back({box, box.centroid(), i});
+  }
+
+  if (refs.empty())
+    return std::make_shared<bvh_node>(std::vector<std::shared_ptr<hittable>>{},
+                                      aabb::empty());
+
+  builder b{objects, refs, std::max<size_t>(max_leaf_size, 1), pool};
+  // The returned pointer keeps the node arenas alive. Members are destroyed
+  // in reverse order, so the nodes go before their memory.
+  struct node_tree {
+    std::vector<std::unique_ptr<arena>> arenas;
+    std::shared_ptr<bvh_node> root;
+  };
+  auto tree = std::make_shared<node_tree>();
+  if (spatial_split_budget > 0) {
+    b.split_budget = static_cast<int64_t>(spatial_split_budget * refs.size());
+    b.root_area = compute_bounds(refs, 0, refs.size()).bounds.surface_area();
+    b.build_spatial(std::move(refs), 0, tree->root);
+    if (pool)
+      pool->wait();
+  } else if (pool && refs.size() >= task_threshold) {
+    tree->root = b.build_parallel();
   } else {
-    std::cerr << "bvh_node::bvh_node: objects.size() = " << objects.size()
-              << std::endl;
+    tree->root = b.build(0, refs.size(), 0);
   }
-  return std::make_shared<bvh_node>(left, right, box);
+  tree->arenas = std::move(b.arenas);
+  return std::shared_ptr<bvh_node>(tree, tree->root.get());
+}
+
+real_t bvh_node::sah_cost(real_t traversal_cost,
+                          real_t intersection_cost) const {
+  real_t area = box.surface_area();
+  if (area <= 0)
+    return intersection_cost * objects.size();
+  return node_cost(*this, traversal_cost, intersection_cost) / area;
 }
 
 bool bvh_node::bounding_box(real_t time0, real_t time1,
                             aabb& output_box) const {
   output_box = box;
-  return true;
+  return !box.is_empty();
 }
 
 bool bvh_node::hit(const ray& r, real_t t_min, real_t t_max,
@@ -72,12 +670,33 @@ bool bvh_node::hit(const ray& r, real_t t_min, real_t t_max,
   if (!box.hit(r, t_min, t_max))
     return false;
 
-  bool hit_left = false;
-  bool hit_right = false;
-  if (left)
-    hit_left = left->hit(r, t_min, t_max, rec);
-  if (right)
-    hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+  if (is_leaf()) {
+    bool hit_anything = false;
+    for (const auto& obj : objects) {
+      if (obj->hit(r, t_min, t_max, rec)) {
+        hit_anything = true;
+        t_max = rec.t;
+      }
+    }
+    return hit_anything;
+  }
+
+  bool hit_left = left->hit(r, t_min, t_max, rec);
+  bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
 
   return hit_left || hit_right;
 }
+
+bool bvh_node::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  if (!box.hit(r, t_min, t_max))
+    return false;
+
+  if (is_leaf()) {
+    for (const auto& obj : objects) {
+      if (obj->occluded(r, t_min, t_max))
+        return true;
+    }
+    return false;
+  }
+  return left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max);
+}
@@ -4,33 +4,56 @@
 
 struct bvh_node : hittable {
 
-  // Modifies the objects vector with the new tree. If the object's bounding box
-  // can not be computed, then it is not included in the tree, but it'll still
-  // be available in the objects vector.
+  // Builds the tree with a binned surface area heuristic. Objects whose
+  // bounding box can not be computed are not included in the tree; the caller
+  // is expected to intersect them separately. Leaves hold at most
+  // max_leaf_size objects. With a started pool, the top levels are binned in
+  // parallel and independent subtrees are built as separate tasks; the pool
+  // must not be running anything else.
+  //
+  // A positive spatial_split_budget enables spatial splits (SBVH): where
+  // siblings would overlap, the builder may instead split space and put
+  // objects crossing the plane into both children, clipped to their side.
+  // The budget caps the added references as a fraction of the object count.
+  // Objects then appear in more than one leaf.
+  //
+  // The nodes are made in per-thread arenas owned by the returned root, so
+  // subtrees must not be kept past it.
   static std::shared_ptr<bvh_node> build(
-    std::vector<std::shared_ptr<hittable>>& objects, real_t time0,
-    real_t time1);
+    const std::vector<std::shared_ptr<hittable>>& objects, real_t time0,
+    real_t time1, size_t max_leaf_size = 4, class thread_pool* pool = nullptr,
+    real_t spatial_split_budget = 0);
 
-  bvh_node(std::shared_ptr<hittable> left, std::shared_ptr<hittable> right,
-           const aabb& box)
-      : left(left), right(right), box(box) {}
+  // Leaf node
+  bvh_node(std::vector<std::shared_ptr<hittable>> objects, const aabb& box)
+      : objects(std::move(objects)), box(box) {}
+
+  // Interior node
+  bvh_node(std::shared_ptr<bvh_node> left, std::shared_ptr<bvh_node> right,
+           const aabb& box, int axis)
+      : left(std::move(left)), right(std::move(right)), box(box), axis(axis) {}
 
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const override;
 
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
   virtual bool bounding_box(real_t time0, real_t time1,
                             aabb& output_box) const override;
 
   bvh_node* as_bvh_node() override { return this; }
 
-  bool is_leaf()
-    const {  // If any is null, or none of them is bvh_node, then it's a leaf.
-    if (!left || !right)
-      return true;
-    return !left->as_bvh_node() && !right->as_bvh_node();
-  }
+  bool is_leaf() const { return !left && !right; }
+
+  // Expected cost of a random ray hitting the root, in units of one
+  // primitive intersection. Lower is better.
+  real_t sah_cost(real_t traversal_cost = 1.0,
+                  real_t intersection_cost = 1.0) const;
 
-  std::shared_ptr<hittable> left;
-  std::shared_ptr<hittable> right;
+  std::shared_ptr<bvh_node> left;
+  std::shared_ptr<bvh_node> right;
+  std::vector<std::shared_ptr<hittable>> objects;  // Only set for leaves
   aabb box;
+  int axis = 0;  // Split axis of interior nodes
 };
@@ -0,0 +1,234 @@
+#include "bvh_cache.h"
+
+#include "binary_file.h"
+#include "linear_bvh.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <unordered_map>
+
+namespace {
+
+// Bump whenever the file layout or the builder output changes.
+constexpr uint32_t cache_version = 1;
+constexpr char cache_magic[8] = {'R', 'T', 'I', 'O', 'W', 'B', 'V', 'H'};
+
+struct cache_header {
+  binary_file_header file;
+  uint64_t key;
+  uint64_t node_count;
+  uint64_t prim_count;
+  uint64_t motion_count;
+  double motion_time0;
+  double motion_time1;
+  uint64_t checksum;  // Of everything after the header
+};
+
+static_assert(sizeof(cache_header) % 8 == 0, "keep the arrays aligned");
+
+// FNV-1a over 64-bit words, with the tail folded in byte by byte.
+struct hasher {
+  uint64_t h = 0xcbf29ce484222325ull;
+
+  void add(const void* data, size_t size) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      uint64_t word;
+      std::memcpy(&word, bytes + i, 8);
+      h = (h ^ word) * 0x100000001b3ull;
+    }
+    for (; i < size; ++i) {
+      h = (h ^ bytes[i]) * 0x100000001b3ull;
+    }
+  }
+
+  template <typename T>
+  void add(const T& value) {
+    add(&value, sizeof(T));
+  }
+
+  void add(const aabb& box) {
+    for (int a = 0; a < 3; ++a) {
+      add(box.min[a]);
+      add(box.max[a]);
+    }
+  }
+};
+
+// The arrays stored after the header, in file order.
+struct cache_sections {
+  const linear_bvh_node* nodes;
+  const uint32_t* prims;
+  const linear_bvh_motion* motion;
+  size_t size;  // Total bytes, header included
+};
+
+cache_sections sections(const cache_header& header, const uint8_t* base) {
+  cache_sections s;
+  size_t offset = sizeof(cache_header);
+  s.nodes = reinterpret_cast<const linear_bvh_node*>(base + offset);
+  offset += header.node_count * sizeof(linear_bvh_node);
+  s.motion = reinterpret_cast<const linear_bvh_motion*>(base + offset);
+  offset += header.motion_count * sizeof(linear_bvh_motion);
+  s.prims = reinterpret_cast<const uint32_t*>(base + offset);
+  offset += header.prim_count * sizeof(uint32_t);
+  s.size = offset;
+  return s;
+}
+
+}  // namespace
+
+uint64_t bvh_cache_key(const std::vector<std::shared_ptr<hittable>>& objects,
+                       real_t time0, real_t time1, size_t max_leaf_size,
+                       real_t spatial_split_budget) {
+  hasher h;
+  h.add(cache_version);
+  h.add(static_cast<uint64_t>(objects.size()));
+  h.add(static_cast<uint64_t>(max_leaf_size));
+  h.add(time0);
+  h.add(time1);
+  h.add(spatial_split_budget);
+  for (const auto& obj : objects) {
+    // The motion bounds use the boxes at both ends of the interval.
+    aabb box, box0, box1;
+    obj->bounding_box(time0, time1, box);
+    obj->bounding_box(time0, time0, box0);
+    obj->bounding_box(time1, time1, box1);
+    h.add(box);
+    h.add(box0);
+    h.add(box1);
+  }
+  return h.h;
+}
+
+std::string bvh_cache_path(const std::string& dir, uint64_t key) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.bvh",
+                static_cast<unsigned long long>(key));
+  return (std::filesystem::path(dir) / name).string();
+}
+
+std::shared_ptr<linear_bvh> load_bvh_cache(
+  const std::string& path, uint64_t key,
+  const std::vector<std::shared_ptr<hittable>>& objects) {
+  auto file = mapped_file::open(path);
+  cache_header header;
+  if (!file || !read_file_header(*file, cache_magic, cache_version, header) ||
+      header.key != key ||
+      !counts_fit(file->size, {header.node_count, header.prim_count,
+                               header.motion_count}))
+    return nullptr;
+  const auto s = sections(header, file->data);
+  if (s.size != file->size)
+    return nullptr;
+
+  hasher h;
+  h.add(file->data + sizeof(cache_header), s.size - sizeof(cache_header));
+  if (h.h != header.checksum)
+    return nullptr;
+
+  auto bvh = std::make_shared<linear_bvh>();
+  bvh->nodes.assign(s.nodes, s.nodes + header.node_count);
+  bvh->motion.assign(s.motion, s.motion + header.motion_count);
+  bvh->motion_time0 = header.motion_time0;
+  bvh->motion_time1 = header.motion_time1;
+  bvh->prims.resize(header.prim_count);
+  for (size_t i = 0; i < header.prim_count; ++i) {
+    if (s.prims[i] >= objects.size())
+      return nullptr;
+    bvh->prims[i] = objects[s.prims[i]].get();
+  }
+  // The checksum catches damage, not a file written to pass it; a bad link
+  // or a tree deeper than the traversal stack must not get through.
+  if (!bvh->valid(bvh->prims.size()))
+    return nullptr;
+  std::error_code ec;
+  std::filesystem::last_write_time(
+    path, std::filesystem::file_time_type::clock::now(), ec);
+  return bvh;
+}
+
+bool save_bvh_cache(const std::string& path, uint64_t key,
+                    const linear_bvh& bvh,
+                    const std::vector<std::shared_ptr<hittable>>& objects) {
+  std::unordered_map<const hittable*, uint32_t> index;
+  index.reserve(objects.size());
+  for (size_t i = 0; i < objects.size(); ++i) {
+    index.emplace(objects[i].get(), static_cast<uint32_t>(i));
+  }
+  std::vector<uint32_t> prims;
+  prims.reserve(bvh.prims.size());
+  for (const auto* prim : bvh.prims) {
+    auto it = index.find(prim);
+    if (it == index.end())
+      return false;
+    prims.push_back(it->second);
+  }
+
+  const size_t node_bytes = bvh.nodes.size() * sizeof(linear_bvh_node);
+  const size_t motion_bytes = bvh.motion.size() * sizeof(linear_bvh_motion);
+  const size_t prim_bytes = prims.size() * sizeof(uint32_t);
+
+  cache_header header = {};
+  header.file = make_file_header(cache_magic, cache_version);
+  header.key = key;
+  header.node_count = bvh.nodes.size();
+  header.prim_count = prims.size();
+  header.motion_count = bvh.motion.size();
+  header.motion_time0 = bvh.motion_time0;
+  header.motion_time1 = bvh.motion_time1;
+  // Hash the sections as one stream, the same way load sees them.
+  std::vector<uint8_t> payload(node_bytes + motion_bytes + prim_bytes);
+  std::memcpy(payload.data(), bvh.nodes.data(), node_bytes);
+  std::memcpy(payload.data() + node_bytes, bvh.motion.data(), motion_bytes);
+  std::memcpy(payload.data() + node_bytes + motion_bytes, prims.data(),
+              prim_bytes);
+  hasher h;
+  h.add(payload.data(), payload.size());
+  header.checksum = h.h;
+
+  std::error_code ec;
+  std::filesystem::path target(path);
+  if (target.has_parent_path())
+    std::filesystem::create_directories(target.parent_path(), ec);
+  return write_file_atomically(path, [&](std::ostream& out) {
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+  });
+}
+
+void trim_bvh_cache(const std::string& dir, uint64_t max_bytes) {
+  struct entry {
+    std::filesystem::path path;
+    std::filesystem::file_time_type time;
+    uint64_t size;
+  };
+  std::vector<entry> files;
+  uint64_t total = 0;
+  std::error_code ec;
+  for (std::filesystem::directory_iterator it(dir, ec), end;
+       !ec && it != end; it.increment(ec)) {
+    if (it->path().extension() != ".bvh")
+      continue;
+    std::error_code size_ec, time_ec;
+    const uint64_t size = it->file_size(size_ec);
+    const auto time = it->last_write_time(time_ec);
+    if (size_ec || time_ec)
+      continue;
+    files.push_back({it->path(), time, size});
+    total += size;
+  }
+  std::sort(files.begin(), files.end(), [](const entry& a, const entry& b) {
+    return a.time < b.time;
+  });
+  for (const auto& f : files) {
+    if (total <= max_bytes)
+      break;
+    if (std::filesystem::remove(f.path, ec))
+      total -= f.size;
+  }
+}
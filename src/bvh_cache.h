@@ -0,0 +1,38 @@
+#pragma once
+
+#include "object.h"
+
+// stl
+#include <cstdint>
+#include <string>
+
+// On-disk cache of compiled BVHs. A file holds the linear_bvh node arrays and
+// the primitive order as indices into the object list it was built from, and
+// is named after a hash of everything the build depends on: the object bounds,
+// the shutter interval and the build settings. Loading maps the file and
+// copies the arrays out in bulk; only the primitive indices have to be
+// resolved.
+
+// Hash of the inputs of bvh_node::build for these objects.
+uint64_t bvh_cache_key(const std::vector<std::shared_ptr<hittable>>& objects,
+                       real_t time0, real_t time1, size_t max_leaf_size,
+                       real_t spatial_split_budget);
+
+std::string bvh_cache_path(const std::string& dir, uint64_t key);
+
+// Returns nullptr if the file is missing, was written for other objects, or
+// fails validation, which includes trees deeper than linear_bvh::max_depth.
+// A file that is loaded counts as just used for trim_bvh_cache().
+std::shared_ptr<struct linear_bvh> load_bvh_cache(
+  const std::string& path, uint64_t key,
+  const std::vector<std::shared_ptr<hittable>>& objects);
+
+// Writes to a temporary file first, so that a crash never leaves a truncated
+// cache behind.
+bool save_bvh_cache(const std::string& path, uint64_t key,
+                    const struct linear_bvh& bvh,
+                    const std::vector<std::shared_ptr<hittable>>& objects);
+
+// Deletes the least recently used cache files in dir until the rest take at
+// most max_bytes.
+void trim_bvh_cache(const std::string& dir, uint64_t max_bytes);
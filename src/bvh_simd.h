@@ -0,0 +1,35 @@
+#pragma once
+
+// Helpers shared by the SIMD traversal of the wide and quantized BVHs.
+
+#include "ray.h"
+
+// stl
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RTIOW_SSE
+#include <immintrin.h>
+#endif
+
+// The ray in single precision, with the near and far planes of every axis
+// picked once from the direction signs.
+struct float_ray {
+  explicit float_ray(const ray& r) {
+    for (int a = 0; a < 3; ++a) {
+      org[a] = static_cast<float>(r.origin()[a]);
+      inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+      negative[a] = inv_dir[a] < 0;
+    }
+  }
+
+  float org[3];
+  float inv_dir[3];
+  bool negative[3];
+};
+
+// Widens the far distance by a few ulps to absorb the rounding of the float
+// slab test, so that rays grazing a box are not lost.
+constexpr float robust_scale =
+  1.0f + 4.0f * std::numeric_limits<float>::epsilon();
@@ -8,6 +8,8 @@
 #define M_PI 3.14159265358979323846
 #endif
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <random>
 
@@ -46,3 +48,29 @@ inline real_t clamp(real_t x, real_t min, real_t max) {
 inline real_t lerp(real_t t, real_t a, real_t b) {
   return (1.0 - t) * a + t * b;
 }
+
+// Nearest float that is not greater (float_down) or not smaller (float_up)
+// than x, for storing bounds in single precision without shrinking them.
+// The step to the neighbouring float is done on the bits; std::nextafter is
+// a library call and BVH builds round millions of bounds.
+inline float float_down(real_t x) {
+  float f = static_cast<float>(x);
+  if (!(f > x))
+    return f;
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(f));
+  bits = f > 0 ? bits - 1 : f < 0 ? bits + 1 : 0x80000001u;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+inline float float_up(real_t x) {
+  float f = static_cast<float>(x);
+  if (!(f < x))
+    return f;
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(f));
+  bits = f > 0 ? bits + 1 : f < 0 ? bits - 1 : 1u;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
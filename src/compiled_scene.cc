@@ -0,0 +1,132 @@
+#include "compiled_scene.h"
+
+compiled_scene::compiled_scene(const linear_bvh& source) { refit(source); }
+
+void compiled_scene::refit(const linear_bvh& source) {
+  spheres.clear();
+  moving_spheres.clear();
+  quads.clear();
+  boxes.clear();
+  others.clear();
+  ids.clear();
+  ids.reserve(source.prims.size());
+  for (const hittable* prim : source.prims)
+    ids.push_back(prim->compile(*this));
+  bvh.nodes = source.nodes;
+  bvh.motion = source.motion;
+  bvh.motion_time0 = source.motion_time0;
+  bvh.motion_time1 = source.motion_time1;
+}
+
+bool compiled_scene::hit(const ray& r, real_t t_min, real_t t_max,
+                         hit_record& rec) const {
+  auto leaf_hit = [&](uint32_t first, uint32_t count, real_t& t_far) {
+    bool hit_anything = false;
+    for (uint32_t i = first; i < first + count; ++i) {
+      const uint32_t id = ids[i];
+      const uint32_t index = id & index_mask;
+      real_t t, alpha, beta;
+      switch (id >> type_shift) {
+        case sphere_type:
+          if (!spheres[index].shape.intersect(r, t_min, t_far, t))
+            continue;
+          break;
+        case moving_sphere_type:
+          if (!moving_spheres[index].shape.intersect(r, t_min, t_far, t))
+            continue;
+          break;
+        case quad_type:
+          if (!quads[index].shape.intersect(r, t_min, t_far, t, alpha, beta))
+            continue;
+          rec.u = alpha;
+          rec.v = beta;
+          break;
+        case box_type:
+          if (!boxes[index].shape.intersect(r, t_min, t_far, t))
+            continue;
+          break;
+        default:
+          // Records its own hit, to be finished by itself.
+          if (others[index]->hit(r, t_min, t_far, rec)) {
+            hit_anything = true;
+            t_far = rec.t;
+          }
+          continue;
+      }
+      hit_anything = true;
+      t_far = rec.t = t;
+      rec.object = this;
+      rec.prim = id;
+    }
+    return hit_anything;
+  };
+  return bvh.traverse(r, t_min, t_max, leaf_hit);
+}
+
+bool compiled_scene::occluded(const ray& r, real_t t_min,
+                              real_t t_max) const {
+  auto leaf_hit = [&](uint32_t first, uint32_t count, real_t& t_far) {
+    for (uint32_t i = first; i < first + count; ++i) {
+      const uint32_t id = ids[i];
+      const uint32_t index = id & index_mask;
+      real_t t, alpha, beta;
+      bool hit = false;
+      switch (id >> type_shift) {
+        case sphere_type:
+          hit = spheres[index].shape.intersect(r, t_min, t_far, t);
+          break;
+        case moving_sphere_type:
+          hit = moving_spheres[index].shape.intersect(r, t_min, t_far, t);
+          break;
+        case quad_type:
+          hit = quads[index].shape.intersect(r, t_min, t_far, t, alpha, beta);
+          break;
+        case box_type:
+          hit = boxes[index].shape.intersect(r, t_min, t_far, t);
+          break;
+        default:
+          hit = others[index]->occluded(r, t_min, t_far);
+          break;
+      }
+      if (hit)
+        return true;
+    }
+    return false;
+  };
+  return bvh.traverse<true>(r, t_min, t_max, leaf_hit);
+}
+
+void compiled_scene::finish_hit(const ray& r, hit_record& rec) const {
+  const uint32_t index = rec.prim & index_mask;
+  switch (rec.prim >> type_shift) {
+    case sphere_type:
+      spheres[index].shape.finish(r, rec);
+      rec.mat = spheres[index].mat;
+      break;
+    case moving_sphere_type:
+      moving_spheres[index].shape.finish(r, rec);
+      rec.mat = moving_spheres[index].mat;
+      break;
+    case quad_type:
+      quads[index].shape.finish(r, rec);
+      rec.mat = quads[index].mat;
+      break;
+    case box_type:
+      boxes[index].shape.finish(r, rec);
+      rec.mat = boxes[index].mat;
+      break;
+  }
+}
+
+bool compiled_scene::bounding_box(real_t time0, real_t time1,
+                                  aabb& output_box) const {
+  return bvh.bounding_box(time0, time1, output_box);
+}
+
+size_t compiled_scene::memory_usage() const {
+  return bvh.memory_usage() + ids.size() * sizeof(uint32_t) +
+         spheres.size() * sizeof(spheres[0]) +
+         moving_spheres.size() * sizeof(moving_spheres[0]) +
+         quads.size() * sizeof(quads[0]) + boxes.size() * sizeof(boxes[0]) +
+         others.size() * sizeof(others[0]);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "linear_bvh.h"
+#include "object.h"
+#include "shapes.h"
+
+// stl
+#include <cstdint>
+
+// The primitives of a BVH compiled into flat arrays, one per primitive type,
+// so that traversal touches no shared_ptr and makes no virtual call for them.
+// Leaves index a list of 32-bit ids, the type in the top bits and the index
+// into that type's array below, and the leaf test switches on the type.
+// Types without a compiled form (instances, meshes, sphere_soa) are kept as
+// pointers and called through hittable as before; they and the materials are
+// not owned and have to outlive the compiled_scene.
+struct compiled_scene : hittable {
+  enum prim_type : uint32_t {
+    sphere_type = 0,
+    moving_sphere_type,
+    quad_type,
+    box_type,
+    other_type
+  };
+  static constexpr uint32_t type_shift = 29;
+  static constexpr uint32_t index_mask = (1u << type_shift) - 1;
+
+  template <typename Shape>
+  struct prim {
+    Shape shape;
+    material* mat;
+  };
+
+  // Compiles the primitives of bvh and copies its nodes; the leaves of the
+  // copy index ids.
+  explicit compiled_scene(const linear_bvh& bvh);
+
+  // Compiles the moved primitives again and copies the refit nodes of bvh,
+  // reusing the arrays instead of allocating a new scene.
+  void refit(const linear_bvh& bvh);
+
+  uint32_t add(const sphere_shape& shape, material* mat) {
+    return add(spheres, sphere_type, shape, mat);
+  }
+  uint32_t add(const moving_sphere_shape& shape, material* mat) {
+    return add(moving_spheres, moving_sphere_type, shape, mat);
+  }
+  uint32_t add(const quad_shape& shape, material* mat) {
+    return add(quads, quad_type, shape, mat);
+  }
+  uint32_t add(const box_shape& shape, material* mat) {
+    return add(boxes, box_type, shape, mat);
+  }
+  uint32_t add(const hittable* other) {
+    others.push_back(other);
+    return make_id(other_type, others.size() - 1);
+  }
+
+  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
+                   hit_record& rec) const override;
+
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
+
+  virtual bool bounding_box(real_t time0, real_t time1,
+                            aabb& output_box) const override;
+
+  size_t memory_usage() const;
+
+  static uint32_t make_id(prim_type type, size_t index) {
+    return (static_cast<uint32_t>(type) << type_shift) |
+           static_cast<uint32_t>(index);
+  }
+
+  std::vector<prim<sphere_shape>> spheres;
+  std::vector<prim<moving_sphere_shape>> moving_spheres;
+  std::vector<prim<quad_shape>> quads;
+  std::vector<prim<box_shape>> boxes;
+  std::vector<const hittable*> others;
+  std::vector<uint32_t> ids;  // In leaf order
+  linear_bvh bvh;             // prims is empty; leaves index ids
+
+ protected:
+  template <typename Shape>
+  uint32_t add(std::vector<prim<Shape>>& prims, prim_type type,
+               const Shape& shape, material* mat) {
+    prims.push_back({shape, mat});
+    return make_id(type, prims.size() - 1);
+  }
+};
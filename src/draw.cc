@@ -3,6 +3,7 @@
 #include "aabb.h"
 #include "bvh.h"
 #include "camera.h"
+#include "linear_bvh.h"
 #include "ray_tracer.h"
 
 void draw_line(Image& dst, point3 start, point3 end, color color,
@@ -49,18 +50,22 @@ void draw_aabb(Image& img, const aabb& box, const ray_tracer& tracer,
   draw_line(img, points[3], points[7], c, tracer);
 }
 
-void draw_bvh(Image& img, bvh_node* root, const ray_tracer& tracer,
-              size_t level) {
+void draw_bvh_node(Image& img, const linear_bvh& bvh, uint32_t index,
+                   const ray_tracer& tracer, size_t level) {
   auto bvh_box_color = color(0, 1, 0) * (level + 1) / 10;
   color bvh_leaf_color(1, 0, 0);
-  while (root) {
-    if (root->is_leaf()) {
-      draw_aabb(img, root->box, tracer, bvh_leaf_color);
-    } else {
-      draw_aabb(img, root->box, tracer, bvh_box_color);
-      draw_bvh(img, root->left->as_bvh_node(), tracer, level + 1);
-      draw_bvh(img, root->right->as_bvh_node(), tracer, level + 1);
-    }
-    break;
+  const auto& node = bvh.nodes[index];
+  if (node.prim_count > 0) {
+    draw_aabb(img, node.box(), tracer, bvh_leaf_color);
+  } else {
+    draw_aabb(img, node.box(), tracer, bvh_box_color);
+    draw_bvh_node(img, bvh, index + 1, tracer, level + 1);
+    draw_bvh_node(img, bvh, node.second_child, tracer, level + 1);
+  }
+}
+
+void draw_bvh(Image& img, const linear_bvh& bvh, const ray_tracer& tracer) {
+  if (!bvh.nodes.empty()) {
+    draw_bvh_node(img, bvh, 0, tracer, 0);
   }
 }
@@ -28,5 +28,5 @@ inline void write_pixel(Image& image, size_t x, size_t y, const color& c) {
 
 void draw_aabb(Image& img, const struct aabb& box,
                const class ray_tracer& tracer, const color& c);
-void draw_bvh(Image& img, struct bvh_node* root, const ray_tracer& tracer,
-              size_t level);
+void draw_bvh(Image& img, const struct linear_bvh& bvh,
+              const ray_tracer& tracer);
@@ -0,0 +1,411 @@
+#include "lbvh.h"
+
+#include "linear_bvh.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+
+namespace {
+
+// Clusters are formed from the top bits of the codes, 4 per axis.
+constexpr int cluster_bits = 12;
+constexpr size_t chunk_size = 1 << 14;
+constexpr size_t radix_bits = 8;
+constexpr size_t radix_size = 1 << radix_bits;
+constexpr size_t bin_count = 16;
+// Past this depth the top levels are split at the cluster median.
+constexpr size_t max_sah_depth = 32;
+// Bound on the depth of the top levels: clusters have distinct prefixes, so
+// each Morton split takes at least one of their bits, and the median splits
+// after max_sah_depth halve at most 2^cluster_bits clusters. Treelets get the
+// rest of linear_bvh::max_depth.
+constexpr size_t max_top_depth = max_sah_depth + cluster_bits;
+
+struct morton_ref {
+  uint64_t code;
+  uint32_t index;  // Into the bounded objects
+};
+
+// Spreads the low 10 bits of v so that there are two zeros between each.
+uint64_t expand_bits_10(uint64_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x30000ff;
+  v = (v | (v << 8)) & 0x300f00f;
+  v = (v | (v << 4)) & 0x30c30c3;
+  v = (v | (v << 2)) & 0x9249249;
+  return v;
+}
+
+// Same for the low 21 bits.
+uint64_t expand_bits_21(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x1f00000000ffffull;
+  v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+  v = (v | (v << 8)) & 0x100f00f00f00f00full;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+  v = (v | (v << 2)) & 0x1249249249249249ull;
+  return v;
+}
+
+// Code of a point in [0, 1]^3, x in the most significant bit of each triple.
+uint64_t morton_code(const vec3& p, int bits) {
+  const int per_axis = bits / 3;
+  const real_t scale = static_cast<real_t>(1ull << per_axis);
+  uint64_t c[3];
+  for (int a = 0; a < 3; ++a) {
+    c[a] = static_cast<uint64_t>(std::clamp(p[a] * scale, 0.0, scale - 1));
+  }
+  if (per_axis == 10)
+    return (expand_bits_10(c[0]) << 2) | (expand_bits_10(c[1]) << 1) |
+           expand_bits_10(c[2]);
+  return (expand_bits_21(c[0]) << 2) | (expand_bits_21(c[1]) << 1) |
+         expand_bits_21(c[2]);
+}
+
+// Runs f(chunk, begin, end) over [0, n) in chunks, on the pool if there is
+// one, and waits for all of them.
+template <typename F>
+void for_each_chunk(thread_pool* pool, size_t n, F&& f) {
+  size_t c = 0;
+  for (size_t begin = 0; begin < n; begin += chunk_size, ++c) {
+    size_t end = std::min(begin + chunk_size, n);
+    if (pool) {
+      pool->enqueue([&f, c, begin, end]() { f(c, begin, end); });
+    } else {
+      f(c, begin, end);
+    }
+  }
+  if (pool)
+    pool->wait();
+}
+
+// LSD radix sort by code, 8 bits per pass. Each chunk counts its digits, the
+// counts are turned into per-chunk output offsets, and the chunks scatter in
+// parallel. Stable, so equal codes keep their object order.
+void radix_sort(std::vector<morton_ref>& refs, int bits, thread_pool* pool) {
+  const size_t n = refs.size();
+  const size_t chunks = (n + chunk_size - 1) / chunk_size;
+  std::vector<morton_ref> temp(n);
+  std::vector<std::array<size_t, radix_size>> offsets(chunks);
+  for (int shift = 0; shift < bits; shift += radix_bits) {
+    for_each_chunk(pool, n, [&](size_t c, size_t begin, size_t end) {
+      auto& count = offsets[c];
+      count.fill(0);
+      for (size_t i = begin; i < end; ++i) {
+        ++count[(refs[i].code >> shift) & (radix_size - 1)];
+      }
+    });
+    // Skip passes where every code has the same digit.
+    bool trivial = false;
+    size_t offset = 0;
+    for (size_t d = 0; d < radix_size; ++d) {
+      size_t total = 0;
+      for (size_t c = 0; c < chunks; ++c) {
+        size_t count = offsets[c][d];
+        offsets[c][d] = offset;
+        offset += count;
+        total += count;
+      }
+      trivial |= total == n;
+    }
+    if (trivial)
+      continue;
+    for_each_chunk(pool, n, [&](size_t c, size_t begin, size_t end) {
+      auto& next = offsets[c];
+      for (size_t i = begin; i < end; ++i) {
+        temp[next[(refs[i].code >> shift) & (radix_size - 1)]++] = refs[i];
+      }
+    });
+    refs.swap(temp);
+  }
+}
+
+// Axis of a code bit, with x in the most significant bit of each triple.
+int bit_axis(int bit) {
+  return 2 - bit % 3;
+}
+
+// Index of the first code in [begin, end) with the highest bit in which the
+// first and the last code differ set, or the middle if they are equal.
+template <typename Code>
+size_t morton_split(size_t begin, size_t end, Code code, int& axis) {
+  uint64_t diff = code(begin) ^ code(end - 1);
+  if (diff == 0) {
+    axis = 0;
+    return begin + (end - begin) / 2;
+  }
+  int bit = std::bit_width(diff) - 1;
+  axis = bit_axis(bit);
+  uint64_t mask = 1ull << bit;
+  // The codes are sorted, so the bit flips from 0 to 1 exactly once.
+  size_t lo = begin, hi = end - 1;
+  while (lo + 1 < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (code(mid) & mask) {
+      hi = mid;
+    } else {
+      lo = mid;
+    }
+  }
+  return hi;
+}
+
+struct cluster {
+  size_t begin, end;  // Range of the sorted references
+  uint64_t prefix;    // The top code bits shared by the range
+  std::vector<linear_bvh_node> nodes;  // Treelet, with local child indices
+  aabb box;
+  point3 centroid;
+};
+
+struct lbvh_builder {
+  const std::vector<morton_ref>& refs;
+  const std::vector<aabb>& boxes;
+  size_t max_leaf_size;
+  std::vector<linear_bvh_node>& nodes;
+
+  // Builds the treelet of a cluster depth first into its own node array.
+  uint32_t build_treelet(cluster& c, size_t begin, size_t end,
+                         size_t depth) const {
+    const auto index = static_cast<uint32_t>(c.nodes.size());
+    c.nodes.emplace_back();
+    c.nodes[index].pad = 0;
+    aabb box = aabb::empty();
+    // Each split takes a code bit or halves the range, so the depth limit is
+    // never reached in practice; past it the traversal stack would overflow.
+    if (end - begin <= max_leaf_size ||
+        depth + 1 >= linear_bvh::max_depth - max_top_depth) {
+      for (size_t i = begin; i < end; ++i) {
+        box = box.surrounding(boxes[refs[i].index]);
+      }
+      c.nodes[index].first_prim = static_cast<uint32_t>(begin);
+      c.nodes[index].prim_count = static_cast<uint16_t>(end - begin);
+      c.nodes[index].axis = 0;
+      c.nodes[index].set_box(box);
+      return index;
+    }
+    int axis;
+    size_t mid = morton_split(begin, end,
+                              [this](size_t i) { return refs[i].code; }, axis);
+    build_treelet(c, begin, mid, depth + 1);
+    uint32_t second = build_treelet(c, mid, end, depth + 1);
+    auto& node = c.nodes[index];
+    node.second_child = second;
+    node.prim_count = 0;
+    node.axis = static_cast<uint8_t>(axis);
+    node.set_box(c.nodes[index + 1].box().surrounding(c.nodes[second].box()));
+    return index;
+  }
+
+  // Appends a treelet to the output, moving its child indices.
+  uint32_t emit_cluster(const cluster& c) const {
+    const auto base = static_cast<uint32_t>(nodes.size());
+    for (auto node : c.nodes) {
+      if (node.prim_count == 0)
+        node.second_child += base;
+      nodes.push_back(node);
+    }
+    return base;
+  }
+
+  uint32_t emit_interior(uint32_t index, int axis) const {
+    auto& node = nodes[index];
+    node.prim_count = 0;
+    node.axis = static_cast<uint8_t>(axis);
+    node.pad = 0;
+    node.set_box(nodes[index + 1].box().surrounding(
+      nodes[node.second_child].box()));
+    return index;
+  }
+
+  // Top levels split by the cluster prefixes, like the treelets.
+  uint32_t emit_morton(const std::vector<cluster>& clusters, size_t begin,
+                       size_t end) const {
+    if (end - begin == 1)
+      return emit_cluster(clusters[begin]);
+    int axis;
+    size_t mid = morton_split(
+      begin, end, [&](size_t i) { return clusters[i].prefix; }, axis);
+    const auto index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    emit_morton(clusters, begin, mid);
+    nodes[index].second_child = emit_morton(clusters, mid, end);
+    return emit_interior(index, axis);
+  }
+
+  // Top levels split with the binned SAH over the cluster bounds, weighted by
+  // their primitive counts. order holds cluster indices and is partitioned.
+  uint32_t emit_sah(const std::vector<cluster>& clusters,
+                    std::vector<size_t>& order, size_t begin, size_t end,
+                    size_t depth) const {
+    if (end - begin == 1)
+      return emit_cluster(clusters[order[begin]]);
+
+    aabb bounds = aabb::empty();
+    aabb centroid_bounds = aabb::empty();
+    for (size_t i = begin; i < end; ++i) {
+      const auto& c = clusters[order[i]];
+      bounds = bounds.surrounding(c.box);
+      centroid_bounds = centroid_bounds.surrounding(aabb(c.centroid, c.centroid));
+    }
+
+    int best_axis = -1;
+    size_t best_bin = 0;
+    real_t best_cost = INFINITY;
+    auto bin_of = [&](const cluster& c, int axis) {
+      real_t cmin = centroid_bounds.min[axis];
+      real_t extent = centroid_bounds.max[axis] - cmin;
+      return std::min(static_cast<size_t>((c.centroid[axis] - cmin) *
+                                          (bin_count / extent)),
+                      bin_count - 1);
+    };
+    for (int axis = 0; depth < max_sah_depth && axis < 3; ++axis) {
+      if (centroid_bounds.max[axis] <= centroid_bounds.min[axis])
+        continue;
+      std::array<aabb, bin_count> bin_box;
+      std::array<size_t, bin_count> bin_prims{};
+      bin_box.fill(aabb::empty());
+      for (size_t i = begin; i < end; ++i) {
+        const auto& c = clusters[order[i]];
+        size_t b = bin_of(c, axis);
+        bin_box[b] = bin_box[b].surrounding(c.box);
+        bin_prims[b] += c.end - c.begin;
+      }
+      for (size_t split = 0; split + 1 < bin_count; ++split) {
+        aabb left = aabb::empty(), right = aabb::empty();
+        size_t left_prims = 0, right_prims = 0;
+        for (size_t b = 0; b < bin_count; ++b) {
+          (b <= split ? left : right) =
+            (b <= split ? left : right).surrounding(bin_box[b]);
+          (b <= split ? left_prims : right_prims) += bin_prims[b];
+        }
+        if (left_prims == 0 || right_prims == 0)
+          continue;
+        real_t cost = left.surface_area() * left_prims +
+                      right.surface_area() * right_prims;
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_bin = split;
+        }
+      }
+    }
+
+    size_t mid;
+    int axis = best_axis;
+    if (best_axis != -1) {
+      mid = std::partition(order.begin() + begin, order.begin() + end,
+                           [&](size_t i) {
+                             return bin_of(clusters[i], best_axis) <=
+                                    best_bin;
+                           }) -
+            order.begin();
+    } else {
+      axis = 0;
+      mid = begin + (end - begin) / 2;
+    }
+
+    const auto index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    emit_sah(clusters, order, begin, mid, depth + 1);
+    nodes[index].second_child = emit_sah(clusters, order, mid, end, depth + 1);
+    return emit_interior(index, axis);
+  }
+};
+
+}  // namespace
+
+std::shared_ptr<linear_bvh> build_lbvh(
+  const std::vector<std::shared_ptr<hittable>>& objects, real_t time0,
+  real_t time1, const lbvh_options& options, thread_pool* pool) {
+  auto bvh = std::make_shared<linear_bvh>();
+  const int bits = options.morton_bits > 30 ? 63 : 30;
+
+  std::vector<hittable*> bounded;
+  std::vector<aabb> boxes;
+  bounded.reserve(objects.size());
+  boxes.reserve(objects.size());
+  for (const auto& obj : objects) {
+    aabb box;
+    if (obj->bounding_box(time0, time1, box)) {
+      bounded.push_back(obj.get());
+      boxes.push_back(box);
+    }
+  }
+  const size_t n = bounded.size();
+  if (n == 0)
+    return bvh;
+
+  // Codes are computed relative to the centroid bounds.
+  const size_t chunks = (n + chunk_size - 1) / chunk_size;
+  std::vector<aabb> chunk_bounds(chunks, aabb::empty());
+  for_each_chunk(pool, n, [&](size_t c, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      auto p = boxes[i].centroid();
+      chunk_bounds[c] = chunk_bounds[c].surrounding(aabb(p, p));
+    }
+  });
+  aabb centroid_bounds = aabb::empty();
+  for (const auto& b : chunk_bounds)
+    centroid_bounds = centroid_bounds.surrounding(b);
+  vec3 extent = centroid_bounds.max - centroid_bounds.min;
+  vec3 inv_extent;
+  for (int a = 0; a < 3; ++a)
+    inv_extent[a] = extent[a] > 0 ? 1.0 / extent[a] : 0.0;
+
+  std::vector<morton_ref> refs(n);
+  for_each_chunk(pool, n, [&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      vec3 p = (boxes[i].centroid() - centroid_bounds.min) * inv_extent;
+      refs[i] = {morton_code(p, bits), static_cast<uint32_t>(i)};
+    }
+  });
+  radix_sort(refs, bits, pool);
+
+  // Cut the sorted references into clusters sharing the top code bits.
+  const int prefix_shift = bits - cluster_bits;
+  std::vector<cluster> clusters;
+  for (size_t begin = 0; begin < n;) {
+    const uint64_t prefix = refs[begin].code >> prefix_shift;
+    size_t end = begin + 1;
+    while (end < n && (refs[end].code >> prefix_shift) == prefix)
+      ++end;
+    clusters.push_back({begin, end, prefix, {}, aabb::empty(), point3()});
+    begin = end;
+  }
+
+  lbvh_builder b{refs, boxes, std::max<size_t>(options.max_leaf_size, 1),
+                 bvh->nodes};
+  auto build_cluster = [&b](cluster& c) {
+    b.build_treelet(c, c.begin, c.end, 0);
+    c.box = c.nodes[0].box();
+    c.centroid = c.box.centroid();
+  };
+  for (auto& c : clusters) {
+    if (pool) {
+      pool->enqueue([&build_cluster, &c]() { build_cluster(c); });
+    } else {
+      build_cluster(c);
+    }
+  }
+  if (pool)
+    pool->wait();
+
+  bvh->nodes.reserve(2 * n / b.max_leaf_size + clusters.size());
+  if (options.sah_top_levels) {
+    std::vector<size_t> order(clusters.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    b.emit_sah(clusters, order, 0, order.size(), 0);
+  } else {
+    b.emit_morton(clusters, 0, clusters.size());
+  }
+
+  bvh->prims.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    bvh->prims[i] = bounded[refs[i].index];
+  }
+  return bvh;
+}
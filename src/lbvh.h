@@ -0,0 +1,26 @@
+#pragma once
+
+#include "object.h"
+
+// A linear BVH builder (LBVH, Karras 2012; HLBVH, Pantaleoni and Luebke 2010)
+// for scenes that change too much to refit. Primitives are sorted by the
+// Morton code of their centroid with a radix sort, and the tree is read off
+// the sorted order: every node splits its range where the highest differing
+// code bit flips. The sorted array is cut into clusters by the top code bits,
+// whose treelets are built in parallel. The levels above the clusters are
+// either split the same way or, for hlbvh, with the binned SAH over the
+// cluster bounds, which costs little and recovers most of the tree quality.
+struct lbvh_options {
+  size_t max_leaf_size = 4;
+  int morton_bits = 30;  // 30 or 63
+  bool sah_top_levels = true;
+};
+
+// Builds straight into the flattened layout, no bvh_node tree in between.
+// Objects without a bounding box are skipped. With a started pool the code
+// computation, the sort and the treelets run on it; the pool must not be
+// running anything else.
+std::shared_ptr<struct linear_bvh> build_lbvh(
+  const std::vector<std::shared_ptr<hittable>>& objects, real_t time0,
+  real_t time1, const lbvh_options& options,
+  class thread_pool* pool = nullptr);
@@ -0,0 +1,393 @@
+#include "linear_bvh.h"
+
+#include "bvh.h"
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_map>
+
+namespace {
+
+// Copies a subtree of a linear_bvh into new arrays while removing and adding
+// primitives. Interior nodes left with a single child are replaced by it.
+struct subtree_copier {
+  const std::vector<linear_bvh_node>& nodes;
+  const std::vector<hittable*>& prims;
+  const std::unordered_set<const hittable*>& removed;
+  const std::unordered_map<uint32_t, std::vector<hittable*>>& added;
+  std::vector<linear_bvh_node>& out_nodes;
+  std::vector<hittable*>& out_prims;
+  std::vector<size_t> live;  // Primitives left in each subtree
+  bool overflow = false;
+
+  void count_live() {
+    live.assign(nodes.size(), 0);
+    for (size_t i = nodes.size(); i-- > 0;) {
+      const auto& node = nodes[i];
+      if (node.prim_count == 0) {
+        live[i] = live[i + 1] + live[node.second_child];
+        continue;
+      }
+      for (uint32_t j = 0; j < node.prim_count; ++j) {
+        live[i] += !removed.count(prims[node.first_prim + j]);
+      }
+      if (auto it = added.find(static_cast<uint32_t>(i)); it != added.end())
+        live[i] += it->second.size();
+      overflow |= live[i] > UINT16_MAX;
+    }
+  }
+
+  // Copies a subtree with live primitives, returns the index of the copy.
+  uint32_t copy(uint32_t index) {
+    const auto& node = nodes[index];
+    if (node.prim_count == 0) {
+      if (live[index + 1] == 0)
+        return copy(node.second_child);
+      if (live[node.second_child] == 0)
+        return copy(index + 1);
+    }
+
+    const auto out = static_cast<uint32_t>(out_nodes.size());
+    out_nodes.push_back(node);
+    if (node.prim_count == 0) {
+      copy(index + 1);
+      uint32_t second = copy(node.second_child);
+      out_nodes[out].second_child = second;
+      return out;
+    }
+
+    out_nodes[out].first_prim = static_cast<uint32_t>(out_prims.size());
+    out_nodes[out].prim_count = static_cast<uint16_t>(live[index]);
+    for (uint32_t i = 0; i < node.prim_count; ++i) {
+      auto* prim = prims[node.first_prim + i];
+      if (!removed.count(prim))
+        out_prims.push_back(prim);
+    }
+    if (auto it = added.find(index); it != added.end())
+      out_prims.insert(out_prims.end(), it->second.begin(), it->second.end());
+    return out;
+  }
+};
+
+// Copies a linear_bvh, merging every subtree of at most max_prims primitives
+// into one leaf.
+struct leaf_merger {
+  const linear_bvh& in;
+  linear_bvh& out;
+  size_t max_prims;
+  std::vector<size_t> sizes;  // Primitives under each node of in
+
+  void count() {
+    sizes.assign(in.nodes.size(), 0);
+    for (size_t i = in.nodes.size(); i-- > 0;) {
+      const auto& node = in.nodes[i];
+      sizes[i] = node.prim_count > 0
+                   ? node.prim_count
+                   : sizes[i + 1] + sizes[node.second_child];
+    }
+  }
+
+  void gather(uint32_t index) {
+    const auto& node = in.nodes[index];
+    if (node.prim_count == 0) {
+      gather(index + 1);
+      gather(node.second_child);
+      return;
+    }
+    for (uint32_t i = 0; i < node.prim_count; ++i)
+      out.prims.push_back(in.prims[node.first_prim + i]);
+  }
+
+  uint32_t merge(uint32_t index) {
+    const auto out_index = static_cast<uint32_t>(out.nodes.size());
+    out.nodes.push_back(in.nodes[index]);
+    if (in.nodes[index].prim_count > 0 || sizes[index] <= max_prims) {
+      out.nodes[out_index].first_prim = static_cast<uint32_t>(out.prims.size());
+      out.nodes[out_index].prim_count = static_cast<uint16_t>(sizes[index]);
+      gather(index);
+      return out_index;
+    }
+    merge(index + 1);
+    uint32_t second = merge(in.nodes[index].second_child);
+    out.nodes[out_index].second_child = second;
+    return out_index;
+  }
+};
+
+// Appends the objects of every leaf below node.
+void collect_objects(const bvh_node& node, std::vector<hittable*>& out) {
+  if (node.is_leaf()) {
+    for (const auto& obj : node.objects)
+      out.push_back(obj.get());
+    return;
+  }
+  collect_objects(*node.left, out);
+  collect_objects(*node.right, out);
+}
+
+}  // namespace
+
+linear_bvh::linear_bvh(const bvh_node& root) {
+  if (root.is_leaf() && root.objects.empty())
+    return;
+  flatten(root, 0);
+}
+
+uint32_t linear_bvh::flatten(const bvh_node& node, size_t depth) {
+  const auto index = static_cast<uint32_t>(nodes.size());
+  nodes.emplace_back();
+  nodes[index].set_box(node.box);
+  nodes[index].axis = static_cast<uint8_t>(node.axis);
+  nodes[index].pad = 0;
+
+  // The builders bound their depth well below max_depth, but a deeper
+  // subtree would overflow the traversal stack, so it becomes one leaf.
+  if (node.is_leaf() || depth + 1 >= max_depth) {
+    const size_t first = prims.size();
+    collect_objects(node, prims);
+    assert(prims.size() - first <= UINT16_MAX);
+    nodes[index].first_prim = static_cast<uint32_t>(first);
+    nodes[index].prim_count = static_cast<uint16_t>(prims.size() - first);
+    return index;
+  }
+
+  nodes[index].prim_count = 0;
+  flatten(*node.left, depth + 1);
+  // The vector may have grown while flattening the first child.
+  uint32_t second = flatten(*node.right, depth + 1);
+  nodes[index].second_child = second;
+  return index;
+}
+
+bool linear_bvh::bounding_box(real_t time0, real_t time1,
+                              aabb& output_box) const {
+  if (nodes.empty())
+    return false;
+  output_box = nodes[0].box();
+  return true;
+}
+
+bool linear_bvh::hit(const ray& r, real_t t_min, real_t t_max,
+                     hit_record& rec) const {
+  return traverse(r, t_min, t_max,
+                  [&](uint32_t first, uint32_t count, real_t& t_far) {
+                    bool hit_anything = false;
+                    for (uint32_t i = 0; i < count; ++i) {
+                      if (prims[first + i]->hit(r, t_min, t_far, rec)) {
+                        hit_anything = true;
+                        t_far = rec.t;
+                      }
+                    }
+                    return hit_anything;
+                  });
+}
+
+bool linear_bvh::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  return traverse<true>(r, t_min, t_max,
+                        [&](uint32_t first, uint32_t count, real_t& t_far) {
+                          for (uint32_t i = 0; i < count; ++i) {
+                            if (prims[first + i]->occluded(r, t_min, t_far))
+                              return true;
+                          }
+                          return false;
+                        });
+}
+
+uint64_t linear_bvh::hit_packet(const ray_packet& packet, uint64_t lanes,
+                                real_t t_min, hit_record* recs) const {
+  return traverse_packet(
+    packet, lanes, t_min, recs,
+    [&](uint32_t first, uint32_t count, uint64_t leaf_lanes) {
+      uint64_t hits = 0;
+      for (uint32_t i = first; i < first + count; ++i)
+        hits |= prims[i]->hit_packet(packet, leaf_lanes, t_min, recs);
+      return hits;
+    });
+}
+
+void linear_bvh::refit(real_t time0, real_t time1) {
+  // Children always come after their parent, so a reverse sweep visits them
+  // first.
+  for (size_t i = nodes.size(); i-- > 0;) {
+    auto& node = nodes[i];
+    if (node.prim_count > 0) {
+      node.set_box(leaf_box(&prims[node.first_prim], node.prim_count, time0,
+                            time1));
+    } else {
+      node.set_box(
+        nodes[i + 1].box().surrounding(nodes[node.second_child].box()));
+    }
+  }
+  compute_motion(time0, time1);
+}
+
+aabb linear_bvh::leaf_box(hittable* const* prims, uint32_t count,
+                          real_t time0, real_t time1) {
+  aabb box = aabb::empty();
+  for (uint32_t j = 0; j < count; ++j) {
+    aabb prim_box;
+    if (prims[j]->bounding_box(time0, time1, prim_box))
+      box = box.surrounding(prim_box);
+  }
+  return box;
+}
+
+void linear_bvh::compute_motion(real_t time0, real_t time1) {
+  motion_time0 = time0;
+  motion_time1 = time1;
+  // Most scenes are static; find that out before filling the node array.
+  auto moves = [&](const hittable* prim) {
+    aabb box0, box1;
+    if (!prim->bounding_box(time0, time0, box0) ||
+        !prim->bounding_box(time1, time1, box1))
+      return false;
+    for (int k = 0; k < 3; ++k) {
+      if (box0.min[k] != box1.min[k] || box0.max[k] != box1.max[k])
+        return true;
+    }
+    return false;
+  };
+  if (std::none_of(prims.begin(), prims.end(), moves)) {
+    motion.clear();
+    return;
+  }
+
+  motion.resize(nodes.size());
+  for (size_t i = nodes.size(); i-- > 0;) {
+    const auto& node = nodes[i];
+    aabb box0 = aabb::empty();
+    aabb box1 = aabb::empty();
+    if (node.prim_count > 0) {
+      for (uint32_t j = 0; j < node.prim_count; ++j) {
+        const auto* prim = prims[node.first_prim + j];
+        aabb prim_box0, prim_box1;
+        if (!prim->bounding_box(time0, time0, prim_box0) ||
+            !prim->bounding_box(time1, time1, prim_box1))
+          continue;
+        box0 = box0.surrounding(prim_box0);
+        box1 = box1.surrounding(prim_box1);
+      }
+    } else {
+      const auto& a = motion[i + 1];
+      const auto& b = motion[node.second_child];
+      for (int k = 0; k < 3; ++k) {
+        box0.min[k] = std::min(a.min0[k], b.min0[k]);
+        box0.max[k] = std::max(a.max0[k], b.max0[k]);
+        box1.min[k] = std::min(a.min1[k], b.min1[k]);
+        box1.max[k] = std::max(a.max1[k], b.max1[k]);
+      }
+    }
+    motion[i].set_boxes(box0, box1);
+  }
+}
+
+bool linear_bvh::update(const std::vector<hittable*>& added,
+                        const std::unordered_set<const hittable*>& removed,
+                        real_t time0, real_t time1) {
+  std::vector<linear_bvh_node> new_nodes;
+  std::vector<hittable*> new_prims;
+  if (nodes.empty()) {
+    if (added.size() > UINT16_MAX)
+      return false;
+    if (!added.empty()) {
+      auto& root = new_nodes.emplace_back();
+      root.first_prim = 0;
+      root.prim_count = static_cast<uint16_t>(added.size());
+      root.axis = 0;
+      root.pad = 0;
+      new_prims = added;
+    }
+  } else {
+    // Pick a leaf for every new primitive by descending into the child whose
+    // surface area grows the least. Bounds are grown on the way so that later
+    // insertions see the earlier ones.
+    auto grown_nodes = nodes;
+    std::unordered_map<uint32_t, std::vector<hittable*>> leaves;
+    for (auto* prim : added) {
+      aabb box;
+      prim->bounding_box(time0, time1, box);
+      uint32_t index = 0;
+      while (true) {
+        auto& node = grown_nodes[index];
+        node.set_box(node.box().surrounding(box));
+        if (node.prim_count > 0)
+          break;
+        auto growth = [&](uint32_t child) {
+          aabb child_box = grown_nodes[child].box();
+          return child_box.surrounding(box).surface_area() -
+                 child_box.surface_area();
+        };
+        index = growth(index + 1) <= growth(node.second_child)
+                  ? index + 1
+                  : node.second_child;
+      }
+      leaves[index].push_back(prim);
+    }
+
+    subtree_copier copier{grown_nodes, prims,     removed,
+                          leaves,      new_nodes, new_prims};
+    copier.count_live();
+    if (copier.overflow)
+      return false;
+    if (copier.live[0] > 0)
+      copier.copy(0);
+  }
+
+  nodes = std::move(new_nodes);
+  prims = std::move(new_prims);
+  refit(time0, time1);
+  return true;
+}
+
+void linear_bvh::merge_leaves(size_t max_prims) {
+  if (nodes.empty())
+    return;
+  max_prims = std::min<size_t>(max_prims, UINT16_MAX);
+  linear_bvh merged;
+  leaf_merger merger{*this, merged, max_prims};
+  merger.count();
+  merger.merge(0);
+  nodes = std::move(merged.nodes);
+  prims = std::move(merged.prims);
+  motion.clear();
+}
+
+bool linear_bvh::valid(size_t prim_count) const {
+  const size_t n = nodes.size();
+  // Children come after their parents, so depths are final when reached.
+  std::vector<uint8_t> depth(n, 0);
+  for (size_t i = 0; i < n; ++i) {
+    const auto& node = nodes[i];
+    if (node.prim_count > 0) {
+      if (size_t(node.first_prim) + node.prim_count > prim_count)
+        return false;
+      continue;
+    }
+    if (node.second_child <= i + 1 || node.second_child >= n)
+      return false;
+    // Traversal keeps a stack of max_depth nodes.
+    const size_t child_depth = depth[i] + 1;
+    if (child_depth >= max_depth)
+      return false;
+    const auto d = static_cast<uint8_t>(child_depth);
+    depth[i + 1] = std::max(depth[i + 1], d);
+    depth[node.second_child] = std::max(depth[node.second_child], d);
+  }
+  return motion.empty() || motion.size() == n;
+}
+
+real_t linear_bvh::sah_cost(real_t traversal_cost,
+                            real_t intersection_cost) const {
+  if (nodes.empty())
+    return 0;
+  real_t cost = 0;
+  for (const auto& node : nodes) {
+    real_t area = node.box().surface_area();
+    cost += node.prim_count > 0 ? area * intersection_cost * node.prim_count
+                                : area * traversal_cost;
+  }
+  real_t root_area = nodes[0].box().surface_area();
+  if (root_area <= 0)
+    return intersection_cost * prims.size();
+  return cost / root_area;
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+#include "object.h"
+
+// stl
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <unordered_set>
+
+// Widens the far distance of the slab tests below by a few ulps, so that rays
+// through the edge or corner of a box are not lost to rounding (Ize 2013).
+// Watertight meshes depend on it.
+constexpr real_t robust_slab_scale =
+  1 + 4 * std::numeric_limits<real_t>::epsilon();
+
+// A BVH node flattened into depth-first order. The first child of an interior
+// node always directly follows it, so only the second child is stored.
+struct linear_bvh_node {
+  float min[3];
+  float max[3];
+  union {
+    uint32_t first_prim;    // Leaf: index into linear_bvh::prims
+    uint32_t second_child;  // Interior: index into linear_bvh::nodes
+  };
+  uint16_t prim_count;  // Zero for interior nodes
+  uint8_t axis;         // Split axis of interior nodes
+  uint8_t pad;
+
+  aabb box() const {
+    return aabb(point3(min[0], min[1], min[2]), point3(max[0], max[1], max[2]));
+  }
+
+  void set_box(const aabb& box) {
+    for (int a = 0; a < 3; ++a) {
+      min[a] = float_down(box.min[a]);
+      max[a] = float_up(box.max[a]);
+    }
+  }
+
+  bool hit(const point3& origin, const vec3& inv_dir, real_t t_min,
+           real_t t_max) const {
+    for (int a = 0; a < 3; a++) {
+      real_t t0 = (min[a] - origin[a]) * inv_dir[a];
+      real_t t1 = (max[a] - origin[a]) * inv_dir[a];
+      if (inv_dir[a] < 0)
+        std::swap(t0, t1);
+      t1 *= robust_slab_scale;
+      t_min = t0 > t_min ? t0 : t_min;
+      t_max = t1 < t_max ? t1 : t_max;
+      if (t_max < t_min)
+        return false;
+    }
+    return true;
+  }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must be 32 bytes");
+
+// Bounds of a linear_bvh_node at the start and the end of the shutter
+// interval. Under linear motion the bounds at any time in between are covered
+// by interpolating the two.
+struct linear_bvh_motion {
+  float min0[3], max0[3];
+  float min1[3], max1[3];
+
+  void set_boxes(const aabb& box0, const aabb& box1) {
+    for (int a = 0; a < 3; ++a) {
+      min0[a] = float_down(box0.min[a]);
+      max0[a] = float_up(box0.max[a]);
+      min1[a] = float_down(box1.min[a]);
+      max1[a] = float_up(box1.max[a]);
+    }
+  }
+
+  // s is the ray time mapped to [0, 1] over the shutter interval.
+  bool hit(const point3& origin, const vec3& inv_dir, real_t s, real_t t_min,
+           real_t t_max) const {
+    for (int a = 0; a < 3; a++) {
+      real_t lo = min0[a] + s * (min1[a] - min0[a]);
+      real_t hi = max0[a] + s * (max1[a] - max0[a]);
+      real_t t0 = (lo - origin[a]) * inv_dir[a];
+      real_t t1 = (hi - origin[a]) * inv_dir[a];
+      if (inv_dir[a] < 0)
+        std::swap(t0, t1);
+      t1 *= robust_slab_scale;
+      t_min = t0 > t_min ? t0 : t_min;
+      t_max = t1 < t_max ? t1 : t_max;
+      if (t_max < t_min)
+        return false;
+    }
+    return true;
+  }
+};
+
+// Compiled form of a bvh_node tree: a contiguous node array traversed without
+// recursion or virtual calls, nearest child first. Bounds are rounded outwards
+// to float so no hit is lost. The primitives are not owned; they have to
+// outlive the linear_bvh.
+struct linear_bvh : hittable {
+  static constexpr size_t max_depth = 128;
+
+  linear_bvh() = default;
+  explicit linear_bvh(const struct bvh_node& root);
+
+  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
+                   hit_record& rec) const override;
+
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual uint64_t hit_packet(const ray_packet& packet, uint64_t lanes,
+                              real_t t_min, hit_record* recs) const override;
+
+  virtual bool bounding_box(real_t time0, real_t time1,
+                            aabb& output_box) const override;
+
+  // Recomputes all node bounds bottom-up from the current primitive bounds,
+  // keeping the topology. O(n). Leaves get the full bounds of their
+  // primitives, so the clipping of spatial splits is lost.
+  void refit(real_t time0, real_t time1);
+
+  // Bounds of count primitives starting at prims, for the refits of this and
+  // the layouts derived from it.
+  static aabb leaf_box(hittable* const* prims, uint32_t count, real_t time0,
+                       real_t time1);
+
+  // Computes the node bounds at both ends of the shutter interval, so that
+  // rays are tested against boxes around the objects at their own time
+  // instead of around the whole motion. Dropped if nothing moves.
+  void compute_motion(real_t time0, real_t time1);
+
+  // Removes primitives and inserts new ones into the leaves where they grow
+  // the surface area the least, then refits. Returns false, leaving the tree
+  // unchanged, if a leaf would overflow; the caller has to rebuild then.
+  bool update(const std::vector<hittable*>& added,
+              const std::unordered_set<const hittable*>& removed,
+              real_t time0, real_t time1);
+
+  // Turns every subtree with at most max_prims primitives into a single leaf,
+  // for primitives that intersect a batch at the cost of one. Call
+  // compute_motion afterwards if the tree has motion bounds.
+  void merge_leaves(size_t max_prims);
+
+  // Checks the child links, leaf ranges and depth of a tree read from a
+  // file, with leaves indexing an array of prim_count primitives.
+  bool valid(size_t prim_count) const;
+
+  size_t memory_usage() const {
+    return nodes.size() * sizeof(linear_bvh_node) +
+           motion.size() * sizeof(linear_bvh_motion) +
+           prims.size() * sizeof(hittable*);
+  }
+
+  // Expected cost of a random ray hitting the root, as in bvh_node::sah_cost.
+  real_t sah_cost(real_t traversal_cost = 1.0,
+                  real_t intersection_cost = 1.0) const;
+
+  // Visits the leaves hit by the ray, nearest child first, calling
+  // leaf_hit(first_prim, prim_count, t_max) on each. leaf_hit returns true
+  // and lowers t_max when it finds a closer hit. Lets primitives that keep
+  // their data in leaf order reuse the tree without going through prims.
+  // With any_hit, the traversal stops at the first leaf that reports a hit.
+  template <bool any_hit = false, typename LeafHit>
+  bool traverse(const ray& r, real_t t_min, real_t t_max,
+                const LeafHit& leaf_hit) const;
+
+  // The same for the rays of a packet in lanes: visits the leaves any of
+  // them hits, calling leaf_hit(first_prim, prim_count, leaf_lanes) with the
+  // lanes that enter the leaf's box. The t_max of lane i is recs[i].t;
+  // leaf_hit updates the records of the lanes it returns as closer hits. A
+  // coherent packet first tests each node against all its rays at once, so
+  // nodes that none of them reaches cost one test. Uses the node bounds over
+  // the whole shutter interval. Returns the lanes that hit.
+  template <typename LeafHit>
+  uint64_t traverse_packet(const ray_packet& packet, uint64_t lanes,
+                           real_t t_min, const hit_record* recs,
+                           const LeafHit& leaf_hit) const;
+
+  std::vector<linear_bvh_node> nodes;
+  std::vector<hittable*> prims;
+  std::vector<linear_bvh_motion> motion;  // Per node, empty if static
+  real_t motion_time0 = 0;
+  real_t motion_time1 = 1;
+
+ protected:
+  uint32_t flatten(const struct bvh_node& node, size_t depth);
+
+  // Stack traversal with node_hit(index, t_max) as the bounds test.
+  template <bool any_hit, typename NodeTest, typename LeafHit>
+  bool traverse(const ray& r, real_t t_max, const NodeTest& node_hit,
+                const LeafHit& leaf_hit) const;
+};
+
+template <bool any_hit, typename LeafHit>
+bool linear_bvh::traverse(const ray& r, real_t t_min, real_t t_max,
+                          const LeafHit& leaf_hit) const {
+  if (nodes.empty())
+    return false;
+
+  const point3 origin = r.origin();
+  const vec3 dir = r.direction();
+  const vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+  if (motion.empty()) {
+    return traverse<any_hit>(
+      r, t_max,
+      [&](uint32_t i, real_t t_far) {
+        return nodes[i].hit(origin, inv_dir, t_min, t_far);
+      },
+      leaf_hit);
+  }
+
+  real_t s = 0;
+  if (motion_time1 > motion_time0) {
+    s = std::clamp((r.time() - motion_time0) / (motion_time1 - motion_time0),
+                   0.0, 1.0);
+  }
+  return traverse<any_hit>(
+    r, t_max,
+    [&](uint32_t i, real_t t_far) {
+      return motion[i].hit(origin, inv_dir, s, t_min, t_far);
+    },
+    leaf_hit);
+}
+
+template <bool any_hit, typename NodeTest, typename LeafHit>
+bool linear_bvh::traverse(const ray& r, real_t t_max, const NodeTest& node_hit,
+                          const LeafHit& leaf_hit) const {
+  const vec3 dir = r.direction();
+  const bool dir_is_neg[3] = {dir.x() < 0, dir.y() < 0, dir.z() < 0};
+
+  uint32_t stack[max_depth];
+  size_t stack_size = 0;
+  uint32_t current = 0;
+  bool hit_anything = false;
+  while (true) {
+    const auto& node = nodes[current];
+    if (node_hit(current, t_max)) {
+      if (node.prim_count > 0) {
+        if (leaf_hit(node.first_prim, node.prim_count, t_max)) {
+          if constexpr (any_hit)
+            return true;
+          hit_anything = true;
+        }
+        if (stack_size == 0)
+          break;
+        current = stack[--stack_size];
+      } else if (dir_is_neg[node.axis]) {
+        // The second child lies on the near side of the split.
+        stack[stack_size++] = current + 1;
+        current = node.second_child;
+      } else {
+        stack[stack_size++] = node.second_child;
+        current = current + 1;
+      }
+    } else {
+      if (stack_size == 0)
+        break;
+      current = stack[--stack_size];
+    }
+  }
+  return hit_anything;
+}
+
+template <typename LeafHit>
+uint64_t linear_bvh::traverse_packet(const ray_packet& packet, uint64_t lanes,
+                                     real_t t_min, const hit_record* recs,
+                                     const LeafHit& leaf_hit) const {
+  if (nodes.empty() || lanes == 0)
+    return 0;
+
+  // Lanes not in lanes get a t_max no box is entered before.
+  alignas(64) float t_max[ray_packet::max_size];
+  float packet_t_max = -INFINITY;
+  for (size_t i = 0; i < ray_packet::max_size; ++i) {
+    t_max[i] = (lanes >> i) & 1 ? float_up(recs[i].t) : -INFINITY;
+    packet_t_max = std::max(packet_t_max, t_max[i]);
+  }
+  const float t_min_f = float_down(t_min);
+  // Children are visited in the order of the first ray.
+  const size_t first = std::countr_zero(lanes);
+  const bool dir_is_neg[3] = {packet.inv_dir[0][first] < 0,
+                              packet.inv_dir[1][first] < 0,
+                              packet.inv_dir[2][first] < 0};
+
+  uint32_t stack[max_depth];
+  size_t stack_size = 0;
+  uint32_t current = 0;
+  uint64_t hits = 0;
+  while (true) {
+    const auto& node = nodes[current];
+    uint64_t active = 0;
+    if (!packet.coherent ||
+        !packet.misses(node.min, node.max, t_min_f, packet_t_max))
+      active = packet.box_hits(node.min, node.max, t_min_f, t_max);
+    if (active == 0) {
+      if (stack_size == 0)
+        break;
+      current = stack[--stack_size];
+    } else if (node.prim_count > 0) {
+      const uint64_t leaf_hits =
+        leaf_hit(node.first_prim, node.prim_count, active);
+      if (leaf_hits) {
+        hits |= leaf_hits;
+        for (uint64_t l = leaf_hits; l; l &= l - 1) {
+          const int i = std::countr_zero(l);
+          t_max[i] = float_up(recs[i].t);
+        }
+        packet_t_max = *std::max_element(t_max, t_max + ray_packet::max_size);
+      }
+      if (stack_size == 0)
+        break;
+      current = stack[--stack_size];
+    } else if (dir_is_neg[node.axis]) {
+      stack[stack_size++] = current + 1;
+      current = node.second_child;
+    } else {
+      stack[stack_size++] = node.second_child;
+      current = current + 1;
+    }
+  }
+  return hits;
+}
@@ -8,11 +8,14 @@
 #include "camera.h"
 #include "draw.h"
 #include "image_texture.h"
+#include "mesh_io.h"
 #include "object.h"
 #include "ray.h"
 #include "ray_tracer.h"
 #include "raylib.h"
 #include "res/earth_topo.png.h"
+#include "scatter.h"
+#include "sphere_soa.h"
 #include "stopwatch.h"
 #include "thread_pool.h"
 #include "vec.h"
@@ -23,91 +26,127 @@
 // globals
 static size_t g_image_width = 1920;
 static size_t g_image_height = 1080;
+// Set by --bvh. The preview modes trace packets, which only the binary layout
+// traverses together.
+static bvh_layout g_bvh_layout = bvh_layout::binary;
+static std::string g_bvh_cache_dir;  // Set by --bvh-cache
+static real_t g_spatial_split_budget = 0;
+static bvh_builder g_bvh_builder = bvh_builder::sah;
+static bool g_sphere_soa = true;
+static bool g_wavefront = false;
+static bool g_sample_lights = true;
+static real_t g_adaptive_error = 0;
+static std::string g_mesh_path;
+static size_t g_sphere_count = 800;
+static uint64_t g_scene_seed = 42;
 real_t g_aspect_ratio;
 size_t g_pixel_count;
 
 enum class scene : int {
   random_spheres = 0,
   earth_sphere,
-  cornell_box
+  cornell_box,
+  instances,
+  mesh
 };
 
 void scatter_objects(ray_tracer& tracer) {
-  std::vector<std::shared_ptr<hittable>> objects;
+  arena& scene_arena = tracer.scene_arena;
+  struct sphere_params {
+    point3 center0, center1;
+    real_t radius;
+    std::shared_ptr<material> mat;
+  };
+  std::vector<sphere_params> params;
   // Place 3 big spheres
-  auto material1 = std::make_shared<glass>(color(1, 1, 1), 1.5);
-  objects.emplace_back(
-    std::make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-  auto material2 = std::make_shared<lambertian>(color(0.4, 0.2, 0.1));
-  objects.emplace_back(
-    std::make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-  auto material3 = std::make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-  objects.emplace_back(
-    std::make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-  for (size_t i = 0; i < 800;) {
-    auto choose_mat = random_real();
-    auto radius = random_real(0.05, 0.25);
-    auto center = vec3(random_real(-10, 10), radius, random_real(-10, 10));
-
-    std::shared_ptr<material> sphere_material;
-    std::shared_ptr<hittable> candidate;
-
-    if (choose_mat < 0.8) {
-      // diffuse
-      auto albedo = color::random() * color::random();
-      sphere_material = std::make_shared<lambertian>(albedo);
-      auto center2 = center + vec3(0, random_real(0, 0.5), 0);
-      candidate = std::make_shared<moving_sphere>(center, center2, 0.0, 1.0,
-                                                  radius, sphere_material);
-    } else if (choose_mat < 0.95) {
-      // metal
-      auto albedo = color::random(0.5, 1);
-      auto fuzz = random_real(0, 0.5);
-      sphere_material = std::make_shared<metal>(albedo, fuzz);
-      candidate = std::make_shared<sphere>(center, radius, sphere_material);
-    } else {
-      // glass
-      sphere_material = std::make_shared<glass>(color(1, 1, 1), 1.5);
-      candidate = std::make_shared<sphere>(center, radius, sphere_material);
-    }
-    bool try_again = false;
-    for (const auto& obj : objects) {
-      aabb box1;
-      aabb box2;
-      if (!obj->bounding_box(0, 1, box1) ||
-          !candidate->bounding_box(0, 1, box2)) {
-        continue;
-      }
-      if (box1.overlaps(box2)) {
-        try_again = true;
+  auto material1 = scene_arena.make<glass>(color(1, 1, 1), 1.5);
+  params.push_back({point3(0, 1, 0), point3(0, 1, 0), 1.0, material1});
+
+  auto material2 = scene_arena.make<lambertian>(color(0.4, 0.2, 0.1));
+  params.push_back({point3(-4, 1, 0), point3(-4, 1, 0), 1.0, material2});
+
+  auto material3 = scene_arena.make<metal>(color(0.7, 0.6, 0.5), 0.0);
+  params.push_back({point3(4, 1, 0), point3(4, 1, 0), 1.0, material3});
+
+  // The small ones around them, at the density of 800 in 20x20.
+  std::vector<aabb> blockers;
+  for (const auto& s : params) {
+    const vec3 extent(s.radius, s.radius, s.radius);
+    blockers.push_back(aabb(s.center0 - extent, s.center1 + extent));
+  }
+  scatter_options options;
+  options.count = g_sphere_count;
+  options.extent = 10 * std::sqrt(g_sphere_count / 800.0);
+  options.seed = g_scene_seed;
+  auto pool =
+    make_temporary_pool(g_sphere_count, std::thread::hardware_concurrency());
+  stopwatch sw;
+  const auto scattered = scatter_spheres(options, blockers, pool.get());
+  pool.reset();
+  std::cout << "Scattered " << scattered.size() << " spheres in "
+            << sw.elapsed_str() << "\n";
+
+  // Materials are made here rather than while scattering, as the arena is
+  // not thread-safe, and only for the spheres that were kept.
+  for (const auto& s : scattered) {
+    std::shared_ptr<material> mat;
+    switch (s.kind) {
+      case scattered_sphere::diffuse:
+        mat = scene_arena.make<lambertian>(s.albedo);
+        break;
+      case scattered_sphere::metal:
+        mat = scene_arena.make<metal>(s.albedo, s.fuzz);
+        break;
+      case scattered_sphere::glass:
+        mat = scene_arena.make<glass>(color(1, 1, 1), 1.5);
         break;
-      }
-    }
-    if (!try_again) {
-      objects.emplace_back(candidate);
-      ++i;
     }
+    params.push_back({s.center0, s.center1, s.radius, mat});
   }
 
-  for (const auto& s : objects) {
-    tracer.world.add_object(s);
+  if (!g_sphere_soa) {
+    for (const auto& s : params) {
+      if ((s.center1 - s.center0).length_squared() > 0) {
+        tracer.world.add_object(scene_arena.make<moving_sphere>(
+          s.center0, s.center1, 0.0, 1.0, s.radius, s.mat));
+      } else {
+        tracer.world.add_object(
+          scene_arena.make<sphere>(s.center0, s.radius, s.mat));
+      }
+    }
+    return;
   }
+  // The same spheres packed into one SIMD primitive.
+  auto spheres = scene_arena.make<sphere_soa>();
+  for (const auto& s : params) {
+    spheres->add(s.center0, s.center1, 0.0, 1.0, s.radius, s.mat);
+  }
+  spheres->build(tracer.camera.shutter_open_time,
+                 tracer.camera.shutter_close_time);
+  tracer.world.add_object(spheres);
 }
 
 void setup_scene(ray_tracer& rt, scene scene) {
+  // Dropping the objects still destroys them one by one; the arena then
+  // frees their memory in whole blocks.
   rt.world.clear_objects();
+  if (!rt.scene_arena.reset()) {
+    // Something still holds on to the old scene; its memory stays.
+    std::cout << "Scene arena still has " << rt.scene_arena.live_objects()
+              << " live objects, keeping "
+              << rt.scene_arena.bytes_used() / (1024.0 * 1024.0) << " MiB\n";
+  }
+  rt.reset();
+  arena& scene_arena = rt.scene_arena;
   switch (scene) {
     case scene::random_spheres: {
       rt.camera = camera(90, g_aspect_ratio, 0.0, 10, point3(13, 2, 3), 0, 1);
       rt.camera.look_at(vec3(0, 0, 0));
       auto ground_mat =
-        std::make_shared<lambertian>(std::make_shared<plane_checker_texture>(
+        scene_arena.make<lambertian>(scene_arena.make<plane_checker_texture>(
           color(0, 0, 0), color(1, 1, 1)));
       rt.world.add_object(
-        std::make_shared<plane>(point3(0, 0, 0), vec3(0, 1, 0), ground_mat));
+        scene_arena.make<plane>(point3(0, 0, 0), vec3(0, 1, 0), ground_mat));
       scatter_objects(rt);
       rt.background = color(0.5, 0.7, 1.0);
       break;
@@ -116,20 +155,21 @@ void setup_scene(ray_tracer& rt, scene scene) {
       rt.camera = camera(90, g_aspect_ratio, 0.0, 10, point3(0, 3, -10), 0, 1);
       rt.camera.look_at(vec3(0, 2, 0));
       auto ground_mat =
-        std::make_shared<lambertian>(std::make_shared<plane_checker_texture>(
+        scene_arena.make<lambertian>(scene_arena.make<plane_checker_texture>(
           color(0, 0, 0), color(1, 1, 1)));
       rt.world.add_object(
-        std::make_shared<plane>(point3(0, 0, 0), vec3(0, 1, 0), ground_mat));
-      rt.world.add_object(std::make_shared<sphere>(
+        scene_arena.make<plane>(point3(0, 0, 0), vec3(0, 1, 0), ground_mat));
+      rt.world.add_object(scene_arena.make<sphere>(
           point3(4, 2, 0), 2.0,
-          std::make_shared<lambertian>(std::make_shared<image_texture>(
+          scene_arena.make<lambertian>(scene_arena.make<image_texture>(
               ".png", earth_topo_png, sizeof(earth_topo_png)))));
-      rt.world.add_object(std::make_shared<sphere>(
+      rt.world.add_object(scene_arena.make<sphere>(
           point3(-2, 2, 1), 1.25,
-          std::make_shared<glass>(color(1, 1, 1), 1.5)));
+          scene_arena.make<glass>(color(1, 1, 1), 1.5)));
       // Add light
-      rt.world.add_object(std::make_shared<xz_rect>(
-        -1, 1, -1, 1, 6, std::make_shared<diffuse_light>(color(16, 16, 16))));
+      rt.world.add_object(scene_arena.make<quad>(
+        point3(-1, 6, -1), vec3(0, 0, 2), vec3(2, 0, 0),
+        scene_arena.make<diffuse_light>(color(16, 16, 16))));
       rt.background = color(0, 0, 0);
       break;
     }
@@ -137,35 +177,95 @@ void setup_scene(ray_tracer& rt, scene scene) {
       rt.camera =
         camera(60, g_aspect_ratio, 0.0, 10, point3(2.78, 2.78, -8.80), 0, 1);
       rt.background = color(0, 0, 0);
-      auto red = std::make_shared<lambertian>(color(0.65, 0.05, 0.05));
-      auto white = std::make_shared<lambertian>(color(0.73, 0.73, 0.73));
-      auto green = std::make_shared<lambertian>(color(0.12, 0.45, 0.15));
-      auto light = std::make_shared<diffuse_light>(color(15, 15, 15));
-      rt.world.add_object(
-        std::make_shared<yz_rect>(0, 5.55, 0, 5.55, 5.55, green));
-      rt.world.add_object(std::make_shared<yz_rect>(0, 5.55, 0, 5.55, 0, red));
-      rt.world.add_object(
-        std::make_shared<xz_rect>(2.13, 3.43, 2.27, 3.32, 5.54, light));
-      rt.world.add_object(std::make_shared<xz_rect>(0, 5.55, 0, 5.55, 0, white));
-      rt.world.add_object(
-        std::make_shared<xz_rect>(0, 5.55, 0, 5.55, 5.55, white));
-      rt.world.add_object(
-        std::make_shared<xy_rect>(0, 5.55, 0, 5.55, 5.55, white));
+      auto red = scene_arena.make<lambertian>(color(0.65, 0.05, 0.05));
+      auto white = scene_arena.make<lambertian>(color(0.73, 0.73, 0.73));
+      auto green = scene_arena.make<lambertian>(color(0.12, 0.45, 0.15));
+      auto light = scene_arena.make<diffuse_light>(color(15, 15, 15));
+      const vec3 x(5.55, 0, 0), y(0, 5.55, 0), z(0, 0, 5.55);
+      rt.world.add_object(scene_arena.make<quad>(x, y, z, green));
+      rt.world.add_object(scene_arena.make<quad>(point3(0, 0, 0), y, z, red));
+      rt.world.add_object(scene_arena.make<quad>(
+        point3(2.13, 5.54, 2.27), vec3(0, 0, 1.05), vec3(1.30, 0, 0), light));
+      rt.world.add_object(scene_arena.make<quad>(point3(0, 0, 0), z, x, white));
+      rt.world.add_object(scene_arena.make<quad>(y, z, x, white));
+      rt.world.add_object(scene_arena.make<quad>(z, x, y, white));
       std::shared_ptr<hittable> box1 =
-        std::make_shared<box>(point3(0, 0, 0), point3(1.65, 3.30, 1.65), white);
-      box1 = std::make_shared<rotate_y>(box1, 15);
-      box1 = std::make_shared<translate>(box1, vec3(2.65, 0, 2.95));
+        scene_arena.make<box>(point3(0, 0, 0), point3(1.65, 3.30, 1.65), white);
+      box1 = translate(rotate_y(box1, 15), vec3(2.65, 0, 2.95));
       rt.world.add_object(box1);
       std::shared_ptr<hittable> box2 =
-        std::make_shared<box>(point3(0, 0, 0), point3(1.65, 1.65, 1.65), white);
-      box2 = std::make_shared<rotate_y>(box2, -18);
-      box2 = std::make_shared<translate>(box2, vec3(1.30, 0, .65));
+        scene_arena.make<box>(point3(0, 0, 0), point3(1.65, 1.65, 1.65), white);
+      box2 = translate(rotate_y(box2, -18), vec3(1.30, 0, .65));
       rt.world.add_object(box2);
       rt.camera.look_at(vec3(2.78, 2.78, 0));
       break;
     }
+    case scene::instances: {
+      rt.camera = camera(90, g_aspect_ratio, 0.0, 10, point3(0, 8, 24), 0, 1);
+      rt.camera.look_at(vec3(0, 0, 0));
+      auto ground_mat =
+        scene_arena.make<lambertian>(scene_arena.make<plane_checker_texture>(
+          color(0, 0, 0), color(1, 1, 1)));
+      rt.world.add_object(
+        scene_arena.make<plane>(point3(0, 0, 0), vec3(0, 1, 0), ground_mat));
+      // One cluster of spheres with its own BVH, placed on a grid. Only the
+      // instances are in the world BVH.
+      std::shared_ptr<material> materials[] = {
+        scene_arena.make<lambertian>(color(0.8, 0.3, 0.2)),
+        scene_arena.make<lambertian>(color(0.2, 0.5, 0.8)),
+        scene_arena.make<metal>(color(0.8, 0.8, 0.7), 0.1),
+        scene_arena.make<glass>(color(1, 1, 1), 1.5)};
+      auto cluster = scene_arena.make<hittable_list>();
+      for (int i = 0; i < 64; ++i) {
+        auto center = random_in_unit_disk();
+        center = point3(center.x(), random_real(-1, 1), center.y());
+        cluster->add_object(scene_arena.make<sphere>(
+          center, random_real(0.1, 0.25), materials[random_int(0, 3)]));
+      }
+      cluster->build_bvh();
+      for (int x = -20; x < 20; ++x) {
+        for (int z = -20; z < 20; ++z) {
+          auto scale = random_real(0.4, 0.9);
+          auto xf = mat3x4::translation(vec3(x * 2.0, 1.25 * scale, z * 2.0)) *
+                    mat3x4::rotation_y(random_real(0, 360)) *
+                    mat3x4::scaling(vec3(scale));
+          rt.world.add_object(scene_arena.make<instance>(cluster, xf));
+        }
+      }
+      rt.background = color(0.5, 0.7, 1.0);
+      break;
+    }
+    case scene::mesh: {
+      rt.camera = camera(60, g_aspect_ratio, 0.0, 10, point3(0, 3, 8), 0, 1);
+      rt.camera.look_at(vec3(0, 1.5, 0));
+      auto ground_mat =
+        scene_arena.make<lambertian>(scene_arena.make<plane_checker_texture>(
+          color(0, 0, 0), color(1, 1, 1)));
+      rt.world.add_object(
+        scene_arena.make<plane>(point3(0, 0, 0), vec3(0, 1, 0), ground_mat));
+      rt.background = color(0.5, 0.7, 1.0);
+      auto mesh = g_mesh_path.empty()
+                    ? nullptr
+                    : load_mesh(g_mesh_path, scene_arena.make<lambertian>(
+                                               color(0.7, 0.7, 0.7)));
+      aabb box;
+      if (!mesh || !mesh->bounding_box(0, 1, box))
+        break;
+      // Scale the mesh to 4 units and stand it on the ground at the origin.
+      const vec3 extent = box.max - box.min;
+      const real_t scale =
+        4 / std::max({extent.x(), extent.y(), extent.z(), 1e-9});
+      const vec3 base((box.min.x() + box.max.x()) / 2, box.min.y(),
+                      (box.min.z() + box.max.z()) / 2);
+      rt.world.add_object(scene_arena.make<instance>(
+        mesh, mat3x4::scaling(vec3(scale)) * mat3x4::translation(-base)));
+      break;
+    }
   }
+  rt.world.time0 = rt.camera.shutter_open_time;
+  rt.world.time1 = rt.camera.shutter_close_time;
   rt.world.build_bvh();
+  rt.collect_lights();
 }
 
 int main(int argc, char** argv) {
@@ -178,6 +278,58 @@ int main(int argc, char** argv) {
       g_image_width = atoi(argv[++i]);
     } else if (strcmp(argv[i], "--height") == 0) {
       g_image_height = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bvh") == 0) {
+      ++i;
+      if (strcmp(argv[i], "wide4") == 0) {
+        g_bvh_layout = bvh_layout::wide4;
+      } else if (strcmp(argv[i], "wide8") == 0) {
+        g_bvh_layout = bvh_layout::wide8;
+      } else if (strcmp(argv[i], "quantized") == 0) {
+        g_bvh_layout = bvh_layout::quantized;
+      } else if (strcmp(argv[i], "compiled") == 0) {
+        g_bvh_layout = bvh_layout::compiled;
+      } else {
+        g_bvh_layout = bvh_layout::binary;
+      }
+    } else if (strcmp(argv[i], "--builder") == 0) {
+      ++i;
+      if (strcmp(argv[i], "lbvh") == 0) {
+        g_bvh_builder = bvh_builder::lbvh;
+      } else if (strcmp(argv[i], "hlbvh") == 0) {
+        g_bvh_builder = bvh_builder::hlbvh;
+      } else {
+        g_bvh_builder = bvh_builder::sah;
+      }
+    } else if (strcmp(argv[i], "--spatial-splits") == 0) {
+      g_spatial_split_budget = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--bvh-cache") == 0) {
+      g_bvh_cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "--no-bvh-cache") == 0) {
+      g_bvh_cache_dir.clear();
+    } else if (strcmp(argv[i], "--adaptive") == 0) {
+      g_adaptive_error = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--wavefront") == 0) {
+      g_wavefront = true;
+    } else if (strcmp(argv[i], "--no-light-sampling") == 0) {
+      g_sample_lights = false;
+    } else if (strcmp(argv[i], "--no-sphere-soa") == 0) {
+      g_sphere_soa = false;
+    } else if (strcmp(argv[i], "--sphere-count") == 0) {
+      g_sphere_count = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      g_scene_seed = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--mesh") == 0) {
+      g_mesh_path = argv[++i];
+    } else if (strcmp(argv[i], "--convert-mesh") == 0) {
+      // Writes the binary format with the BVH, for fast loading.
+      const char* in = argv[++i];
+      const char* out = argv[++i];
+      auto mesh = load_mesh(in, nullptr);
+      if (!mesh || !save_mesh_binary(out, *mesh)) {
+        std::cout << "Failed to convert " << in << "\n";
+        return 1;
+      }
+      return 0;
     }
   }
   g_aspect_ratio = static_cast<real_t>(g_image_width) / g_image_height;
@@ -192,9 +344,20 @@ int main(int argc, char** argv) {
   ray_tracer rt(camera(90, g_aspect_ratio, 0.0, 10, point3(0, 0, 0), 0, 1), 4,
                 50, g_image_width, g_image_height);
   rt.camera.look_at(vec3(0, 0, -1));
+  rt.world.layout = g_bvh_layout;
+  rt.world.bvh_cache_dir = g_bvh_cache_dir;
+  rt.world.spatial_split_budget = g_spatial_split_budget;
+  rt.world.builder = g_bvh_builder;
+  rt.sample_lights = g_sample_lights;
+  if (g_adaptive_error > 0) {
+    rt.adaptive_error = g_adaptive_error;
+    rt.set_adaptive(true);
+  }
 
   // Scene
-  scene selected_scene = scene::earth_sphere, current_scene;
+  scene selected_scene =
+    g_mesh_path.empty() ? scene::earth_sphere : scene::mesh;
+  scene current_scene;
   setup_scene(rt, current_scene = selected_scene);
 
   thread_pool pool(thread_count);
@@ -219,16 +382,39 @@ int main(int argc, char** argv) {
         char buf[256];
         snprintf(buf, 256, "Segment %zu [%zu, %zu)\n", si, start, end);
         std::cout << buf << std::flush;
+        auto add_progress = [&](unsigned pixels) {
+          // Only the add that crosses the end of the frame wraps the count.
+          const auto old =
+            progress.fetch_add(pixels, std::memory_order_relaxed);
+          if (old < g_pixel_count && old + pixels >= g_pixel_count) {
+            rt_frame_time = rt_sw.elapsed();
+            progress.fetch_sub(g_pixel_count);
+            rt_sw.reset();
+          }
+        };
+        wavefront engine;
         while (!done) {
-          for (size_t i = start; i < end; ++i) {
+          for (size_t i = start; i < end && !done;) {
+            const bool preview = rt.mode != ray_tracer::render_mode::color;
+            if (g_wavefront || preview) {
+              // Whole columns, about one batch of paths at a time, or 8 for
+              // the packets of the preview modes.
+              const size_t paths_per_column =
+                image.height * std::max<size_t>(rt.sample_count, 1);
+              const size_t columns = std::clamp<size_t>(
+                preview ? 8 : wavefront::batch_paths / paths_per_column, 1,
+                end - i);
+              rt.render_columns(image, engine, i, i + columns);
+              add_progress(columns * image.height);
+              i += columns;
+              while (suspend) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(400));
+              }
+              continue;
+            }
             for (size_t j = 0; j < image.height; ++j) {
               rt.render_pixel(image, i, j);
-              if (progress.fetch_add(1, std::memory_order_relaxed) ==
-                  g_pixel_count - 1) {
-                rt_frame_time = rt_sw.elapsed();
-                progress.store(0);
-                rt_sw.reset();
-              }
+              add_progress(1);
               if (done) {
                 break;
               }
@@ -236,6 +422,7 @@ int main(int argc, char** argv) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(400));
               }
             }
+            ++i;
           }
         }
       });
@@ -278,8 +465,8 @@ int main(int argc, char** argv) {
     if (IsKeyPressed(KEY_F1)) {
       debug = !debug;
     }
-    if (debug) {
-      draw_bvh(image, rt.world.bvh_root.get(), rt, 0);
+    if (debug && rt.world.bvh) {
+      draw_bvh(image, *rt.world.bvh, rt);
     }
     UpdateTexture(tex, image.data);
     DrawTexture(tex, 0, 0, WHITE);
@@ -309,10 +496,16 @@ int main(int argc, char** argv) {
                stopwatch::elapsed_str(remaining).c_str());
       GuiLabel(Rectangle{5, 0, 280, 20}, perf_str);
       snprintf(perf_str, sizeof(perf_str), "Render: %.2f FPS | Frames: %d", render_fps, rt.frame_count.load());
-      GuiLabel(Rectangle{5, 20, 280, 20}, perf_str);
+      if (rt.adaptive) {
+        const size_t length = strlen(perf_str);
+        snprintf(perf_str + length, sizeof(perf_str) - length,
+                 " | Converged: %.1f%%",
+                 100.0 * rt.converged_pixels / g_pixel_count);
+      }
+      GuiLabel(Rectangle{5, 20, 380, 20}, perf_str);
 
       // Scene selector (top middle)
-      const char* scene_str = "Random Spheres;Earth;Cornell Box";
+      const char* scene_str = "Random Spheres;Earth;Cornell Box;Instances;Mesh";
       static const Rectangle scene_selector_rect = {(g_image_width / 2.f) - 100,
                                                     0, 200, 20};
       if (!suspend)
@@ -321,6 +514,15 @@ int main(int argc, char** argv) {
                   reinterpret_cast<int*>(&selected_scene));
       if (current_scene != selected_scene)
         setup_scene(rt, current_scene = selected_scene);
+      // BVH layout (below the scene selector)
+      const char* layout_str =
+        "Binary BVH;4-wide BVH;8-wide BVH;Quantized BVH;Compiled scene";
+      static const Rectangle layout_selector_rect = {
+        (g_image_width / 2.f) - 100, 25, 200, 20};
+      GuiComboBox(layout_selector_rect, layout_str,
+                  reinterpret_cast<int*>(&g_bvh_layout));
+      if (rt.world.layout != g_bvh_layout)
+        rt.world.set_layout(g_bvh_layout);
       if (!suspend)
         GuiEnable();
 
@@ -355,6 +557,10 @@ int main(int argc, char** argv) {
 	  GuiCheckBox(Rectangle{ 5, cam_settings_start + 25, 20, 20 }, "Accumulate",
 		  &accumulate);
 	  rt.set_accumulate(accumulate);
+      bool adaptive = rt.adaptive;
+      GuiCheckBox(Rectangle{110, cam_settings_start + 25, 20, 20}, "Adaptive",
+                  &adaptive);
+      rt.set_adaptive(adaptive);
       GuiSlider(Rectangle{5, cam_settings_start + 50, 150, 20}, nullptr,
                 TextFormat("Focus Distance %.2f", rt.camera.focus_distance),
                 &rt.camera.focus_distance, 0.5, 50);
@@ -390,6 +596,7 @@ int main(int argc, char** argv) {
         for (size_t i = 0; i < image.width * image.height; ++i) {
           write_pixel(image, i % image.width, i / image.width, color(0, 0, 0));
         }
+        rt.reset();
       }
       if (GuiButton(Rectangle{5, img_settings_start + 100, 150, 20},
                     suspend ? "Resume" : "Suspend")) {
@@ -0,0 +1,75 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+std::shared_ptr<mapped_file> mapped_file::open(const std::string& path) {
+  std::shared_ptr<mapped_file> f(new mapped_file());
+  f->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (f->file == INVALID_HANDLE_VALUE) {
+    f->file = nullptr;
+    return nullptr;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(f->file, &size) || size.QuadPart == 0)
+    return nullptr;
+  f->mapping =
+    CreateFileMappingA(f->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!f->mapping)
+    return nullptr;
+  f->data = static_cast<const uint8_t*>(
+    MapViewOfFile(f->mapping, FILE_MAP_READ, 0, 0, 0));
+  if (!f->data)
+    return nullptr;
+  f->size = static_cast<size_t>(size.QuadPart);
+  return f;
+}
+
+mapped_file::~mapped_file() {
+  if (data)
+    UnmapViewOfFile(data);
+  if (mapping)
+    CloseHandle(mapping);
+  if (file)
+    CloseHandle(file);
+}
+
+#else
+
+std::shared_ptr<mapped_file> mapped_file::open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (addr == MAP_FAILED)
+    return nullptr;
+  std::shared_ptr<mapped_file> f(new mapped_file());
+  f->data = static_cast<const uint8_t*>(addr);
+  f->size = static_cast<size_t>(st.st_size);
+  return f;
+}
+
+mapped_file::~mapped_file() {
+  if (data)
+    munmap(const_cast<uint8_t*>(data), size);
+}
+
+#endif
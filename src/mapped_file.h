@@ -0,0 +1,29 @@
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// A whole file mapped read-only into memory. Pages are loaded on first access,
+// so opening is cheap regardless of the file size.
+struct mapped_file {
+  // Returns nullptr if the file cannot be opened or mapped.
+  static std::shared_ptr<mapped_file> open(const std::string& path);
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  ~mapped_file();
+
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+
+ protected:
+  mapped_file() = default;
+
+#ifdef _WIN32
+  void* file = nullptr;
+  void* mapping = nullptr;
+#endif
+};
@@ -10,6 +10,13 @@ struct material {
 
   virtual bool scatter(const class ray& r_in, const class hit_record& rec,
                        color& attenuation, ray& scattered) const = 0;
+
+  // Whether emitted() can be nonzero, which makes primitives lights.
+  virtual bool emissive() const { return false; }
+
+  // Whether scatter() reflects ideally diffusely: cosine-weighted directions,
+  // the attenuation being the albedo. Lights are sampled from such hits.
+  virtual bool diffuse() const { return false; }
 };
 
 struct lambertian : public material {
@@ -20,6 +27,8 @@ struct lambertian : public material {
   virtual bool scatter(const ray& r_in, const hit_record& rec,
                        color& attenuation, ray& scattered) const override;
 
+  virtual bool diffuse() const override { return true; }
+
   std::shared_ptr<texture> albedo;
 };
 
@@ -58,6 +67,8 @@ class diffuse_light : public material {
     return emit->value(u, v, p);
   }
 
+  virtual bool emissive() const override { return true; }
+
  public:
   std::shared_ptr<texture> emit;
 };
\ No newline at end of file
@@ -0,0 +1,576 @@
+#include "mesh_io.h"
+
+#include "binary_file.h"
+#include "mapped_file.h"
+#include "stopwatch.h"
+
+// stl
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <unordered_map>
+
+namespace {
+
+// Text parsing over a mapped file.
+struct text_cursor {
+  const char* p;
+  const char* end;
+
+  bool at_end() const { return p >= end; }
+
+  void skip_spaces() {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      ++p;
+  }
+
+  void skip_line() {
+    while (p < end && *p != '\n')
+      ++p;
+    if (p < end)
+      ++p;
+  }
+
+  bool at_line_end() {
+    skip_spaces();
+    return p >= end || *p == '\n' || *p == '#';
+  }
+
+  std::string_view word() {
+    skip_spaces();
+    const char* begin = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+      ++p;
+    return std::string_view(begin, p - begin);
+  }
+
+  template <typename T>
+  bool number(T& value) {
+    skip_spaces();
+    // from_chars rejects a leading plus sign.
+    if (p < end && *p == '+')
+      ++p;
+    auto [next, ec] = std::from_chars(p, end, value);
+    if (ec != std::errc())
+      return false;
+    p = next;
+    return true;
+  }
+};
+
+// One corner of an OBJ face: position, uv and normal indices, -1 if absent.
+struct obj_corner {
+  int32_t v, vt, vn;
+
+  bool operator==(const obj_corner& rhs) const {
+    return v == rhs.v && vt == rhs.vt && vn == rhs.vn;
+  }
+};
+
+struct obj_corner_hash {
+  size_t operator()(const obj_corner& c) const {
+    uint64_t h = uint32_t(c.v);
+    h = h * 0x9e3779b97f4a7c15ull ^ uint32_t(c.vt);
+    h = h * 0x9e3779b97f4a7c15ull ^ uint32_t(c.vn);
+    return static_cast<size_t>(h ^ (h >> 29));
+  }
+};
+
+// Parses "v", "v/vt", "v//vn" or "v/vt/vn" with 1-based or negative indices.
+bool parse_corner(text_cursor& c, size_t v_count, size_t vt_count,
+                  size_t vn_count, obj_corner& out) {
+  const size_t counts[3] = {v_count, vt_count, vn_count};
+  int32_t* fields[3] = {&out.v, &out.vt, &out.vn};
+  out = {-1, -1, -1};
+  for (int i = 0; i < 3; ++i) {
+    if (i > 0) {
+      if (c.p >= c.end || *c.p != '/')
+        break;
+      ++c.p;
+      if (c.p < c.end && *c.p == '/')
+        continue;
+    }
+    int64_t index;
+    auto [next, ec] = std::from_chars(c.p, c.end, index);
+    if (ec != std::errc())
+      return false;
+    c.p = next;
+    const int64_t resolved = index < 0 ? int64_t(counts[i]) + index : index - 1;
+    if (resolved < 0 || resolved >= int64_t(counts[i]))
+      return false;
+    *fields[i] = static_cast<int32_t>(resolved);
+  }
+  return true;
+}
+
+enum class ply_format { ascii, binary_little_endian, binary_big_endian };
+
+enum class ply_type { none, int8, uint8, int16, uint16, int32, uint32, float32,
+                      float64 };
+
+ply_type parse_ply_type(std::string_view name) {
+  if (name == "char" || name == "int8")
+    return ply_type::int8;
+  if (name == "uchar" || name == "uint8")
+    return ply_type::uint8;
+  if (name == "short" || name == "int16")
+    return ply_type::int16;
+  if (name == "ushort" || name == "uint16")
+    return ply_type::uint16;
+  if (name == "int" || name == "int32")
+    return ply_type::int32;
+  if (name == "uint" || name == "uint32")
+    return ply_type::uint32;
+  if (name == "float" || name == "float32")
+    return ply_type::float32;
+  if (name == "double" || name == "float64")
+    return ply_type::float64;
+  return ply_type::none;
+}
+
+struct ply_property {
+  std::string name;
+  ply_type type;
+  ply_type count_type = ply_type::none;  // Set for list properties
+};
+
+struct ply_element {
+  std::string name;
+  size_t count;
+  std::vector<ply_property> properties;
+};
+
+// Reads the values of the body one at a time, whatever the format.
+struct ply_reader {
+  text_cursor c;
+  ply_format format;
+  bool ok = true;
+
+  template <typename T>
+  double binary() {
+    T value;
+    if (c.end - c.p < static_cast<ptrdiff_t>(sizeof(T))) {
+      ok = false;
+      return 0;
+    }
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, c.p, sizeof(T));
+    c.p += sizeof(T);
+    const bool big = format == ply_format::binary_big_endian;
+    if (big != (std::endian::native == std::endian::big))
+      std::reverse(bytes, bytes + sizeof(T));
+    std::memcpy(&value, bytes, sizeof(T));
+    return static_cast<double>(value);
+  }
+
+  double read(ply_type type) {
+    if (format == ply_format::ascii) {
+      while (c.p < c.end && (*c.p == '\n' || *c.p == ' ' || *c.p == '\t' ||
+                             *c.p == '\r'))
+        ++c.p;
+      double value = 0;
+      ok = ok && c.number(value);
+      return value;
+    }
+    switch (type) {
+      case ply_type::int8:
+        return binary<int8_t>();
+      case ply_type::uint8:
+        return binary<uint8_t>();
+      case ply_type::int16:
+        return binary<int16_t>();
+      case ply_type::uint16:
+        return binary<uint16_t>();
+      case ply_type::int32:
+        return binary<int32_t>();
+      case ply_type::uint32:
+        return binary<uint32_t>();
+      case ply_type::float32:
+        return binary<float>();
+      case ply_type::float64:
+        return binary<double>();
+      default:
+        ok = false;
+        return 0;
+    }
+  }
+};
+
+constexpr uint32_t mesh_version = 1;
+constexpr char mesh_magic[8] = {'R', 'T', 'I', 'O', 'W', 'M', 'S', 'H'};
+constexpr uint32_t has_normals = 1;
+constexpr uint32_t has_uvs = 2;
+
+struct mesh_header {
+  binary_file_header file;
+  uint64_t vertex_count;
+  uint64_t triangle_count;
+  uint64_t order_count;
+  uint64_t node_count;
+  uint32_t flags;
+  uint32_t pad;
+};
+
+// Byte offsets of the arrays after the header, each aligned to 64 bytes.
+struct mesh_sections {
+  size_t positions, normals, uvs, indices, order, nodes;
+  size_t size;  // Total bytes, header included
+};
+
+mesh_sections sections(const mesh_header& h) {
+  auto align = [](size_t offset) { return (offset + 63) & ~size_t(63); };
+  mesh_sections s;
+  s.positions = align(sizeof(mesh_header));
+  s.normals = align(s.positions + h.vertex_count * 3 * sizeof(float));
+  s.uvs = align(s.normals + (h.flags & has_normals ? h.vertex_count * 3 : 0) *
+                              sizeof(float));
+  s.indices = align(s.uvs + (h.flags & has_uvs ? h.vertex_count * 2 : 0) *
+                              sizeof(float));
+  s.order = align(s.indices + h.triangle_count * 3 * sizeof(uint32_t));
+  s.nodes = align(s.order + h.order_count * sizeof(uint32_t));
+  s.size = s.nodes + h.node_count * sizeof(linear_bvh_node);
+  return s;
+}
+
+bool has_extension(const std::string& path, const char* ext) {
+  auto actual = std::filesystem::path(path).extension().string();
+  std::transform(actual.begin(), actual.end(), actual.begin(),
+                 [](unsigned char ch) { return std::tolower(ch); });
+  return actual == ext;
+}
+
+}  // namespace
+
+bool load_obj(const std::string& path, mesh_data& out) {
+  auto file = mapped_file::open(path);
+  if (!file) {
+    std::cout << "Failed to open " << path << "\n";
+    return false;
+  }
+  const char* data = reinterpret_cast<const char*>(file->data);
+  text_cursor c{data, data + file->size};
+
+  std::vector<float> positions, uvs, normals;
+  std::vector<obj_corner> corners;  // Three per triangle
+  std::vector<obj_corner> face;
+  bool all_uvs = true, all_normals = true;
+  size_t line = 1;
+  for (; !c.at_end(); c.skip_line(), ++line) {
+    const auto keyword = c.word();
+    bool ok = true;
+    if (keyword == "v" || keyword == "vn") {
+      auto& dst = keyword == "v" ? positions : normals;
+      for (int i = 0; i < 3; ++i) {
+        float value;
+        ok = ok && c.number(value);
+        dst.push_back(value);
+      }
+    } else if (keyword == "vt") {
+      for (int i = 0; i < 2; ++i) {
+        float value;
+        ok = ok && c.number(value);
+        uvs.push_back(value);
+      }
+    } else if (keyword == "f") {
+      face.clear();
+      while (ok && !c.at_line_end()) {
+        obj_corner corner;
+        ok = parse_corner(c, positions.size() / 3, uvs.size() / 2,
+                          normals.size() / 3, corner);
+        all_uvs = all_uvs && corner.vt >= 0;
+        all_normals = all_normals && corner.vn >= 0;
+        face.push_back(corner);
+      }
+      ok = ok && face.size() >= 3;
+      for (size_t i = 2; ok && i < face.size(); ++i) {
+        corners.push_back(face[0]);
+        corners.push_back(face[i - 1]);
+        corners.push_back(face[i]);
+      }
+    }
+    if (!ok) {
+      std::cout << path << ":" << line << ": invalid " << keyword << "\n";
+      return false;
+    }
+  }
+
+  out = mesh_data();
+  if (!all_uvs && !all_normals) {
+    // Positions are the vertices.
+    out.positions = std::move(positions);
+    out.indices.reserve(corners.size());
+    for (const auto& corner : corners)
+      out.indices.push_back(static_cast<uint32_t>(corner.v));
+    return true;
+  }
+
+  std::unordered_map<obj_corner, uint32_t, obj_corner_hash> vertices;
+  out.indices.reserve(corners.size());
+  for (auto corner : corners) {
+    if (!all_uvs)
+      corner.vt = -1;
+    if (!all_normals)
+      corner.vn = -1;
+    auto [it, inserted] = vertices.try_emplace(
+      corner, static_cast<uint32_t>(out.positions.size() / 3));
+    if (inserted) {
+      for (int i = 0; i < 3; ++i)
+        out.positions.push_back(positions[3 * size_t(corner.v) + i]);
+      for (int i = 0; all_normals && i < 3; ++i)
+        out.normals.push_back(normals[3 * size_t(corner.vn) + i]);
+      for (int i = 0; all_uvs && i < 2; ++i)
+        out.uvs.push_back(uvs[2 * size_t(corner.vt) + i]);
+    }
+    out.indices.push_back(it->second);
+  }
+  return true;
+}
+
+bool load_ply(const std::string& path, mesh_data& out) {
+  auto file = mapped_file::open(path);
+  if (!file) {
+    std::cout << "Failed to open " << path << "\n";
+    return false;
+  }
+  const char* data = reinterpret_cast<const char*>(file->data);
+  text_cursor c{data, data + file->size};
+  auto fail = [&](const char* reason) {
+    std::cout << path << ": " << reason << "\n";
+    return false;
+  };
+
+  if (c.word() != "ply")
+    return fail("not a PLY file");
+  ply_format format = ply_format::ascii;
+  std::vector<ply_element> elements;
+  while (true) {
+    c.skip_line();
+    if (c.at_end())
+      return fail("truncated header");
+    const auto keyword = c.word();
+    if (keyword == "format") {
+      const auto name = c.word();
+      if (name == "ascii")
+        format = ply_format::ascii;
+      else if (name == "binary_little_endian")
+        format = ply_format::binary_little_endian;
+      else if (name == "binary_big_endian")
+        format = ply_format::binary_big_endian;
+      else
+        return fail("unknown format");
+    } else if (keyword == "element") {
+      ply_element element;
+      element.name = c.word();
+      if (!c.number(element.count))
+        return fail("invalid element count");
+      elements.push_back(std::move(element));
+    } else if (keyword == "property") {
+      if (elements.empty())
+        return fail("property outside of an element");
+      ply_property property;
+      auto type = c.word();
+      if (type == "list") {
+        property.count_type = parse_ply_type(c.word());
+        type = c.word();
+        if (property.count_type == ply_type::none)
+          return fail("unknown list count type");
+      }
+      property.type = parse_ply_type(type);
+      property.name = c.word();
+      if (property.type == ply_type::none)
+        return fail("unknown property type");
+      elements.back().properties.push_back(std::move(property));
+    } else if (keyword == "end_header") {
+      c.skip_line();
+      break;
+    }
+  }
+
+  ply_reader reader{c, format};
+  out = mesh_data();
+  std::vector<uint32_t> polygon;
+  for (const auto& element : elements) {
+    const bool is_vertex = element.name == "vertex";
+    const bool is_face = element.name == "face";
+    // Slots of the vertex attributes in a row of property values.
+    int slot[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    const char* names[8][4] = {{"x"},          {"y"},
+                               {"z"},          {"nx"},
+                               {"ny"},         {"nz"},
+                               {"u", "s", "texture_u", "texture_s"},
+                               {"v", "t", "texture_v", "texture_t"}};
+    for (size_t p = 0; is_vertex && p < element.properties.size(); ++p) {
+      for (int a = 0; a < 8; ++a) {
+        for (const char* name : names[a]) {
+          if (name && element.properties[p].name == name)
+            slot[a] = static_cast<int>(p);
+        }
+      }
+    }
+    if (is_vertex && (slot[0] < 0 || slot[1] < 0 || slot[2] < 0))
+      return fail("vertices without positions");
+    const bool normals = slot[3] >= 0 && slot[4] >= 0 && slot[5] >= 0;
+    const bool uvs = slot[6] >= 0 && slot[7] >= 0;
+
+    std::vector<double> row(element.properties.size());
+    for (size_t i = 0; i < element.count; ++i) {
+      for (size_t p = 0; p < element.properties.size(); ++p) {
+        const auto& property = element.properties[p];
+        if (property.count_type == ply_type::none) {
+          row[p] = reader.read(property.type);
+          continue;
+        }
+        const double count = reader.read(property.count_type);
+        const bool indices = is_face && (property.name == "vertex_indices" ||
+                                         property.name == "vertex_index");
+        polygon.clear();
+        for (double j = 0; reader.ok && j < count; ++j) {
+          const double index = reader.read(property.type);
+          reader.ok = reader.ok && index >= 0 && index <= UINT32_MAX;
+          if (indices && reader.ok)
+            polygon.push_back(static_cast<uint32_t>(index));
+        }
+        for (size_t j = 2; indices && j < polygon.size(); ++j) {
+          out.indices.push_back(polygon[0]);
+          out.indices.push_back(polygon[j - 1]);
+          out.indices.push_back(polygon[j]);
+        }
+      }
+      if (!reader.ok)
+        return fail("truncated or invalid data");
+      if (!is_vertex)
+        continue;
+      for (int a = 0; a < 3; ++a)
+        out.positions.push_back(static_cast<float>(row[slot[a]]));
+      for (int a = 3; normals && a < 6; ++a)
+        out.normals.push_back(static_cast<float>(row[slot[a]]));
+      for (int a = 6; uvs && a < 8; ++a)
+        out.uvs.push_back(static_cast<float>(row[slot[a]]));
+    }
+  }
+
+  const size_t vertex_count = out.positions.size() / 3;
+  for (uint32_t index : out.indices) {
+    if (index >= vertex_count)
+      return fail("vertex index out of range");
+  }
+  return true;
+}
+
+std::shared_ptr<triangle_mesh> load_mesh_binary(const std::string& path,
+                                                std::shared_ptr<material> mat) {
+  auto file = mapped_file::open(path);
+  if (!file) {
+    std::cout << "Failed to open " << path << "\n";
+    return nullptr;
+  }
+  mesh_header header;
+  if (!read_file_header(*file, mesh_magic, mesh_version, header) ||
+      !counts_fit(file->size, {header.vertex_count, header.triangle_count,
+                               header.order_count, header.node_count}) ||
+      sections(header).size != file->size) {
+    std::cout << path << ": not a mesh file of this version\n";
+    return nullptr;
+  }
+
+  const auto s = sections(header);
+  const uint8_t* base = file->data;
+  auto floats = [&](size_t offset, size_t count) {
+    return std::span<const float>(
+      reinterpret_cast<const float*>(base + offset), count);
+  };
+  auto uints = [&](size_t offset, size_t count) {
+    return std::span<const uint32_t>(
+      reinterpret_cast<const uint32_t*>(base + offset), count);
+  };
+  const size_t v = header.vertex_count;
+  auto mesh = std::make_shared<triangle_mesh>(
+    floats(s.positions, 3 * v),
+    floats(s.normals, header.flags & has_normals ? 3 * v : 0),
+    floats(s.uvs, header.flags & has_uvs ? 2 * v : 0),
+    uints(s.indices, 3 * header.triangle_count), file, std::move(mat));
+  mesh->order = uints(s.order, header.order_count);
+  const auto* nodes = reinterpret_cast<const linear_bvh_node*>(base + s.nodes);
+  mesh->bvh.nodes.assign(nodes, nodes + header.node_count);
+
+  // An index out of range would read outside the mapping during rendering,
+  // and a tree deeper than linear_bvh::max_depth would overflow the
+  // traversal stack.
+  bool ok = mesh->bvh.valid(mesh->order.size());
+  for (uint32_t index : mesh->indices)
+    ok = ok && index < v;
+  for (uint32_t triangle : mesh->order)
+    ok = ok && triangle < header.triangle_count;
+  if (!ok) {
+    std::cout << path << ": corrupt mesh file\n";
+    return nullptr;
+  }
+  return mesh;
+}
+
+bool save_mesh_binary(const std::string& path, const triangle_mesh& mesh) {
+  mesh_header header = {};
+  header.file = make_file_header(mesh_magic, mesh_version);
+  header.vertex_count = mesh.vertex_count();
+  header.triangle_count = mesh.triangle_count();
+  header.order_count = mesh.order.size();
+  header.node_count = mesh.bvh.nodes.size();
+  header.flags = (mesh.normals.empty() ? 0 : has_normals) |
+                 (mesh.uvs.empty() ? 0 : has_uvs);
+  const auto s = sections(header);
+
+  return write_file_atomically(path, [&](std::ostream& out) {
+    auto write_at = [&](size_t offset, const void* data, size_t size) {
+      // Zero padding up to the aligned offset.
+      static const char zeros[64] = {};
+      const auto at = static_cast<size_t>(out.tellp());
+      out.write(zeros, static_cast<std::streamsize>(offset - at));
+      out.write(static_cast<const char*>(data),
+                static_cast<std::streamsize>(size));
+    };
+    write_at(0, &header, sizeof(header));
+    write_at(s.positions, mesh.positions.data(), mesh.positions.size_bytes());
+    write_at(s.normals, mesh.normals.data(), mesh.normals.size_bytes());
+    write_at(s.uvs, mesh.uvs.data(), mesh.uvs.size_bytes());
+    write_at(s.indices, mesh.indices.data(), mesh.indices.size_bytes());
+    write_at(s.order, mesh.order.data(), mesh.order.size_bytes());
+    write_at(s.nodes, mesh.bvh.nodes.data(),
+             mesh.bvh.nodes.size() * sizeof(linear_bvh_node));
+  });
+}
+
+std::shared_ptr<triangle_mesh> load_mesh(const std::string& path,
+                                         std::shared_ptr<material> mat) {
+  stopwatch sw;
+  if (has_extension(path, ".rtmesh")) {
+    auto mesh = load_mesh_binary(path, std::move(mat));
+    if (mesh) {
+      std::cout << "Mesh load time: " << sw.elapsed() << "s, "
+                << mesh->triangle_count() << " triangles\n";
+    }
+    return mesh;
+  }
+
+  mesh_data data;
+  bool ok = false;
+  if (has_extension(path, ".obj")) {
+    ok = load_obj(path, data);
+  } else if (has_extension(path, ".ply")) {
+    ok = load_ply(path, data);
+  } else {
+    std::cout << "Unknown mesh format: " << path << "\n";
+  }
+  if (!ok)
+    return nullptr;
+  const auto load_time = sw.elapsed();
+  auto mesh = std::make_shared<triangle_mesh>(std::move(data), std::move(mat));
+  mesh->build();
+  std::cout << "Mesh load time: " << load_time
+            << "s, build time: " << sw.elapsed() - load_time << "s, "
+            << mesh->triangle_count() << " triangles\n";
+  return mesh;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "triangle_mesh.h"
+
+// stl
+#include <string>
+
+// Mesh loaders. They print the reason and return false, or nullptr, if a file
+// can not be read.
+
+// Wavefront OBJ: v, vt, vn and f statements. Polygons are split into
+// triangle fans; vertices are shared where position, uv and normal all match.
+// Normals and uvs are kept only if every face has them.
+bool load_obj(const std::string& path, mesh_data& out);
+
+// PLY, ASCII or binary in either byte order, with x, y, z and optionally
+// nx, ny, nz and u, v (or s, t) per vertex. Polygons are split into fans.
+bool load_ply(const std::string& path, mesh_data& out);
+
+// The binary mesh format: the vertex and index buffers and the BVH, each
+// aligned to 64 bytes, so that the file is mapped and used in place. Only the
+// nodes are copied.
+std::shared_ptr<triangle_mesh> load_mesh_binary(const std::string& path,
+                                                std::shared_ptr<material> mat);
+
+// The mesh must have been built. Writes to a temporary file first.
+bool save_mesh_binary(const std::string& path, const triangle_mesh& mesh);
+
+// Loads by file extension (.obj, .ply or .rtmesh) and builds the BVH if the
+// file did not contain one.
+std::shared_ptr<triangle_mesh> load_mesh(const std::string& path,
+                                         std::shared_ptr<material> mat);
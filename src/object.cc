@@ -1,7 +1,16 @@
 #include "object.h"
 #include "bvh.h"
+#include "bvh_cache.h"
 #include "common.h"
-
+#include "compiled_scene.h"
+#include "lbvh.h"
+#include "linear_bvh.h"
+#include "quantized_bvh.h"
+#include "thread_pool.h"
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <bit>
 #include <cfloat>
 #include <cmath>
 #include <mutex>
@@ -23,20 +32,55 @@ void get_plane_uv(const vec3& p, real_t& u, real_t& v) {
   v = p.z();
 }
 
+uint32_t hittable::compile(compiled_scene& scene) const {
+  return scene.add(this);
+}
+
+uint64_t hittable::hit_packet(const ray_packet& packet, uint64_t lanes,
+                              real_t t_min, hit_record* recs) const {
+  uint64_t hits = 0;
+  for (; lanes; lanes &= lanes - 1) {
+    const int i = std::countr_zero(lanes);
+    if (hit(packet.rays[i], t_min, recs[i].t, recs[i]))
+      hits |= uint64_t(1) << i;
+  }
+  return hits;
+}
+
 bool hittable_list::hit(const ray &r, real_t t_min, real_t t_max, hit_record &rec) const {
-  hit_record cur_rec;
+  // Objects only write rec on a hit, so it always holds the closest so far.
   bool hit_anything = false;
-  auto closest_so_far = t_max;
-  for (const auto& obj : objects) {
-    if (obj->hit(r, t_min, closest_so_far, cur_rec)) {
+  if (accel && accel->hit(r, t_min, t_max, rec)) {
+    hit_anything = true;
+    t_max = rec.t;
+  }
+  for (const auto& obj : accel ? unbounded : objects) {
+    if (obj->hit(r, t_min, t_max, rec)) {
       hit_anything = true;
-      closest_so_far = cur_rec.t;
-      rec = cur_rec;
+      t_max = rec.t;
     }
   }
   return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  if (accel && accel->occluded(r, t_min, t_max))
+    return true;
+  for (const auto& obj : accel ? unbounded : objects) {
+    if (obj->occluded(r, t_min, t_max))
+      return true;
+  }
+  return false;
+}
+
+uint64_t hittable_list::hit_packet(const ray_packet& packet, uint64_t lanes,
+                                   real_t t_min, hit_record* recs) const {
+  uint64_t hits = accel ? accel->hit_packet(packet, lanes, t_min, recs) : 0;
+  for (const auto& obj : accel ? unbounded : objects)
+    hits |= obj->hit_packet(packet, lanes, t_min, recs);
+  return hits;
+}
+
 bool hittable_list::bounding_box(real_t time0, real_t time1,
                                  aabb& output_box) const {
   if (objects.empty())
@@ -55,45 +99,213 @@ bool hittable_list::bounding_box(real_t time0, real_t time1,
   return true;
 }
 
-void hittable_list::build_bvh() {
+void hittable_list::build_bvh(size_t leaf_size, size_t thread_count,
+                              bool use_cache) {
   stopwatch sw;
-  bvh_root = bvh_node::build(objects, 0, 1);
-  std::cout << "BVH build time: " << sw.elapsed() << "s\n";
+  max_leaf_size = leaf_size;
+  std::vector<std::shared_ptr<hittable>> bounded;
+  unbounded.clear();
+  for (const auto& obj : objects) {
+    aabb box;
+    if (obj->bounding_box(time0, time1, box)) {
+      bounded.push_back(obj);
+    } else {
+      unbounded.push_back(obj);
+    }
+  }
+  // Small trees build faster than the cache can be checked, and the Morton
+  // order builders are meant for scenes that change every frame.
+  std::string cache_path;
+  uint64_t cache_key = 0;
+  bvh.reset();
+  if (use_cache && !bvh_cache_dir.empty() && bounded.size() >= 4096 &&
+      builder == bvh_builder::sah) {
+    cache_key = bvh_cache_key(bounded, time0, time1, max_leaf_size,
+                              spatial_split_budget);
+    cache_path = bvh_cache_path(bvh_cache_dir, cache_key);
+    bvh = load_bvh_cache(cache_path, cache_key, bounded);
+  }
+  const bool cached = bvh != nullptr;
+
+  if (!cached) {
+    auto pool = make_temporary_pool(bounded.size(), thread_count);
+    if (builder == bvh_builder::sah) {
+      auto root = bvh_node::build(bounded, time0, time1, max_leaf_size,
+                                  pool.get(), spatial_split_budget);
+      bvh = std::make_shared<linear_bvh>(*root);
+    } else {
+      lbvh_options options;
+      options.max_leaf_size = max_leaf_size;
+      options.morton_bits = morton_bits;
+      options.sah_top_levels = builder == bvh_builder::hlbvh;
+      bvh = build_lbvh(bounded, time0, time1, options, pool.get());
+    }
+    bvh->compute_motion(time0, time1);
+    if (!cache_path.empty()) {
+      if (!save_bvh_cache(cache_path, cache_key, *bvh, bounded))
+        std::cout << "Failed to write BVH cache " << cache_path << "\n";
+      trim_bvh_cache(bvh_cache_dir, bvh_cache_max_bytes);
+    }
+  }
+  built_sah_cost = bvh->sah_cost();
+  set_layout(layout);
+  std::cout << (cached ? "BVH load time: " : "BVH build time: ") << sw.elapsed()
+            << "s, "
+            << "SAH cost: " << built_sah_cost << ", "
+            << "nodes: " << bvh->nodes.size() << "\n";
+}
+
+void hittable_list::update(const std::vector<std::shared_ptr<hittable>>& added,
+                           const std::vector<const hittable*>& removed) {
+  std::unordered_set<const hittable*> removed_set(removed.begin(),
+                                                  removed.end());
+  auto erase_removed = [&](std::vector<std::shared_ptr<hittable>>& list) {
+    list.erase(std::remove_if(list.begin(), list.end(),
+                              [&](const auto& obj) {
+                                return removed_set.count(obj.get()) > 0;
+                              }),
+               list.end());
+  };
+
+  objects.insert(objects.end(), added.begin(), added.end());
+  if (!bvh) {
+    erase_removed(objects);
+    return;
+  }
+
+  std::vector<hittable*> added_bounded;
+  for (const auto& obj : added) {
+    aabb box;
+    if (obj->bounding_box(time0, time1, box)) {
+      added_bounded.push_back(obj.get());
+    } else {
+      unbounded.push_back(obj);
+    }
+  }
+
+  // The BVH holds raw pointers, so update it before the objects are released.
+  bool updated = bvh->update(added_bounded, removed_set, time0, time1);
+  erase_removed(objects);
+  erase_removed(unbounded);
+  // Scenes edited frame by frame would fill the cache with trees that are
+  // never loaded again.
+  if (!updated || bvh->sah_cost() > rebuild_threshold * built_sah_cost) {
+    build_bvh(max_leaf_size, std::thread::hardware_concurrency(), false);
+    return;
+  }
+  derive_layout();
+}
+
+void hittable_list::refit() {
+  if (!bvh)
+    return;
+  bvh->refit(time0, time1);
+  if (bvh->sah_cost() > rebuild_threshold * built_sah_cost) {
+    build_bvh(max_leaf_size, std::thread::hardware_concurrency(), false);
+    return;
+  }
+  // Same topology, so the derived layout is refit in place too.
+  switch (layout) {
+    case bvh_layout::binary:
+      break;
+    case bvh_layout::wide4:
+      static_cast<wide_bvh<4>*>(accel.get())->refit(time0, time1);
+      break;
+    case bvh_layout::wide8:
+      static_cast<wide_bvh<8>*>(accel.get())->refit(time0, time1);
+      break;
+    case bvh_layout::quantized:
+      static_cast<quantized_bvh*>(accel.get())->refit(time0, time1);
+      break;
+    case bvh_layout::compiled:
+      static_cast<compiled_scene*>(accel.get())->refit(*bvh);
+      break;
+  }
+}
+
+void hittable_list::set_layout(bvh_layout l) {
+  layout = l;
+  if (!bvh)
+    return;
+  const size_t bytes = derive_layout();
+  // Only worth reporting for the scene, not every small nested list.
+  if (bvh->prims.size() >= 4096) {
+    std::cout << "BVH memory: " << bytes / (1024.0 * 1024.0) << " MiB, "
+              << static_cast<real_t>(bytes) / bvh->prims.size()
+              << " bytes/primitive\n";
+  }
+}
+
+size_t hittable_list::derive_layout() {
+  size_t bytes = 0;
+  switch (layout) {
+    case bvh_layout::binary:
+      accel = bvh;
+      bytes = bvh->memory_usage();
+      break;
+    case bvh_layout::wide4: {
+      auto wide = std::make_shared<wide_bvh<4>>(*bvh);
+      bytes = wide->memory_usage();
+      accel = std::move(wide);
+      break;
+    }
+    case bvh_layout::wide8: {
+      auto wide = std::make_shared<wide_bvh<8>>(*bvh);
+      bytes = wide->memory_usage();
+      accel = std::move(wide);
+      break;
+    }
+    case bvh_layout::quantized: {
+      auto quantized = std::make_shared<quantized_bvh>(*bvh);
+      bytes = quantized->memory_usage();
+      accel = std::move(quantized);
+      break;
+    }
+    case bvh_layout::compiled: {
+      auto compiled = std::make_shared<compiled_scene>(*bvh);
+      bytes = compiled->memory_usage();
+      accel = std::move(compiled);
+      break;
+    }
+  }
+  return bytes;
 }
 
 bool sphere::hit(const ray& r, real_t t_min, real_t t_max,
                  hit_record& rec) const {
-  // Ray Center: R
-  // Sphere Center: S
-  // Day Direction: d
-  // Ray Eq: R(t) = R + td
-  // ((t^2)d ⋅ d) + (2td ⋅ (R−S)) + ((R−S) ⋅ (R−S)) − r^2 = 0
-  const auto& R = r.origin();
-  const auto& S = center;
-  const auto& d = r.direction();
-  // D: From sphere center to ray origin
-  auto SR = R - S;
-  // At^2 + Bt + C = 0, solve for t
-  auto A = d.dot(d);
-  auto B = 2 * d.dot(SR);
-  auto C = SR.dot(SR) - radius * radius;
-  auto discriminant = B * B - 4 * A * C;
-  if (discriminant < 0) {
+  real_t t;
+  if (!intersect(r, t_min, t_max, t))
     return false;
-  }
-  auto t = (-B - sqrt(discriminant)) / (2 * A);
-  if (t < t_min || t > t_max) {
-    return false;
-  }
   rec.t = t;
-  rec.p = r.at(t);
-  vec3 outward_normal = (rec.p - S) / radius;
-  rec.set_face_normal(r, outward_normal);
+  rec.object = this;
+  return true;
+}
+
+void sphere::finish_hit(const ray& r, hit_record& rec) const {
+  finish(r, rec);
+  rec.mat = mat.get();
+}
+
+bool sphere::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  real_t t;
+  return intersect(r, t_min, t_max, t);
+}
+
+bool sphere::sample_surface(hit_record& rec) const {
+  const vec3 outward_normal = random_unit_vector();
+  rec.p = center + radius * outward_normal;
+  rec.normal = outward_normal;
   get_sphere_uv(outward_normal, rec.u, rec.v);
   rec.mat = mat.get();
   return true;
 }
 
+real_t sphere::area() const { return 4 * M_PI * radius * radius; }
+
+uint32_t sphere::compile(compiled_scene& scene) const {
+  return scene.add(*this, mat.get());
+}
+
 bool sphere::bounding_box(real_t time0, real_t time1, aabb& out) const {
   out = aabb(center - vec3(radius, radius, radius),
              center + vec3(radius, radius, radius));
@@ -102,37 +314,28 @@ bool sphere::bounding_box(real_t time0, real_t time1, aabb& out) const {
 
 bool moving_sphere::hit(const ray& r, real_t t_min, real_t t_max,
                         hit_record& rec) const {
-  // Ray Center: R
-  // Sphere Center: S
-  // Day Direction: d
-  // Ray Eq: R(t) = R + td
-  // ((t^2)d ⋅ d) + (2td ⋅ (R−S)) + ((R−S) ⋅ (R−S)) − r^2 = 0
-  const auto& R = r.origin();
-  const auto& S = center(r.time());
-  const auto& d = r.direction();
-  // D: From sphere center to ray origin
-  auto SR = R - S;
-  // At^2 + Bt + C = 0, solve for t
-  auto A = d.dot(d);
-  auto B = 2 * d.dot(SR);
-  auto C = SR.dot(SR) - radius * radius;
-  auto discriminant = B * B - 4 * A * C;
-  if (discriminant < 0) {
+  real_t t;
+  if (!intersect(r, t_min, t_max, t))
     return false;
-  }
-  auto t = (-B - sqrt(discriminant)) / (2 * A);
-  if (t < t_min || t > t_max) {
-    return false;
-  }
   rec.t = t;
-  rec.p = r.at(t);
-  vec3 outward_normal = (rec.p - S) / radius;
-  rec.set_face_normal(r, outward_normal);
-  get_sphere_uv(outward_normal, rec.u, rec.v);
-  rec.mat = mat.get();
+  rec.object = this;
   return true;
 }
 
+void moving_sphere::finish_hit(const ray& r, hit_record& rec) const {
+  finish(r, rec);
+  rec.mat = mat.get();
+}
+
+bool moving_sphere::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  real_t t;
+  return intersect(r, t_min, t_max, t);
+}
+
+uint32_t moving_sphere::compile(compiled_scene& scene) const {
+  return scene.add(*this, mat.get());
+}
+
 bool moving_sphere::bounding_box(real_t time0, real_t time1, aabb& out) const {
   out = (aabb(center(time0) - vec3(radius, radius, radius),
               center(time0) + vec3(radius, radius, radius))
@@ -161,181 +364,162 @@ bool plane::hit(const ray& r, real_t t_min, real_t t_max,
     return false;
   }
   rec.t = t;
-  rec.p = r.at(t);
-  rec.set_face_normal(r, n);
+  rec.object = this;
+  return true;
+}
+
+void plane::finish_hit(const ray& r, hit_record& rec) const {
+  rec.p = r.at(rec.t);
+  rec.set_face_normal(r, normal);
   get_plane_uv(rec.p, rec.u, rec.v);
   rec.mat = mat.get();
-  return true;
+}
+
+bool plane::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  auto t = (center - r.origin()).dot(normal) / r.direction().dot(normal);
+  return t >= t_min && t <= t_max;
 }
 
 bool plane::bounding_box(real_t time0, real_t time1, aabb& out) const {
   return false;
 }
 
-bool xy_rect::hit(const ray& r, real_t t_min, real_t t_max,
-                  hit_record& rec) const {
-  auto t = (k - r.origin().z()) / r.direction().z();
-  if (t < t_min || t > t_max)
-    return false;
-  auto x = r.origin().x() + t * r.direction().x();
-  auto y = r.origin().y() + t * r.direction().y();
-  if (x < x0 || x > x1 || y < y0 || y > y1)
+bool quad::hit(const ray& r, real_t t_min, real_t t_max,
+               hit_record& rec) const {
+  real_t t, alpha, beta;
+  if (!intersect(r, t_min, t_max, t, alpha, beta))
     return false;
-  rec.u = (x - x0) / (x1 - x0);
-  rec.v = (y - y0) / (y1 - y0);
   rec.t = t;
-  auto outward_normal = vec3(0, 0, 1);
-  rec.set_face_normal(r, outward_normal);
-  rec.mat = this->mat.get();
-  rec.p = r.at(t);
-  return true;
-}
-
-bool xy_rect::bounding_box(real_t time0, real_t time1, aabb& out) const {
-  out =
-    aabb(vec3(x0, y0, k - 0.0001), vec3(x1, y1, k + 0.0001));  // Pad a little
+  rec.u = alpha;
+  rec.v = beta;
+  rec.object = this;
   return true;
 }
 
-bool xz_rect::hit(const ray& r, real_t t_min, real_t t_max,
-                  hit_record& rec) const {
-  auto t = (k - r.origin().y()) / r.direction().y();
-  if (t < t_min || t > t_max)
-    return false;
-  auto x = r.origin().x() + t * r.direction().x();
-  auto z = r.origin().z() + t * r.direction().z();
-  if (x < x0 || x > x1 || z < z0 || z > z1)
-    return false;
-  rec.u = (x - x0) / (x1 - x0);
-  rec.v = (z - z0) / (z1 - z0);
-  rec.t = t;
-  auto outward_normal = vec3(0, 1, 0);
-  rec.set_face_normal(r, outward_normal);
+void quad::finish_hit(const ray& r, hit_record& rec) const {
+  finish(r, rec);
   rec.mat = mat.get();
-  rec.p = r.at(t);
-  return true;
 }
 
-bool xz_rect::bounding_box(real_t time0, real_t time1, aabb& output_box) const {
-  output_box = aabb(point3(x0, k - 0.0001, z0),
-                    point3(x1, k + 0.0001, z1));  // Pad a little
-  return true;
+bool quad::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  real_t t, alpha, beta;
+  return intersect(r, t_min, t_max, t, alpha, beta);
 }
 
-bool yz_rect::hit(const ray& r, real_t t_min, real_t t_max,
-                  hit_record& rec) const {
-  auto t = (k - r.origin().x()) / r.direction().x();
-  if (t < t_min || t > t_max)
-    return false;
-  auto y = r.origin().y() + t * r.direction().y();
-  auto z = r.origin().z() + t * r.direction().z();
-  if (y < y0 || y > y1 || z < z0 || z > z1)
-    return false;
-  rec.u = (y - y0) / (y1 - y0);
-  rec.v = (z - z0) / (z1 - z0);
-  rec.t = t;
-  auto outward_normal = vec3(1, 0, 0);
-  rec.set_face_normal(r, outward_normal);
+bool quad::sample_surface(hit_record& rec) const {
+  rec.u = random_real();
+  rec.v = random_real();
+  rec.p = q + rec.u * u + rec.v * v;
+  rec.normal = normal;
   rec.mat = mat.get();
-  rec.p = r.at(t);
   return true;
 }
 
-bool yz_rect::bounding_box(real_t time0, real_t time1, aabb& output_box) const {
-  output_box = aabb(point3(k - 0.0001, y0, z0),
-                    point3(k + 0.0001, y1, z1));  // Pad a little
-  return true;
-}
-
-// Transforms
+real_t quad::area() const { return u.cross(v).length(); }
 
-bool translate::hit(const ray& r, real_t t_min, real_t t_max,
-                    hit_record& rec) const {
-  ray moved_r(r.origin() - offset, r.direction(), r.time());
-  if (!ptr->hit(moved_r, t_min, t_max, rec))
-    return false;
-
-  rec.p += offset;
-  rec.set_face_normal(moved_r, rec.normal);
+uint32_t quad::compile(compiled_scene& scene) const {
+  return scene.add(*this, mat.get());
+}
 
+bool quad::bounding_box(real_t time0, real_t time1, aabb& out) const {
+  out = aabb::empty();
+  for (const auto& corner : {q, q + u, q + v, q + u + v})
+    out = out.surrounding(aabb(corner, corner));
+  for (int a = 0; a < 3; a++) {  // Pad a little, the quad may be flat
+    out.min[a] -= 0.0001;
+    out.max[a] += 0.0001;
+  }
   return true;
 }
 
-bool translate::bounding_box(real_t time0, real_t time1,
-                             aabb& output_box) const {
-  if (!ptr->bounding_box(time0, time1, output_box))
+bool box::hit(const ray& r, real_t t_min, real_t t_max,
+              hit_record& rec) const {
+  real_t t;
+  if (!intersect(r, t_min, t_max, t))
     return false;
-
-  output_box = aabb(output_box.min + offset, output_box.max + offset);
-
+  rec.t = t;
+  rec.object = this;
   return true;
 }
 
-rotate_y::rotate_y(std::shared_ptr<hittable> p, real_t angle) : ptr(p) {
-  auto radians = deg2rad(angle);
-  sin_theta = sin(radians);
-  cos_theta = cos(radians);
-  has_box = ptr->bounding_box(0, 1, bbox);
-
-  point3 min(INFINITY, INFINITY, INFINITY);
-  point3 max(-INFINITY, -INFINITY, -INFINITY);
+void box::finish_hit(const ray& r, hit_record& rec) const {
+  finish(r, rec);
+  rec.mat = mat.get();
+}
 
-  for (int i = 0; i < 2; i++) {
-    for (int j = 0; j < 2; j++) {
-      for (int k = 0; k < 2; k++) {
-        auto x = i * bbox.max.x() + (1 - i) * bbox.min.x();
-        auto y = j * bbox.max.y() + (1 - j) * bbox.min.y();
-        auto z = k * bbox.max.z() + (1 - k) * bbox.min.z();
+bool box::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  real_t t;
+  return intersect(r, t_min, t_max, t);
+}
 
-        auto newx = cos_theta * x + sin_theta * z;
-        auto newz = -sin_theta * x + cos_theta * z;
+uint32_t box::compile(compiled_scene& scene) const {
+  return scene.add(*this, mat.get());
+}
 
-        vec3 tester(newx, y, newz);
+// Transforms
 
-        for (int c = 0; c < 3; c++) {
-          min[c] = fmin(min[c], tester[c]);
-          max[c] = fmax(max[c], tester[c]);
-        }
-      }
-    }
-  }
+instance::instance(std::shared_ptr<hittable> object,
+                   const mat3x4& object_to_world)
+    : hittable(object->mat), object(std::move(object)) {
+  set_transform(object_to_world);
+}
 
-  bbox = aabb(min, max);
+void instance::set_transform(const mat3x4& xf) {
+  object_to_world = xf;
+  world_to_object = xf.inverse();
+  has_box = object->bounding_box(0, 1, bbox);
+  if (has_box)
+    bbox = object_to_world.apply(bbox);
 }
 
-bool rotate_y::bounding_box(real_t time0, real_t time1,
+bool instance::bounding_box(real_t time0, real_t time1,
                             aabb& output_box) const {
   output_box = bbox;
   return has_box;
 }
 
-bool rotate_y::hit(const ray& r, real_t t_min, real_t t_max,
+bool instance::hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const {
-  auto origin = r.origin();
-  auto direction = r.direction();
-
-  origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-  origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-  direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-  direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-  ray rotated_r(origin, direction, r.time());
-
-  if (!ptr->hit(rotated_r, t_min, t_max, rec))
+  // The direction is not renormalized, so t means the same in both spaces.
+  ray object_r(world_to_object.apply_point(r.origin()),
+               world_to_object.apply_vector(r.direction()), r.time());
+  if (!object->hit(object_r, t_min, t_max, rec))
     return false;
 
-  auto p = rec.p;
-  auto normal = rec.normal;
-
-  p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
-  p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
+  // A hit record has room for one inner object, so a hit on an instance
+  // nested in this one is finished right away, in this one's object space.
+  // transformed() folds chains of instances, so this is rare.
+  if (rec.object && rec.object->as_instance()) {
+    rec.object->finish_hit(object_r, rec);
+    rec.inner = nullptr;
+  } else {
+    rec.inner = rec.object;
+  }
+  rec.object = this;
+  return true;
+}
 
-  normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
-  normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
+void instance::finish_hit(const ray& r, hit_record& rec) const {
+  if (rec.inner) {
+    ray object_r(world_to_object.apply_point(r.origin()),
+                 world_to_object.apply_vector(r.direction()), r.time());
+    rec.inner->finish_hit(object_r, rec);
+  }
+  // front_face carries over: the dot product of the direction and the
+  // normal keeps its sign under the inverse transpose.
+  rec.p = r.at(rec.t);
+  rec.normal = world_to_object.apply_transpose(rec.normal).normalized();
+}
 
-  rec.p = p;
-  rec.set_face_normal(rotated_r, normal);
+bool instance::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  ray object_r(world_to_object.apply_point(r.origin()),
+               world_to_object.apply_vector(r.direction()), r.time());
+  return object->occluded(object_r, t_min, t_max);
+}
 
-  return true;
+std::shared_ptr<hittable> transformed(std::shared_ptr<hittable> obj,
+                                      const mat3x4& xf) {
+  if (auto* inst = obj->as_instance())
+    return std::make_shared<instance>(inst->object, xf * inst->object_to_world);
+  return std::make_shared<instance>(std::move(obj), xf);
 }
@@ -2,11 +2,16 @@
 
 #include "aabb.h"
 #include "material.h"
+#include "ray_packet.h"
+#include "shapes.h"
 #include "stopwatch.h"
+#include "transform.h"
 
 // stl
 #include <iostream>
 #include <shared_mutex>
+#include <string>
+#include <thread>
 
 struct hittable {
   virtual ~hittable() = default;
@@ -14,21 +19,82 @@ struct hittable {
 
   explicit hittable(std::shared_ptr<material> m) : mat(std::move(m)) {}
 
+  // Finds the closest hit in [t_min, t_max]. rec is only written on a hit,
+  // and only as far as needed to tell the hits apart and finish the closest.
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const = 0;
 
+  // Fills in the point, normal, texture coordinates and material of a hit
+  // that hit() recorded with rec.object == this, for the same ray. Deferred
+  // so that candidates closer hits replace never pay for them.
+  virtual void finish_hit(const ray& r, hit_record& rec) const {}
+
+  // Whether anything is hit in [t_min, t_max], for shadow and visibility
+  // rays. Overrides stop at the first hit found and fill no hit record.
+  virtual bool occluded(const ray& r, real_t t_min, real_t t_max) const {
+    hit_record rec;
+    return hit(r, t_min, t_max, rec);
+  }
+
+  // Closest hits for the rays of a packet in lanes, one record per lane.
+  // Lane i searches [t_min, recs[i].t], so records start at INFINITY or at a
+  // hit found earlier, and are written as by hit(). Returns the lanes that
+  // hit. By default the rays are traced one by one.
+  virtual uint64_t hit_packet(const ray_packet& packet, uint64_t lanes,
+                              real_t t_min, hit_record* recs) const;
+
   virtual bool bounding_box(real_t time0, real_t time1, aabb& out) const = 0;
 
+  // For sampling emitters directly: picks a point on the surface, uniformly
+  // by area, and fills in its point, outward normal, texture coordinates and
+  // material. Returns false for primitives that cannot be sampled.
+  virtual bool sample_surface(hit_record& rec) const { return false; }
+
+  // Surface area of the primitives that can be sampled.
+  virtual real_t area() const { return 0; }
+
   virtual class bvh_node* as_bvh_node() { return nullptr; }
 
+  virtual const struct instance* as_instance() const { return nullptr; }
+
+  // Adds the primitive to a compiled scene and returns its id there. Types
+  // without a compiled form are added as themselves.
+  virtual uint32_t compile(struct compiled_scene& scene) const;
+
   std::shared_ptr<material> mat = nullptr;
 };
 
+// Algorithm that builds the BVH of a hittable_list.
+enum class bvh_builder : int {
+  sah = 0,  // Binned SAH, best trees
+  lbvh,     // Morton order, fastest build
+  hlbvh     // Morton order below, SAH above the clusters
+};
+
+// Node layout of the acceleration structure traversed by hittable_list::hit.
+// Only binary traces packets together; the others fall back to hittable's
+// lane by lane hit_packet.
+enum class bvh_layout : int {
+  binary = 0,
+  wide4,
+  wide8,
+  quantized,
+  compiled  // Binary, over the primitives compiled into flat arrays
+};
+
 struct hittable_list : public hittable {
 
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const override;
 
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  // Traverses the binary BVH whatever the layout, as only it has a packet
+  // traversal.
+  virtual uint64_t hit_packet(const ray_packet& packet, uint64_t lanes,
+                              real_t t_min, hit_record* recs) const override;
+
   virtual bool bounding_box(double time0, double time1,
                             aabb& output_box) const override;
 
@@ -38,53 +104,105 @@ struct hittable_list : public hittable {
 
   void clear_objects() {
     objects.clear();
-    bvh_root.reset();
+    unbounded.clear();
+    bvh.reset();
+    accel.reset();
   }
 
-  void build_bvh();
-
-  std::shared_ptr<struct bvh_node> bvh_root;
+  // Builds the acceleration structure over the objects. Objects without a
+  // bounding box (e.g. planes) are kept aside and intersected linearly.
+  // Large scenes are built on a temporary pool of thread_count threads.
+  // Moving objects get bounds at both ends of [time0, time1] for the binary
+  // layout; the wide layouts bound the whole motion. Large trees are cached in
+  // bvh_cache_dir, if set and use_cache, and loaded from there when the
+  // scene is unchanged.
+  void build_bvh(size_t leaf_size = 4,
+                 size_t thread_count = std::thread::hardware_concurrency(),
+                 bool use_cache = true);
+
+  // Recompiles the built BVH into the given layout, no rebuild needed.
+  // update() and refit() keep the layout, deriving it again only when the
+  // topology changed.
+  void set_layout(bvh_layout layout);
+
+  // Adds and removes objects without a full rebuild. New objects go into the
+  // leaves they enlarge the least and the bounds are refit. Once the SAH cost
+  // has degraded past rebuild_threshold times that of the last build, the BVH
+  // is rebuilt from scratch instead.
+  void update(const std::vector<std::shared_ptr<hittable>>& added,
+              const std::vector<const hittable*>& removed);
+  void insert_object(std::shared_ptr<hittable> obj) { update({obj}, {}); }
+  void remove_object(const hittable* obj) { update({}, {obj}); }
+
+  // Recomputes the BVH bounds after objects were moved or resized in place.
+  // Cheap, but the tree quality degrades the further objects travel; past
+  // rebuild_threshold, as for update(), the BVH is rebuilt instead.
+  void refit();
+
+  bvh_layout layout = bvh_layout::binary;
+  real_t time0 = 0;  // Shutter interval covered by the BVH bounds
+  real_t time1 = 1;
+  size_t max_leaf_size = 4;
+  bvh_builder builder = bvh_builder::sah;
+  int morton_bits = 30;  // For the Morton order builders, 30 or 63
+  // Extra references spatial splits may add, as a fraction of the object
+  // count. Zero builds without spatial splits.
+  real_t spatial_split_budget = 0;
+  std::string bvh_cache_dir;  // Empty disables the cache
+  // Past this, the least recently used cache files are deleted.
+  uint64_t bvh_cache_max_bytes = uint64_t(1) << 30;
+  real_t rebuild_threshold = 1.5;
+  real_t built_sah_cost = 0;
+  std::shared_ptr<struct linear_bvh> bvh;
+  std::shared_ptr<hittable> accel;  // bvh compiled to the selected layout
   std::vector<std::shared_ptr<hittable>> objects;
+  std::vector<std::shared_ptr<hittable>> unbounded;
+
+ protected:
+  // Compiles accel from bvh, returns its size in bytes.
+  size_t derive_layout();
 };
 
-struct sphere : public hittable {
+struct sphere : public hittable, sphere_shape {
   sphere(point3 cen, real_t r, std::shared_ptr<material> mat)
-      : hittable(mat), center(cen), radius(r) {}
+      : hittable(mat), sphere_shape{cen, r} {}
 
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const override;
 
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
+
   virtual bool bounding_box(real_t time0, real_t time1,
                             aabb& out) const override;
 
-  point3 center;
-  real_t radius;
+  virtual bool sample_surface(hit_record& rec) const override;
+
+  virtual real_t area() const override;
+
+  virtual uint32_t compile(compiled_scene& scene) const override;
 };
 
 // TODO: Remove this
-struct moving_sphere : public hittable {
+struct moving_sphere : public hittable, moving_sphere_shape {
   moving_sphere(point3 cen0, point3 cen1, real_t t0, real_t t1, real_t r,
                 std::shared_ptr<material> mat)
-      : hittable(mat),
-        center0(cen0),
-        center1(cen1),
-        time0(t0),
-        time1(t1),
-        radius(r) {}
+      : hittable(mat), moving_sphere_shape{cen0, cen1, t0, t1, r} {}
 
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const override;
 
-  point3 center(real_t time) const {
-    return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
-  }
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
 
   virtual bool bounding_box(real_t time0, real_t time1,
                             aabb& out) const override;
 
-  point3 center0, center1;
-  real_t time0, time1;
-  real_t radius;
+  virtual uint32_t compile(compiled_scene& scene) const override;
 };
 
 struct plane : public hittable {
@@ -94,6 +212,11 @@ struct plane : public hittable {
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const override;
 
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
+
   virtual bool bounding_box(real_t time0, real_t time1,
                             aabb& out) const override;
 
@@ -101,73 +224,42 @@ struct plane : public hittable {
   vec3 normal;
 };
 
-struct xy_rect : public hittable {
-  xy_rect(real_t x0, real_t x1, real_t y0, real_t y1, real_t k,
-          std::shared_ptr<material> mat)
-      : hittable(mat), x0(x0), x1(x1), y0(y0), y1(y1), k(k) {}
+struct quad : public hittable, quad_shape {
+  quad(const point3& q, const vec3& u, const vec3& v,
+       std::shared_ptr<material> mat)
+      : hittable(mat) {
+    set(q, u, v);
+  }
 
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const override;
 
-  virtual bool bounding_box(real_t time0, real_t time1,
-                            aabb& out) const override;
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
 
-  real_t x0, x1, y0, y1, k;
-};
-
-struct xz_rect : public hittable {
-  xz_rect(real_t x0, real_t x1, real_t z0, real_t z1, real_t k,
-          std::shared_ptr<material> mat)
-      : hittable(mat), x0(x0), x1(x1), z0(z0), z1(z1), k(k) {}
-
-  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
-                   hit_record& rec) const override;
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
 
   virtual bool bounding_box(real_t time0, real_t time1,
                             aabb& out) const override;
 
-  real_t x0, x1, z0, z1, k;
-};
-
-struct yz_rect : public hittable {
-  yz_rect(real_t y0, real_t y1, real_t z0, real_t z1, real_t k,
-          std::shared_ptr<material> mat)
-      : hittable(mat), y0(y0), y1(y1), z0(z0), z1(z1), k(k) {}
+  virtual bool sample_surface(hit_record& rec) const override;
 
-  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
-                   hit_record& rec) const override;
+  virtual real_t area() const override;
 
-  virtual bool bounding_box(real_t time0, real_t time1,
-                            aabb& out) const override;
-
-  real_t y0, y1, z0, z1, k;
+  virtual uint32_t compile(compiled_scene& scene) const override;
 };
 
-struct box : public hittable {
+struct box : public hittable, box_shape {
   box(point3 p0, point3 p1, std::shared_ptr<material> mat)
-      : hittable(mat), p0(p0), p1(p1) {
-    sides.add_object(
-      std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), mat));
-    sides.add_object(
-      std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), mat));
-    sides.add_object(
-      std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), mat));
-    sides.add_object(
-      std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), mat));
-    sides.add_object(
-      std::make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), mat));
-    sides.add_object(
-      std::make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), mat));
-    sides.add_object(
-      std::make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), mat));
-    sides.add_object(
-      std::make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), mat));
-  }
+      : hittable(mat), box_shape{p0, p1} {}
 
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
-                   hit_record& rec) const override {
-    return sides.hit(r, t_min, t_max, rec);
-  }
+                   hit_record& rec) const override;
+
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
 
   virtual bool bounding_box(real_t time0, real_t time1,
                             aabb& out) const override {
@@ -175,40 +267,54 @@ struct box : public hittable {
     return true;
   }
 
-  point3 p0, p1;
-  hittable_list sides;
+  virtual uint32_t compile(compiled_scene& scene) const override;
 };
 
-struct translate : public hittable {
-  translate(std::shared_ptr<hittable> p, const vec3& displacement)
-      : hittable(p->mat), ptr(p), offset(displacement) {}
+// Places a shared object, usually a hittable_list with its own BVH (a bottom
+// level acceleration structure), in the world with an affine transform. Many
+// instances can reference the same object without copying it. The world BVH
+// built over the instances is the top level; after moving an instance only
+// that has to be rebuilt.
+struct instance : public hittable {
+  instance(std::shared_ptr<hittable> object, const mat3x4& object_to_world);
 
   virtual bool hit(const ray& r, real_t t_min, real_t t_max,
                    hit_record& rec) const override;
 
-  virtual bool bounding_box(real_t time0, real_t time1,
-                            aabb& out) const override;
-
-  virtual class bvh_node* as_bvh_node() override { return ptr->as_bvh_node(); }
+  // Transforms the point and normal of the inner hit to world space.
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
 
-  std::shared_ptr<hittable> ptr;
-  vec3 offset;
-};
-
-struct rotate_y : public hittable {
-  rotate_y(std::shared_ptr<hittable> p, real_t angle);
-
-  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
-                   hit_record& rec) const override;
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
 
   virtual bool bounding_box(real_t time0, real_t time1,
                             aabb& out) const override;
 
-  virtual class bvh_node* as_bvh_node() override { return ptr->as_bvh_node(); }
+  void set_transform(const mat3x4& object_to_world);
+
+  const instance* as_instance() const override { return this; }
 
-  std::shared_ptr<hittable> ptr;
-  real_t sin_theta;
-  real_t cos_theta;
+  std::shared_ptr<hittable> object;
+  mat3x4 object_to_world;
+  mat3x4 world_to_object;
   bool has_box;
-  aabb bbox;
+  aabb bbox;  // In world space
 };
+
+// Places obj with the transform xf. Transforming an instance makes a new
+// instance of the same object with the combined matrix rather than nesting
+// one in the other, so a chain of transforms folds into a single matrix and
+// rays and normals are transformed once.
+std::shared_ptr<hittable> transformed(std::shared_ptr<hittable> obj,
+                                      const mat3x4& xf);
+
+inline std::shared_ptr<hittable> translate(std::shared_ptr<hittable> obj,
+                                           const vec3& offset) {
+  return transformed(std::move(obj), mat3x4::translation(offset));
+}
+
+// Positive angles turn +x towards -z.
+inline std::shared_ptr<hittable> rotate_y(std::shared_ptr<hittable> obj,
+                                          real_t degrees) {
+  return transformed(std::move(obj), mat3x4::rotation_y(degrees));
+}
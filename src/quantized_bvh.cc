@@ -0,0 +1,308 @@
+#include "quantized_bvh.h"
+
+#include "bvh_simd.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+// 2^e as a float, built from the exponent bits instead of calling ldexp.
+inline float step_size(int8_t e) {
+  uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+  float step;
+  std::memcpy(&step, &bits, sizeof(step));
+  return step;
+}
+
+// Fits a frame [origin, origin + 255 * 2^exponent] around [lo, hi] with the
+// origin a multiple of the step, so that origin + q * step is exact in float.
+void fit_frame(real_t lo, real_t hi, float& origin, int8_t& exponent) {
+  constexpr int min_exponent = -100;
+  constexpr real_t max_steps = 1 << 24;  // Float mantissa
+  int e = min_exponent;
+  if (hi > lo)
+    e = std::max(e, static_cast<int>(std::ceil(std::log2((hi - lo) / 255))));
+  while (true) {
+    real_t step = std::ldexp(1.0, e);
+    real_t k = std::floor(lo / step);
+    if (hi - k * step <= 255 * step && std::abs(k) + 255 < max_steps) {
+      origin = static_cast<float>(k * step);
+      exponent = static_cast<int8_t>(e);
+      return;
+    }
+    ++e;
+  }
+}
+
+// Largest q with origin + q * step <= x.
+uint8_t quantize_down(real_t x, real_t origin, real_t step) {
+  real_t q = std::clamp(std::floor((x - origin) / step), 0.0, 255.0);
+  while (q > 0 && origin + q * step > x)
+    --q;
+  return static_cast<uint8_t>(q);
+}
+
+// Smallest q with origin + q * step >= x.
+uint8_t quantize_up(real_t x, real_t origin, real_t step) {
+  real_t q = std::clamp(std::ceil((x - origin) / step), 0.0, 255.0);
+  while (q < 255 && origin + q * step < x)
+    ++q;
+  return static_cast<uint8_t>(q);
+}
+
+// Child bounds of a node, decoded to float.
+struct decoded_planes {
+  decoded_planes(const quantized_bvh_node& n) {
+    const uint8_t* q_mins[3] = {n.q_min_x, n.q_min_y, n.q_min_z};
+    const uint8_t* q_maxs[3] = {n.q_max_x, n.q_max_y, n.q_max_z};
+    for (int a = 0; a < 3; ++a) {
+      const float step = step_size(n.exponent[a]);
+      for (int i = 0; i < 4; ++i) {
+        min[a][i] = n.origin[a] + q_mins[a][i] * step;
+        max[a][i] = n.origin[a] + q_maxs[a][i] * step;
+      }
+    }
+  }
+
+  alignas(16) float min[3][4];
+  alignas(16) float max[3][4];
+};
+
+#ifdef RTIOW_SSE
+__m128 decode4(const uint8_t* q, __m128 origin, __m128 step) {
+  int32_t packed;
+  std::memcpy(&packed, q, 4);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i bytes = _mm_cvtsi32_si128(packed);
+  __m128i ints = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+  return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(ints), step));
+}
+#endif
+
+unsigned slab_test(const quantized_bvh_node& n, const float_ray& r,
+                   float t_min, float t_max, float* t_near) {
+  unsigned mask;
+#ifdef RTIOW_SSE
+  const uint8_t* q_mins[3] = {n.q_min_x, n.q_min_y, n.q_min_z};
+  const uint8_t* q_maxs[3] = {n.q_max_x, n.q_max_y, n.q_max_z};
+  __m128 tn = _mm_set1_ps(t_min);
+  __m128 tf = _mm_set1_ps(t_max);
+  for (int a = 0; a < 3; ++a) {
+    const __m128 origin = _mm_set1_ps(n.origin[a]);
+    const __m128 step = _mm_set1_ps(step_size(n.exponent[a]));
+    const uint8_t* near = r.negative[a] ? q_maxs[a] : q_mins[a];
+    const uint8_t* far = r.negative[a] ? q_mins[a] : q_maxs[a];
+    const __m128 org = _mm_set1_ps(r.org[a]);
+    const __m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+    __m128 t0 =
+      _mm_mul_ps(_mm_sub_ps(decode4(near, origin, step), org), inv_dir);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(decode4(far, origin, step), org), inv_dir);
+    // Operand order matters: a NaN from 0 * inf is dropped, not propagated.
+    tn = _mm_max_ps(t0, tn);
+    tf = _mm_min_ps(t1, tf);
+  }
+  tf = _mm_mul_ps(tf, _mm_set1_ps(robust_scale));
+  _mm_storeu_ps(t_near, tn);
+  mask = static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(tn, tf)));
+#else
+  const decoded_planes p(n);
+  mask = 0;
+  for (int i = 0; i < 4; ++i) {
+    float tn = t_min;
+    float tf = t_max;
+    for (int a = 0; a < 3; ++a) {
+      float near = r.negative[a] ? p.max[a][i] : p.min[a][i];
+      float far = r.negative[a] ? p.min[a][i] : p.max[a][i];
+      float t0 = (near - r.org[a]) * r.inv_dir[a];
+      float t1 = (far - r.org[a]) * r.inv_dir[a];
+      tn = t0 > tn ? t0 : tn;
+      tf = t1 < tf ? t1 : tf;
+    }
+    t_near[i] = tn;
+    if (tn <= tf * robust_scale)
+      mask |= 1u << i;
+  }
+#endif
+  return mask & ((1u << n.child_count) - 1);
+}
+
+}  // namespace
+
+void quantized_bvh_node::set_bounds(const aabb& box, const aabb* children,
+                                    int count) {
+  child_count = static_cast<uint8_t>(count);
+  uint8_t* q_mins[3] = {q_min_x, q_min_y, q_min_z};
+  uint8_t* q_maxs[3] = {q_max_x, q_max_y, q_max_z};
+  for (int a = 0; a < 3; ++a) {
+    fit_frame(box.min[a], box.max[a], origin[a], exponent[a]);
+    const real_t step = std::ldexp(1.0, exponent[a]);
+    for (int i = 0; i < 4; ++i) {
+      if (i >= count) {
+        q_mins[a][i] = 255;
+        q_maxs[a][i] = 0;
+        continue;
+      }
+      q_mins[a][i] = quantize_down(children[i].min[a], origin[a], step);
+      q_maxs[a][i] = quantize_up(children[i].max[a], origin[a], step);
+    }
+  }
+}
+
+aabb quantized_bvh_node::box(int i) const {
+  const decoded_planes p(*this);
+  return aabb(point3(p.min[0][i], p.min[1][i], p.min[2][i]),
+              point3(p.max[0][i], p.max[1][i], p.max[2][i]));
+}
+
+quantized_bvh::quantized_bvh(const linear_bvh& bvh) : prims(bvh.prims) {
+  // Reuse the collapse of the 4-wide layout, then quantize its nodes.
+  const wide_bvh<4> wide(bvh);
+  bounds = wide.bounds;
+  nodes.resize(wide.nodes.size());
+  for (size_t i = 0; i < wide.nodes.size(); ++i) {
+    const auto& w = wide.nodes[i];
+    auto& q = nodes[i];
+    aabb children[4];
+    aabb box = aabb::empty();
+    int count = 0;
+    for (; count < 4; ++count) {
+      children[count] = w.box(count);
+      if (children[count].is_empty())
+        break;
+      box = box.surrounding(children[count]);
+    }
+    q.set_bounds(box, children, count);
+    for (int c = 0; c < 4; ++c) {
+      q.child[c] = w.child[c];
+      q.prim_count[c] = w.prim_count[c];
+    }
+  }
+}
+
+void quantized_bvh::refit(real_t time0, real_t time1) {
+  // Children always come after their parent, so a reverse sweep visits them
+  // first. The exact node bounds are kept aside, requantizing the decoded
+  // ones would widen the frames at every level.
+  std::vector<aabb> node_boxes(nodes.size());
+  for (size_t i = nodes.size(); i-- > 0;) {
+    auto& node = nodes[i];
+    aabb children[4];
+    aabb box = aabb::empty();
+    for (int c = 0; c < node.child_count; ++c) {
+      if (node.prim_count[c] > 0) {
+        children[c] = linear_bvh::leaf_box(&prims[node.child[c]],
+                                           node.prim_count[c], time0, time1);
+      } else {
+        children[c] = node_boxes[node.child[c]];
+      }
+      box = box.surrounding(children[c]);
+    }
+    node.set_bounds(box, children, node.child_count);
+    node_boxes[i] = box;
+  }
+  bounds = nodes.empty() ? aabb::empty() : node_boxes[0];
+}
+
+bool quantized_bvh::bounding_box(real_t time0, real_t time1,
+                                 aabb& output_box) const {
+  output_box = bounds;
+  return !nodes.empty();
+}
+
+size_t quantized_bvh::memory_usage() const {
+  return nodes.size() * sizeof(quantized_bvh_node) +
+         prims.size() * sizeof(hittable*);
+}
+
+template <bool any_hit, typename LeafHit>
+bool quantized_bvh::traverse(const ray& r, real_t t_min, real_t t_max,
+                             const LeafHit& leaf_hit) const {
+  if (nodes.empty())
+    return false;
+
+  struct entry {
+    uint32_t child;
+    uint16_t prim_count;
+    float t;
+  };
+  // Every level pushes at most 3 entries beyond the one it pops.
+  constexpr size_t stack_capacity = linear_bvh::max_depth * 3 + 1;
+  entry stack[stack_capacity];
+  size_t stack_size = 0;
+  stack[stack_size++] = {0, 0, static_cast<float>(t_min)};
+
+  const float_ray fr(r);
+  bool hit_anything = false;
+  while (stack_size > 0) {
+    const entry e = stack[--stack_size];
+    if (e.t > t_max * robust_scale)
+      continue;
+
+    if (e.prim_count > 0) {
+      if (leaf_hit(e.child, e.prim_count, t_max)) {
+        if constexpr (any_hit)
+          return true;
+        hit_anything = true;
+      }
+      continue;
+    }
+
+    const auto& node = nodes[e.child];
+    alignas(16) float t_near[4];
+    unsigned mask = slab_test(node, fr, static_cast<float>(t_min),
+                              static_cast<float>(t_max), t_near);
+    if (mask == 0)
+      continue;
+
+    // Sort the children that were hit nearest first, then push them in
+    // reverse so the nearest one is popped next.
+    entry hits[4];
+    int hit_count = 0;
+    for (int i = 0; i < 4; ++i) {
+      if (!(mask & (1u << i)))
+        continue;
+      entry h = {node.child[i], node.prim_count[i], t_near[i]};
+      int j = hit_count++;
+      while (j > 0 && hits[j - 1].t > h.t) {
+        hits[j] = hits[j - 1];
+        --j;
+      }
+      hits[j] = h;
+    }
+    for (int i = hit_count - 1; i >= 0; --i) {
+      stack[stack_size++] = hits[i];
+    }
+  }
+  return hit_anything;
+}
+
+bool quantized_bvh::hit(const ray& r, real_t t_min, real_t t_max,
+                        hit_record& rec) const {
+  return traverse<false>(r, t_min, t_max,
+                         [&](uint32_t first, uint32_t count, real_t& t_far) {
+                           bool hit_anything = false;
+                           for (uint32_t i = 0; i < count; ++i) {
+                             if (prims[first + i]->hit(r, t_min, t_far, rec)) {
+                               hit_anything = true;
+                               t_far = rec.t;
+                             }
+                           }
+                           return hit_anything;
+                         });
+}
+
+bool quantized_bvh::occluded(const ray& r, real_t t_min,
+                             real_t t_max) const {
+  return traverse<true>(r, t_min, t_max,
+                        [&](uint32_t first, uint32_t count, real_t& t_far) {
+                          for (uint32_t i = 0; i < count; ++i) {
+                            if (prims[first + i]->occluded(r, t_min, t_far))
+                              return true;
+                          }
+                          return false;
+                        });
+}
@@ -26,6 +26,9 @@ struct ray {
   real_t t;
 };
 
+// Traversal only sets t, object and whatever object needs to finish the hit
+// later (prim, and u and v as barycentrics); the rest is filled in by
+// hittable::finish_hit for the closest hit.
 struct hit_record {
   point3 p;
   vec3 normal;
@@ -34,6 +37,11 @@ struct hit_record {
   real_t v;
   bool front_face;
   material* mat = nullptr;
+  const struct hittable* object = nullptr;
+  uint32_t prim = 0;  // Primitive within object, if it has several
+  // What was hit inside object, if that is an instance, to be finished in
+  // object space.
+  const struct hittable* inner = nullptr;
 
   inline void set_face_normal(const ray& r, const vec3& outward_normal) {
     front_face = r.direction().dot(outward_normal) < 0;
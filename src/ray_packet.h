@@ -0,0 +1,114 @@
+#pragma once
+
+#include "bvh_simd.h"
+#include "ray.h"
+
+// stl
+#include <algorithm>
+#include <cstdint>
+
+// Up to 64 rays traced together, e.g. the camera rays of an 8x8 pixel tile.
+// Lanes are selected with 64-bit masks. Besides the rays themselves, which
+// the primitives are tested with, the packet keeps their origins and inverse
+// directions in single precision lane by lane, so that a BVH node is tested
+// against every ray in one vectorized loop.
+//
+// Add the rays, then call finish().
+struct ray_packet {
+  static constexpr size_t max_size = 64;
+
+  void add(const ray& r) {
+    const size_t lane = size++;
+    rays[lane] = r;
+    for (int a = 0; a < 3; ++a) {
+      org[a][lane] = static_cast<float>(r.origin()[a]);
+      inv_dir[a][lane] = static_cast<float>(1.0 / r.direction()[a]);
+    }
+  }
+
+  // Pads the unused lanes and computes the bounds of the packet.
+  void finish();
+
+  uint64_t lanes() const {
+    return size == max_size ? ~uint64_t(0) : (uint64_t(1) << size) - 1;
+  }
+
+  // Lanes whose ray enters the box in [t_min, t_max[lane]]. Lanes with a
+  // t_max of -INFINITY never hit.
+  uint64_t box_hits(const float box_min[3], const float box_max[3],
+                    float t_min, const float* t_max) const {
+    bool hit[max_size];
+    for (size_t i = 0; i < max_size; ++i) {
+      float t_near = t_min, t_far = t_max[i];
+      for (int a = 0; a < 3; ++a) {
+        const float t0 = (box_min[a] - org[a][i]) * inv_dir[a][i];
+        const float t1 = (box_max[a] - org[a][i]) * inv_dir[a][i];
+        t_near = std::max(t_near, std::min(t0, t1));
+        t_far = std::min(t_far, std::max(t0, t1) * robust_scale);
+      }
+      hit[i] = t_near <= t_far;
+    }
+    uint64_t mask = 0;
+    for (size_t i = 0; i < max_size; ++i)
+      mask |= uint64_t(hit[i]) << i;
+    return mask;
+  }
+
+  // Whether no ray of the packet can hit the box in [t_min, t_max], bounding
+  // the slab distances of all rays at once with interval arithmetic over the
+  // origins and inverse directions. Only meaningful if coherent.
+  bool misses(const float box_min[3], const float box_max[3], float t_min,
+              float t_max) const {
+    float t_near = t_min, t_far = t_max;
+    for (int a = 0; a < 3; ++a) {
+      const float near = inv_lo[a] > 0 ? box_min[a] : box_max[a];
+      const float far = inv_lo[a] > 0 ? box_max[a] : box_min[a];
+      const float n0 = (near - org_hi[a]) * inv_lo[a];
+      const float n1 = (near - org_hi[a]) * inv_hi[a];
+      const float n2 = (near - org_lo[a]) * inv_lo[a];
+      const float n3 = (near - org_lo[a]) * inv_hi[a];
+      const float f0 = (far - org_hi[a]) * inv_lo[a];
+      const float f1 = (far - org_hi[a]) * inv_hi[a];
+      const float f2 = (far - org_lo[a]) * inv_lo[a];
+      const float f3 = (far - org_lo[a]) * inv_hi[a];
+      t_near = std::max(t_near, std::min({n0, n1, n2, n3}));
+      t_far = std::min(t_far, std::max({f0, f1, f2, f3}) * robust_scale);
+    }
+    return t_near > t_far;
+  }
+
+  ray rays[max_size];
+  alignas(64) float org[3][max_size];
+  alignas(64) float inv_dir[3][max_size];
+  size_t size = 0;
+
+  // Set by finish(). Coherent packets have directions of the same sign on
+  // every axis, none of them parallel to an axis.
+  bool coherent = false;
+  float org_lo[3], org_hi[3];
+  float inv_lo[3], inv_hi[3];
+};
+
+inline void ray_packet::finish() {
+  coherent = size > 0;
+  if (size == 0)
+    return;
+  for (int a = 0; a < 3; ++a) {
+    org_lo[a] = org_hi[a] = org[a][0];
+    inv_lo[a] = inv_hi[a] = inv_dir[a][0];
+    for (size_t i = 1; i < size; ++i) {
+      org_lo[a] = std::min(org_lo[a], org[a][i]);
+      org_hi[a] = std::max(org_hi[a], org[a][i]);
+      inv_lo[a] = std::min(inv_lo[a], inv_dir[a][i]);
+      inv_hi[a] = std::max(inv_hi[a], inv_dir[a][i]);
+    }
+    coherent = coherent && std::isfinite(inv_lo[a]) &&
+               std::isfinite(inv_hi[a]) &&
+               (inv_lo[a] > 0 || inv_hi[a] < 0);
+    // The padding repeats the first ray; its lanes are never selected.
+    for (size_t i = size; i < max_size; ++i) {
+      org[a][i] = org[a][0];
+      inv_dir[a][i] = inv_dir[a][0];
+    }
+  }
+}
@@ -1,15 +1,18 @@
 #pragma once
 
+#include "arena.h"
 #include "bvh.h"
 #include "camera.h"
 #include "draw.h"
 #include "object.h"
 #include "stopwatch.h"
+#include "wavefront.h"
 
 // third party
 #include "raylib.h"
 
 // stl
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <shared_mutex>
@@ -17,6 +20,10 @@
 #include <vector>
 #include <utility>
 
+inline real_t luminance(const color& c) {
+  return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline color lin2srgb(const color& c) {
   auto ret = color(std::pow(c.x(), 1.0 / 2.2), std::pow(c.y(), 1.0 / 2.2),
                    std::pow(c.z(), 1.0 / 2.2));
@@ -41,6 +48,7 @@ struct ray_tracer {
     pixel_width = 1.0 / image_width;
     pixel_height = 1.0 / image_height;
     image_linear.resize(image_width * image_height);
+    stats.resize(image_width * image_height);
   }
 
   color compute(size_t x, size_t y) {
@@ -48,27 +56,68 @@ struct ray_tracer {
     color c;
     for (int i = 0; i < sample_count; ++i) {
       vec2 uvp(uv.x() + random_real() * pixel_width, uv.y() + random_real() * pixel_height);
-      color sample_color;
-      ray r = camera.ray_to(uvp);
-      fire_ray(r, sample_color, max_depth);
-      c += sample_color;
+      c += trace(camera.ray_to(uvp));
     }
     c /= sample_count;
     return c;
   }
 
+  // Adds samples to the running statistics of the pixel and returns their
+  // mean over all frames. Pixels take sample_count samples a frame, and up
+  // to adaptive_max_boost times as many while their error is that many
+  // times above the target. A pixel converges once it has
+  // adaptive_min_samples and the standard error of its mean luminance is
+  // within adaptive_error of that mean; from then on it takes no samples
+  // until reset(). Dark pixels never converge: all of their samples being
+  // black says little when their light comes through rare paths, and
+  // stopping them showed as black specks.
+  color sample_adaptive(size_t x, size_t y) {
+    constexpr real_t dark = 0.01;
+    pixel_stats& s = stats[y * image_width + x];
+    if (s.converged)
+      return s.mean;
+    auto ratio_to_target = [&]() {
+      const real_t error = std::sqrt(s.m2 / (s.n - 1) / s.n);
+      return error / (adaptive_error * std::max(luminance(s.mean), dark));
+    };
+    size_t samples = sample_count;
+    if (s.n >= 2) {
+      samples = static_cast<size_t>(
+        sample_count * std::clamp<real_t>(ratio_to_target(), 1,
+                                          adaptive_max_boost));
+    }
+    vec2 uv = get_uv(x, y);
+    for (size_t i = 0; i < samples; ++i) {
+      vec2 uvp(uv.x() + random_real() * pixel_width,
+               uv.y() + random_real() * pixel_height);
+      const color c = trace(camera.ray_to(uvp));
+      // Welford's update; the luminance is linear, so its mean is that of
+      // the mean color.
+      const real_t l = luminance(c);
+      const real_t old_mean = luminance(s.mean);
+      ++s.n;
+      s.mean += (c - s.mean) / s.n;
+      s.m2 += (l - old_mean) * (l - luminance(s.mean));
+    }
+    if (s.n >= std::max<size_t>(adaptive_min_samples, 2) &&
+        luminance(s.mean) >= dark && ratio_to_target() <= 1) {
+      s.converged = true;
+      ++converged_pixels;
+    }
+    return s.mean;
+  }
+
   void render_pixel(Image& image, size_t x, size_t y) {
     color res;
     switch (mode) {
       case render_mode::color: {
-        res = compute(x, y);
-        if (accumulate) {
-          auto idx = y * image_width + x;
-          auto& prev = image_linear[idx];
-          res = (prev * (frame_count - 1) + res) / frame_count;
-          image_linear[idx] = res;
+        if (adaptive && accumulate) {
+          // Converged pixels are written too, as the image may have been
+          // drawn over since.
+          res = lin2srgb(sample_adaptive(x, y));
+          break;
         }
-        res = lin2srgb(res);
+        res = accumulate_color(x, y, compute(x, y));
         break;
       }
       case render_mode::normal: {
@@ -76,18 +125,43 @@ struct ray_tracer {
         break;
       }
       case render_mode::depth: {
-        real_t d = depth_at(x, y);
-        d = clamp(d, 0.0, camera.focus_distance * 2);
-        d /= camera.focus_distance * 2;
-        d = 1.0 - d;
-        res = color(d);
+        res = depth_color(depth_at(x, y));
         break;
       }
     }
     write_pixel(image, x, y, res);
-    if (pixels_done.fetch_add(1) == image_width * image_height - 1) {
-      ++frame_count;
-      pixels_done = 0;
+    pixel_done();
+  }
+
+  // The same as render_pixel over columns [x0, x1), all rows, but in color
+  // mode the samples are traced breadth-first by engine, and in the normal
+  // and depth modes the camera rays of 8x8 tiles are traced as packets.
+  // Adaptive sampling decides pixel by pixel, so it goes through
+  // render_pixel.
+  void render_columns(Image& image, wavefront& engine, size_t x0, size_t x1) {
+    if (mode == render_mode::color && adaptive && accumulate) {
+      for (size_t x = x0; x < x1; ++x) {
+        for (size_t y = 0; y < image_height; ++y)
+          render_pixel(image, x, y);
+      }
+      return;
+    }
+    if (mode != render_mode::color) {
+      for (size_t x = x0; x < x1; x += 8) {
+        for (size_t y = 0; y < image_height; y += 8)
+          render_tile(image, x, std::min(x + 8, x1), y,
+                      std::min(y + 8, image_height));
+      }
+      return;
+    }
+    engine.render(*this, x0, x1, 0, image_height);
+    const std::vector<color>& colors = engine.colors;
+    for (size_t x = x0; x < x1; ++x) {
+      for (size_t y = 0; y < image_height; ++y) {
+        const color c = colors[(x - x0) * image_height + y];
+        write_pixel(image, x, y, accumulate_color(x, y, c));
+        pixel_done();
+      }
     }
   }
 
@@ -107,6 +181,71 @@ struct ray_tracer {
     return vec3(0);
   }
 
+  // Renders the normal or depth view of pixels [x0, x1) x [y0, y1), at most
+  // 64, with one packet of camera rays.
+  void render_tile(Image& image, size_t x0, size_t x1, size_t y0, size_t y1) {
+    ray_packet packet;
+    for (size_t y = y0; y < y1; ++y) {
+      for (size_t x = x0; x < x1; ++x)
+        packet.add(camera.ray_to(get_uv(x, y)));
+    }
+    packet.finish();
+    hit_record recs[ray_packet::max_size];
+    const uint64_t hits = world.hit_packet(packet, packet.lanes(), 0.001, recs);
+    size_t lane = 0;
+    for (size_t y = y0; y < y1; ++y) {
+      for (size_t x = x0; x < x1; ++x, ++lane) {
+        hit_record& rec = recs[lane];
+        const bool hit = (hits >> lane) & 1;
+        if (hit && rec.object)
+          rec.object->finish_hit(packet.rays[lane], rec);
+        if (mode == render_mode::normal) {
+          write_pixel(image, x, y, hit ? rec.normal : vec3(0));
+        } else {
+          write_pixel(image, x, y, depth_color(hit ? rec.t : -INFINITY));
+        }
+        pixel_done();
+      }
+    }
+  }
+
+  // Depth view: white at the camera, black from twice the focus distance on.
+  color depth_color(real_t d) const {
+    d = clamp(d, 0.0, camera.focus_distance * 2);
+    d /= camera.focus_distance * 2;
+    d = 1.0 - d;
+    return color(d);
+  }
+
+  // Gathers the emissive primitives among the world's objects that can be
+  // sampled, for next-event estimation; call once the scene is built.
+  // Emitters inside instances are not seen and are only found by paths that
+  // hit them, so they should not share a material with a sampled light.
+  void collect_lights() {
+    lights.clear();
+    light_materials.clear();
+    if (!sample_lights)
+      return;
+    for (const auto& object : world.objects) {
+      if (!object->mat || !object->mat->emissive() || object->area() <= 0)
+        continue;
+      lights.push_back(emitter{object.get(), object->area()});
+      const material* mat = object->mat.get();
+      if (std::find(light_materials.begin(), light_materials.end(), mat) ==
+          light_materials.end())
+        light_materials.push_back(mat);
+    }
+  }
+
+  // Starts accumulating, and adaptive sampling, over.
+  void reset() {
+    frame_count = 1;
+    pixels_done = 0;
+    image_linear.assign(image_width * image_height, color(0));
+    stats.assign(image_width * image_height, pixel_stats());
+    converged_pixels = 0;
+  }
+
   void set_accumulate(bool accum) {
     if (accumulate == accum)
       return;
@@ -114,6 +253,13 @@ struct ray_tracer {
 	reset();
   }
 
+  void set_adaptive(bool adapt) {
+    if (adaptive == adapt)
+      return;
+    adaptive = adapt;
+    reset();
+  }
+
   void update_camera(float move_right, float move_front, float look_right,
                      float look_up) {
     if (move_right != 0 || move_front != 0 || look_right != 0 || look_up != 0) {
@@ -126,40 +272,145 @@ struct ray_tracer {
   std::atomic_uint frame_count = 1;
   size_t sample_count;
   size_t max_depth;
+  size_t roulette_depth = 3;  // Bounces before Russian roulette starts
+  bool sample_lights = true;  // Next-event estimation, see trace()
+  // Adaptive sampling, when accumulating: pixels stop taking samples once
+  // the relative standard error of their luminance drops below
+  // adaptive_error. Set with set_adaptive().
+  bool adaptive = false;
+  real_t adaptive_error = 0.02;
+  size_t adaptive_min_samples = 64;
+  real_t adaptive_max_boost = 8;
+  std::atomic_size_t converged_pixels = 0;
   camera camera;
   color background;
+  arena scene_arena;  // Before world, which holds what it allocated
   hittable_list world;
 
  protected:
-  void fire_ray(const ray& r, color& c, size_t depth) const {
-    if (depth <= 0) {
-      c = color(0, 0, 0);
-      return;
-    }
-    hit_record rec = {};
-    if (hit(r, rec)) {
-      ray scattered;
+  friend struct wavefront;
+
+  // Follows one path, carrying the product of the attenuations so far. After
+  // roulette_depth bounces a path whose throughput has dropped below one
+  // survives with probability equal to its largest component and is weighted
+  // up by the inverse, which keeps the estimate unbiased while ending the
+  // paths that would add little. Paths still alive after max_depth bounces
+  // add nothing, as before.
+  //
+  // At diffuse hits a shadow ray goes to a point sampled on the lights
+  // (next-event estimation), which finds small lights far more often than
+  // the scattered ray does. The emission of a sampled light that the
+  // scattered ray then hits is already counted and is skipped.
+  color trace(ray r) const {
+    color c(0, 0, 0);
+    color throughput(1, 1, 1);
+    hit_record rec;
+    bool lights_sampled = false;  // At the previous hit
+    for (size_t depth = 0; depth < max_depth; ++depth) {
+      if (!hit(r, rec)) {
+        c += throughput * background;
+        break;
+      }
+      if (!lights_sampled || !is_sampled_light(rec.mat))
+        c += throughput * rec.mat->emitted(rec.u, rec.v, rec.p);
       color attenuation;
-      color emitted = rec.mat->emitted(rec.u, rec.v, rec.p);
-      if (rec.mat->scatter(r, rec, attenuation, scattered)) {
-        fire_ray(scattered, c, depth - 1);
-        c = emitted + attenuation * c;
-      } else {
-        c = emitted;
+      ray scattered;
+      if (!rec.mat->scatter(r, rec, attenuation, scattered))
+        break;
+      // Only up to the bounce whose scattered ray could still find the light.
+      lights_sampled = !lights.empty() && rec.mat->diffuse() &&
+                       depth + 1 < max_depth;
+      if (lights_sampled) {
+        ray shadow;
+        real_t t_max;
+        color light;
+        if (sample_light(rec, attenuation, r.time(), shadow, t_max, light) &&
+            !occluded(shadow, t_max))
+          c += throughput * light;
       }
-    } else {
-      c = background;
+      throughput = throughput * attenuation;
+      if (depth + 1 >= roulette_depth) {
+        const real_t survive =
+          std::max({throughput.x(), throughput.y(), throughput.z()});
+        if (survive < 1) {
+          if (random_real() >= survive)
+            break;
+          throughput /= survive;
+        }
+      }
+      r = scattered;
     }
+    return c;
   }
 
   bool hit(const ray& r, hit_record& out_rec) const {
-    return world.hit(r, 0.001, INFINITY, out_rec);
+    if (!world.hit(r, 0.001, INFINITY, out_rec))
+      return false;
+    if (out_rec.object)
+      out_rec.object->finish_hit(r, out_rec);
+    return true;
   }
 
-  void reset() {
-    frame_count = 1;
-    pixels_done = 0;
-    image_linear.assign(image_width * image_height, color(0));
+  // Whether anything blocks the ray before t_max, e.g. a light at t_max.
+  bool occluded(const ray& r, real_t t_max) const {
+    return world.occluded(r, 0.001, t_max);
+  }
+
+  // Picks a light, and a point on it uniformly by area, for a diffuse hit
+  // with the given albedo. Returns the shadow ray towards the point, the
+  // distance the ray must clear and the light it brings if it does, per unit
+  // of throughput. Returns false if the point faces away.
+  bool sample_light(const hit_record& rec, const color& albedo, real_t time,
+                    ray& shadow, real_t& t_max, color& light) const {
+    const emitter& picked = lights[std::min(
+      static_cast<size_t>(random_real() * lights.size()), lights.size() - 1)];
+    hit_record on_light;
+    if (!picked.shape->sample_surface(on_light))
+      return false;
+    const vec3 to_light = on_light.p - rec.p;
+    const real_t distance_squared = to_light.length_squared();
+    const real_t distance = std::sqrt(distance_squared);
+    const vec3 direction = to_light / distance;
+    const real_t cos_surface = direction.dot(rec.normal);
+    // Lights emit on both sides.
+    const real_t cos_light = std::abs(direction.dot(on_light.normal));
+    if (cos_surface <= 0 || cos_light <= 0 || distance <= 0.002)
+      return false;
+    shadow = ray(rec.p, direction, time);
+    t_max = distance - 0.001;
+    // The BRDF is albedo / pi; the point has density 1 / (count * area) by
+    // area, which the geometric term converts to solid angle.
+    const real_t weight = cos_surface * cos_light / distance_squared *
+                          lights.size() * picked.area / M_PI;
+    light = albedo *
+            on_light.mat->emitted(on_light.u, on_light.v, on_light.p) * weight;
+    return true;
+  }
+
+  bool is_sampled_light(const material* mat) const {
+    return mat->emissive() &&
+           std::find(light_materials.begin(), light_materials.end(), mat) !=
+             light_materials.end();
+  }
+
+  // Averages c into the pixel's accumulated color, if accumulating, and
+  // returns it in sRGB.
+  color accumulate_color(size_t x, size_t y, color c) {
+    if (accumulate) {
+      auto idx = y * image_width + x;
+      auto& prev = image_linear[idx];
+      c = (prev * (frame_count - 1) + c) / frame_count;
+      image_linear[idx] = c;
+    }
+    return lin2srgb(c);
+  }
+
+  // Counts a written pixel; the last one of the image ends the frame.
+  void pixel_done() {
+    if (pixels_done.fetch_add(1) == image_width * image_height - 1) {
+      ++frame_count;
+      pixels_done = 0;
+    }
   }
 
   inline vec2 get_uv(size_t x, size_t y) const {
@@ -173,5 +424,24 @@ struct ray_tracer {
   real_t pixel_height;
   bool accumulate = false;
   std::vector<color> image_linear;
+
+  // Running mean of the samples of a pixel and the sum of the squared
+  // deviations of their luminance, for adaptive sampling.
+  struct pixel_stats {
+    color mean = color(0, 0, 0);
+    real_t m2 = 0;
+    uint32_t n = 0;
+    bool converged = false;
+  };
+  std::vector<pixel_stats> stats;
+
+  // Emissive primitives sampled by next-event estimation, and their
+  // materials.
+  struct emitter {
+    const hittable* shape;
+    real_t area;
+  };
+  std::vector<emitter> lights;
+  std::vector<const material*> light_materials;
   std::atomic_uint pixels_done = 0;
 };
@@ -0,0 +1,215 @@
+#include "scatter.h"
+
+#include "thread_pool.h"
+
+// stl
+#include <algorithm>
+#include <iostream>
+
+namespace {
+
+// Tiles are this many cells wide; a pass over 16x16 cells is enough work to
+// be worth a task.
+constexpr size_t tile_cells = 16;
+
+uint64_t mix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// SplitMix64. Small enough to keep one per tile, and unlike the
+// distributions of <random> it gives the same numbers on every platform.
+struct scatter_rng {
+  explicit scatter_rng(uint64_t seed) : state(seed) {}
+
+  uint64_t next() { return mix(state += 0x9e3779b97f4a7c15ull); }
+
+  real_t real() { return static_cast<real_t>(next() >> 11) * 0x1.0p-53; }
+
+  real_t real(real_t min, real_t max) { return min + (max - min) * real(); }
+
+  color random_color(real_t min, real_t max) {
+    // Named components keep the order of the draws fixed.
+    const real_t r = real(min, max), g = real(min, max), b = real(min, max);
+    return color(r, g, b);
+  }
+
+  uint64_t state;
+};
+
+struct grid {
+  grid(real_t origin, real_t cell_size, size_t size)
+      : origin(origin), cell_size(cell_size), size(size), cells(size * size) {}
+
+  // Cell of coordinate x along either axis, clamped to [lo, hi].
+  size_t cell(real_t x, size_t lo, size_t hi) const {
+    const real_t c = std::floor((x - origin) / cell_size);
+    return static_cast<size_t>(
+      std::clamp(c, static_cast<real_t>(lo), static_cast<real_t>(hi)));
+  }
+
+  std::vector<aabb>& at(size_t x, size_t z) { return cells[z * size + x]; }
+
+  // Whether box overlaps anything in the 3x3 cells around (x, z).
+  bool overlaps(const aabb& box, size_t x, size_t z) {
+    const size_t x0 = x > 0 ? x - 1 : 0, x1 = std::min(x + 1, size - 1);
+    const size_t z0 = z > 0 ? z - 1 : 0, z1 = std::min(z + 1, size - 1);
+    for (size_t cz = z0; cz <= z1; ++cz) {
+      for (size_t cx = x0; cx <= x1; ++cx) {
+        for (const aabb& other : at(cx, cz)) {
+          if (other.overlaps(box))
+            return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  real_t origin;
+  real_t cell_size;
+  size_t size;  // Cells per side
+  std::vector<std::vector<aabb>> cells;
+};
+
+struct tile {
+  size_t x0, x1, z0, z1;         // Cells [x0, x1) x [z0, z1)
+  real_t lo_x, hi_x, lo_z, hi_z;  // Where its centers are drawn
+  size_t quota;
+  std::vector<scattered_sphere> spheres;
+};
+
+void fill_tile(const scatter_options& options, grid& g, tile& t,
+               uint64_t seed) {
+  scatter_rng rng(seed);
+  t.spheres.reserve(t.quota);
+  size_t attempts = t.quota * options.max_attempts;
+  while (t.spheres.size() < t.quota && attempts-- > 0) {
+    scattered_sphere s;
+    const real_t choose_mat = rng.real();
+    s.radius = rng.real(options.min_radius, options.max_radius);
+    const real_t x = rng.real(t.lo_x, t.hi_x);
+    const real_t z = rng.real(t.lo_z, t.hi_z);
+    s.center0 = s.center1 = point3(x, s.radius, z);
+    s.fuzz = 0;
+    if (choose_mat < 0.8) {
+      s.kind = scattered_sphere::diffuse;
+      s.albedo = rng.random_color(0, 1) * rng.random_color(0, 1);
+      s.center1 += vec3(0, rng.real(0, options.max_rise), 0);
+    } else if (choose_mat < 0.95) {
+      s.kind = scattered_sphere::metal;
+      s.albedo = rng.random_color(0.5, 1);
+      s.fuzz = rng.real(0, 0.5);
+    } else {
+      s.kind = scattered_sphere::glass;
+      s.albedo = color(1, 1, 1);
+    }
+
+    // Clamping keeps rounding at the tile edge from writing a cell of
+    // another tile.
+    const size_t cx = g.cell(x, t.x0, t.x1 - 1);
+    const size_t cz = g.cell(z, t.z0, t.z1 - 1);
+    const aabb box = s.box();
+    if (g.overlaps(box, cx, cz))
+      continue;
+    g.at(cx, cz).push_back(box);
+    t.spheres.push_back(s);
+  }
+}
+
+}  // namespace
+
+std::vector<scattered_sphere> scatter_spheres(
+  const scatter_options& options, const std::vector<aabb>& blockers,
+  thread_pool* pool) {
+  // A cell as wide as the largest sphere means that two spheres can only
+  // overlap if their centers are in neighbouring cells.
+  const real_t cell_size = 2 * options.max_radius;
+  const real_t origin = -options.extent - options.max_radius;
+  const size_t size = std::max<size_t>(
+    1, static_cast<size_t>(std::ceil(-2 * origin / cell_size)));
+  grid g(origin, cell_size, size);
+
+  // Blockers go into every cell they touch, so that the 3x3 query around a
+  // candidate finds them whatever their size.
+  for (const aabb& b : blockers) {
+    const real_t end = origin + size * cell_size;
+    if (b.max.x() < origin || b.min.x() > end || b.max.z() < origin ||
+        b.min.z() > end)
+      continue;
+    const size_t x0 = g.cell(b.min.x(), 0, size - 1);
+    const size_t x1 = g.cell(b.max.x(), 0, size - 1);
+    const size_t z0 = g.cell(b.min.z(), 0, size - 1);
+    const size_t z1 = g.cell(b.max.z(), 0, size - 1);
+    for (size_t z = z0; z <= z1; ++z) {
+      for (size_t x = x0; x <= x1; ++x)
+        g.at(x, z).push_back(b);
+    }
+  }
+
+  // Each tile's share of the spheres follows its share of the area where
+  // centers are drawn.
+  const size_t tiles_per_side = (size + tile_cells - 1) / tile_cells;
+  std::vector<tile> tiles(tiles_per_side * tiles_per_side);
+  std::vector<real_t> areas(tiles.size());
+  real_t total_area = 0;
+  for (size_t tz = 0; tz < tiles_per_side; ++tz) {
+    for (size_t tx = 0; tx < tiles_per_side; ++tx) {
+      tile& t = tiles[tz * tiles_per_side + tx];
+      t.x0 = tx * tile_cells;
+      t.x1 = std::min(t.x0 + tile_cells, size);
+      t.z0 = tz * tile_cells;
+      t.z1 = std::min(t.z0 + tile_cells, size);
+      auto center_range = [&](size_t c0, size_t c1, real_t& lo, real_t& hi) {
+        lo = std::max(origin + c0 * cell_size, -options.extent);
+        hi = std::min(origin + c1 * cell_size, options.extent);
+        return std::max<real_t>(hi - lo, 0);
+      };
+      const real_t area = center_range(t.x0, t.x1, t.lo_x, t.hi_x) *
+                          center_range(t.z0, t.z1, t.lo_z, t.hi_z);
+      areas[tz * tiles_per_side + tx] = area;
+      total_area += area;
+    }
+  }
+  real_t covered = 0;
+  size_t assigned = 0;
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    covered += areas[i];
+    const size_t until = i + 1 == tiles.size()
+                           ? options.count
+                           : static_cast<size_t>(options.count * covered /
+                                                 total_area);
+    tiles[i].quota = until - assigned;
+    assigned = until;
+  }
+
+  for (size_t pass = 0; pass < 4; ++pass) {
+    for (size_t tz = pass / 2; tz < tiles_per_side; tz += 2) {
+      for (size_t tx = pass % 2; tx < tiles_per_side; tx += 2) {
+        const size_t i = tz * tiles_per_side + tx;
+        if (tiles[i].quota == 0)
+          continue;
+        const uint64_t seed = mix(options.seed + mix(i + 1));
+        if (pool) {
+          pool->enqueue([&options, &g, &tiles, i, seed]() {
+            fill_tile(options, g, tiles[i], seed);
+          });
+        } else {
+          fill_tile(options, g, tiles[i], seed);
+        }
+      }
+    }
+    if (pool)
+      pool->wait();
+  }
+
+  std::vector<scattered_sphere> spheres;
+  spheres.reserve(options.count);
+  for (const tile& t : tiles)
+    spheres.insert(spheres.end(), t.spheres.begin(), t.spheres.end());
+  if (spheres.size() < options.count) {
+    std::cout << "Placed " << spheres.size() << " of " << options.count
+              << " spheres, the region is too crowded\n";
+  }
+  return spheres;
+}
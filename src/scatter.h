@@ -0,0 +1,51 @@
+#pragma once
+
+#include "aabb.h"
+
+// stl
+#include <vector>
+
+// Rejection sampling of non-overlapping spheres resting on the ground plane
+// (y = 0), for the random spheres scene and larger stress scenes. Placed
+// boxes are kept in a uniform grid over xz with cells as wide as the largest
+// sphere, so a candidate is only tested against the 3x3 cells around it.
+//
+// The grid is cut into tiles, each with its own random stream and its share
+// of the spheres. Tiles are filled in four passes by the parity of their
+// coordinates: tiles of one pass are at least a tile apart, so they never
+// read a cell another is writing and run in parallel. The result depends on
+// the seed only, not on the number of threads.
+struct scatter_options {
+  size_t count = 800;
+  real_t extent = 10;  // Centers lie in [-extent, extent] on x and z
+  real_t min_radius = 0.05;
+  real_t max_radius = 0.25;
+  real_t max_rise = 0.5;  // Upward motion of diffuse spheres over the shutter
+  uint64_t seed = 42;
+  // Candidates tried per sphere before a tile gives up on the rest of its
+  // share, for regions too crowded to hold count spheres.
+  size_t max_attempts = 100;
+};
+
+struct scattered_sphere {
+  enum kind_t : uint8_t { diffuse, metal, glass };
+
+  aabb box() const {
+    const vec3 extent(radius, radius, radius);
+    return aabb(center0 - extent, center1 + extent);
+  }
+
+  point3 center0, center1;  // center1 is never below center0
+  real_t radius;
+  kind_t kind;
+  color albedo;  // Unused for glass
+  real_t fuzz;   // Metal only
+};
+
+// Places up to options.count spheres that overlap neither each other nor any
+// of the blockers, in tile order. Blockers may be any size. With a started
+// pool the tiles of each pass run on it; the pool must not be running
+// anything else.
+std::vector<scattered_sphere> scatter_spheres(
+  const scatter_options& options, const std::vector<aabb>& blockers,
+  class thread_pool* pool = nullptr);
@@ -0,0 +1,173 @@
+#pragma once
+
+#include "aabb.h"
+#include "ray.h"
+
+// Geometry of the analytic primitives, without a material or virtual
+// functions. The hittables in object.h are built on these, and the compiled
+// scene keeps them by value in one array per type. intersect() only finds the
+// distance; finish() fills in the point, normal and texture coordinates of
+// the closest hit, as hittable::hit and hittable::finish_hit do.
+
+// Texture coordinates of a point on the unit sphere.
+void get_sphere_uv(const vec3& p, real_t& u, real_t& v);
+
+// Nearer root of the ray/sphere equation, if it lies in [t_min, t_max].
+inline bool hit_sphere(const point3& S, real_t radius, const ray& r,
+                       real_t t_min, real_t t_max, real_t& t) {
+  // Ray Center: R
+  // Sphere Center: S
+  // Day Direction: d
+  // Ray Eq: R(t) = R + td
+  // ((t^2)d ⋅ d) + (2td ⋅ (R−S)) + ((R−S) ⋅ (R−S)) − r^2 = 0
+  const auto& R = r.origin();
+  const auto& d = r.direction();
+  // D: From sphere center to ray origin
+  auto SR = R - S;
+  // At^2 + Bt + C = 0, solve for t
+  auto A = d.dot(d);
+  auto B = 2 * d.dot(SR);
+  auto C = SR.dot(SR) - radius * radius;
+  auto discriminant = B * B - 4 * A * C;
+  if (discriminant < 0) {
+    return false;
+  }
+  t = (-B - sqrt(discriminant)) / (2 * A);
+  return t >= t_min && t <= t_max;
+}
+
+inline void finish_sphere(const point3& center, real_t radius, const ray& r,
+                          hit_record& rec) {
+  rec.p = r.at(rec.t);
+  vec3 outward_normal = (rec.p - center) / radius;
+  rec.set_face_normal(r, outward_normal);
+  get_sphere_uv(outward_normal, rec.u, rec.v);
+}
+
+struct sphere_shape {
+  bool intersect(const ray& r, real_t t_min, real_t t_max, real_t& t) const {
+    return hit_sphere(center, radius, r, t_min, t_max, t);
+  }
+
+  void finish(const ray& r, hit_record& rec) const {
+    finish_sphere(center, radius, r, rec);
+  }
+
+  point3 center;
+  real_t radius;
+};
+
+// A sphere moving linearly from center0 at time0 to center1 at time1.
+struct moving_sphere_shape {
+  point3 center(real_t time) const {
+    return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
+  }
+
+  bool intersect(const ray& r, real_t t_min, real_t t_max, real_t& t) const {
+    return hit_sphere(center(r.time()), radius, r, t_min, t_max, t);
+  }
+
+  void finish(const ray& r, hit_record& rec) const {
+    finish_sphere(center(r.time()), radius, r, rec);
+  }
+
+  point3 center0, center1;
+  real_t time0, time1;
+  real_t radius;
+};
+
+// A parallelogram with corner q and edges u and v. The normal is u x v;
+// the texture coordinates are the positions along u and v. The test has no
+// branches before the final inside check, so it vectorizes.
+struct quad_shape {
+  void set(const point3& corner, const vec3& edge_u, const vec3& edge_v) {
+    q = corner;
+    u = edge_u;
+    v = edge_v;
+    auto n = u.cross(v);
+    normal = n.normalized();
+    d = normal.dot(q);
+    w = n / n.dot(n);
+  }
+
+  // Distance to the hit and its coordinates along u and v.
+  bool intersect(const ray& r, real_t t_min, real_t t_max, real_t& t,
+                 real_t& alpha, real_t& beta) const {
+    // Rays parallel to the plane give an infinite or NaN t, which fails the
+    // range check.
+    t = (d - normal.dot(r.origin())) / normal.dot(r.direction());
+    auto planar = r.at(t) - q;
+    alpha = w.dot(planar.cross(v));
+    beta = w.dot(u.cross(planar));
+    return t >= t_min && t <= t_max && alpha >= 0 && alpha <= 1 &&
+           beta >= 0 && beta <= 1;
+  }
+
+  // Expects rec.u and rec.v to hold alpha and beta.
+  void finish(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, normal);
+  }
+
+  point3 q;
+  vec3 u, v;
+  vec3 normal;  // Unit length
+  real_t d;     // The plane is normal . p = d
+  vec3 w;       // (u x v) / |u x v|^2, turns a point into its coordinates
+};
+
+// An axis-aligned box, intersected with a single slab test. The face that is
+// hit is the axis of the entry (or, from inside, the exit) distance.
+struct box_shape {
+  // Distance to the hit and the axis of the face that is hit. Returns false
+  // if the box is missed in [t_min, t_max].
+  bool intersect(const ray& r, real_t t_min, real_t t_max, real_t& t,
+                 int& axis, bool& entering) const {
+    real_t t_near = -INFINITY, t_far = INFINITY;
+    int near_axis = 0, far_axis = 0;
+    for (int a = 0; a < 3; a++) {
+      real_t inv_d = 1.0 / r.direction()[a];
+      real_t t0 = (p0[a] - r.origin()[a]) * inv_d;
+      real_t t1 = (p1[a] - r.origin()[a]) * inv_d;
+      real_t lo = std::min(t0, t1), hi = std::max(t0, t1);
+      near_axis = lo > t_near ? a : near_axis;
+      far_axis = hi < t_far ? a : far_axis;
+      t_near = std::max(lo, t_near);
+      t_far = std::min(hi, t_far);
+    }
+    if (t_near > t_far)
+      return false;
+
+    // Entering through the near face, or leaving through the far one when
+    // the origin is inside.
+    entering = t_near >= t_min;
+    t = entering ? t_near : t_far;
+    axis = entering ? near_axis : far_axis;
+    return t >= t_min && t <= t_max;
+  }
+
+  bool intersect(const ray& r, real_t t_min, real_t t_max, real_t& t) const {
+    int axis;
+    bool entering;
+    return intersect(r, t_min, t_max, t, axis, entering);
+  }
+
+  void finish(const ray& r, hit_record& rec) const {
+    // Testing again at exactly rec.t tells the entry from the exit and gives
+    // back the face.
+    real_t t;
+    int axis;
+    bool entering;
+    intersect(r, rec.t, rec.t, t, axis, entering);
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[axis] = (r.direction()[axis] < 0) == entering ? 1 : -1;
+
+    rec.p = r.at(rec.t);
+    int iu = axis == 0 ? 1 : 0, iv = axis == 2 ? 1 : 2;
+    rec.u = (rec.p[iu] - p0[iu]) / (p1[iu] - p0[iu]);
+    rec.v = (rec.p[iv] - p0[iv]) / (p1[iv] - p0[iv]);
+    rec.set_face_normal(r, outward_normal);
+  }
+
+  point3 p0, p1;
+};
@@ -0,0 +1,354 @@
+#include "sphere_soa.h"
+
+#include "bvh.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// stl
+#include <bit>
+#include <limits>
+
+namespace {
+
+constexpr int lanes = sphere_soa::lanes;
+
+// Stands in for one sphere while the BVH is built.
+struct sphere_ref : hittable {
+  sphere_ref(const point3& center, const vec3& velocity, real_t radius,
+             uint32_t index)
+      : center(center), velocity(velocity), radius(radius), index(index) {}
+
+  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
+                   hit_record& rec) const override {
+    return false;
+  }
+
+  virtual bool bounding_box(real_t time0, real_t time1,
+                            aabb& out) const override {
+    const vec3 extent(radius, radius, radius);
+    const point3 center0 = center + time0 * velocity;
+    const point3 center1 = center + time1 * velocity;
+    out = aabb(center0 - extent, center0 + extent)
+            .surrounding(aabb(center1 - extent, center1 + extent));
+    return true;
+  }
+
+  point3 center;
+  vec3 velocity;
+  real_t radius;
+  uint32_t index;
+};
+
+void copy_sphere(const sphere_soa_block& from, int from_lane,
+                 sphere_soa_block& to, int to_lane) {
+  to.center_x[to_lane] = from.center_x[from_lane];
+  to.center_y[to_lane] = from.center_y[from_lane];
+  to.center_z[to_lane] = from.center_z[from_lane];
+  to.velocity_x[to_lane] = from.velocity_x[from_lane];
+  to.velocity_y[to_lane] = from.velocity_y[from_lane];
+  to.velocity_z[to_lane] = from.velocity_z[from_lane];
+  to.radius[to_lane] = from.radius[from_lane];
+  to.material[to_lane] = from.material[from_lane];
+}
+
+sphere_soa_block empty_block() {
+  constexpr real_t nan = std::numeric_limits<real_t>::quiet_NaN();
+  sphere_soa_block block;
+  for (int i = 0; i < lanes; ++i) {
+    block.center_x[i] = block.center_y[i] = block.center_z[i] = nan;
+    block.velocity_x[i] = block.velocity_y[i] = block.velocity_z[i] = 0;
+    block.radius[i] = 0;
+    block.material[i] = 0;
+  }
+  return block;
+}
+
+// The ray, with the quadratic coefficient shared by all spheres.
+struct soa_ray {
+  explicit soa_ray(const ray& r) {
+    for (int i = 0; i < 3; ++i) {
+      org[i] = r.origin()[i];
+      dir[i] = r.direction()[i];
+    }
+    a = r.direction().dot(r.direction());
+    time = r.time();
+  }
+
+  real_t org[3];
+  real_t dir[3];
+  real_t a;
+  real_t time;
+};
+
+// Intersects the ray with the spheres of a block, the same way as
+// sphere::hit. Returns the lane of the nearest hit in [t_min, t_max] and sets
+// t to its distance, or returns -1.
+int hit_block(const sphere_soa_block& b, const soa_ray& r, real_t t_min,
+              real_t t_max, real_t& t) {
+#if defined(__AVX512F__)
+  const __m512d time = _mm512_set1_pd(r.time);
+  auto offset = [&](const real_t* center, const real_t* velocity, int axis) {
+    const __m512d c =
+      _mm512_fmadd_pd(_mm512_load_pd(velocity), time, _mm512_load_pd(center));
+    return _mm512_sub_pd(_mm512_set1_pd(r.org[axis]), c);
+  };
+  const __m512d sx = offset(b.center_x, b.velocity_x, 0);
+  const __m512d sy = offset(b.center_y, b.velocity_y, 1);
+  const __m512d sz = offset(b.center_z, b.velocity_z, 2);
+  const __m512d radius = _mm512_load_pd(b.radius);
+
+  __m512d d_dot_s = _mm512_mul_pd(_mm512_set1_pd(r.dir[0]), sx);
+  d_dot_s = _mm512_fmadd_pd(_mm512_set1_pd(r.dir[1]), sy, d_dot_s);
+  d_dot_s = _mm512_fmadd_pd(_mm512_set1_pd(r.dir[2]), sz, d_dot_s);
+  const __m512d B = _mm512_add_pd(d_dot_s, d_dot_s);
+  __m512d C = _mm512_mul_pd(sx, sx);
+  C = _mm512_fmadd_pd(sy, sy, C);
+  C = _mm512_fmadd_pd(sz, sz, C);
+  C = _mm512_fnmadd_pd(radius, radius, C);
+  const __m512d four_a = _mm512_set1_pd(4 * r.a);
+  const __m512d discriminant =
+    _mm512_fnmadd_pd(four_a, C, _mm512_mul_pd(B, B));
+  // NaN padding lanes fail every ordered comparison.
+  __mmask8 mask =
+    _mm512_cmp_pd_mask(discriminant, _mm512_setzero_pd(), _CMP_GE_OQ);
+  if (!mask)
+    return -1;
+  const __m512d root =
+    _mm512_div_pd(_mm512_sub_pd(_mm512_sub_pd(_mm512_setzero_pd(), B),
+                                _mm512_sqrt_pd(discriminant)),
+                  _mm512_set1_pd(2 * r.a));
+  mask = _mm512_mask_cmp_pd_mask(mask, root, _mm512_set1_pd(t_min),
+                                 _CMP_GE_OQ);
+  mask = _mm512_mask_cmp_pd_mask(mask, root, _mm512_set1_pd(t_max),
+                                 _CMP_LE_OQ);
+  if (!mask)
+    return -1;
+  t = _mm512_mask_reduce_min_pd(mask, root);
+  mask = _mm512_mask_cmp_pd_mask(mask, root, _mm512_set1_pd(t), _CMP_EQ_OQ);
+  return std::countr_zero(static_cast<unsigned>(mask));
+#elif defined(__AVX__)
+  const __m256d time = _mm256_set1_pd(r.time);
+  auto offset = [&](const real_t* center, const real_t* velocity, int axis) {
+    const __m256d c = _mm256_add_pd(
+      _mm256_load_pd(center), _mm256_mul_pd(_mm256_load_pd(velocity), time));
+    return _mm256_sub_pd(_mm256_set1_pd(r.org[axis]), c);
+  };
+  const __m256d sx = offset(b.center_x, b.velocity_x, 0);
+  const __m256d sy = offset(b.center_y, b.velocity_y, 1);
+  const __m256d sz = offset(b.center_z, b.velocity_z, 2);
+  const __m256d radius = _mm256_load_pd(b.radius);
+
+  const __m256d d_dot_s = _mm256_add_pd(
+    _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(r.dir[0]), sx),
+                  _mm256_mul_pd(_mm256_set1_pd(r.dir[1]), sy)),
+    _mm256_mul_pd(_mm256_set1_pd(r.dir[2]), sz));
+  const __m256d B = _mm256_add_pd(d_dot_s, d_dot_s);
+  const __m256d C = _mm256_sub_pd(
+    _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, sx), _mm256_mul_pd(sy, sy)),
+                  _mm256_mul_pd(sz, sz)),
+    _mm256_mul_pd(radius, radius));
+  const __m256d discriminant = _mm256_sub_pd(
+    _mm256_mul_pd(B, B), _mm256_mul_pd(_mm256_set1_pd(4 * r.a), C));
+  // NaN padding lanes fail every ordered comparison.
+  int mask = _mm256_movemask_pd(
+    _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ));
+  if (!mask)
+    return -1;
+  const __m256d root =
+    _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(_mm256_setzero_pd(), B),
+                                _mm256_sqrt_pd(discriminant)),
+                  _mm256_set1_pd(2 * r.a));
+  mask &= _mm256_movemask_pd(_mm256_and_pd(
+    _mm256_cmp_pd(root, _mm256_set1_pd(t_min), _CMP_GE_OQ),
+    _mm256_cmp_pd(root, _mm256_set1_pd(t_max), _CMP_LE_OQ)));
+  if (!mask)
+    return -1;
+  alignas(32) real_t roots[lanes];
+  _mm256_store_pd(roots, root);
+  int nearest = -1;
+  for (; mask; mask &= mask - 1) {
+    const int i = std::countr_zero(static_cast<unsigned>(mask));
+    if (nearest < 0 || roots[i] < roots[nearest])
+      nearest = i;
+  }
+  t = roots[nearest];
+  return nearest;
+#else
+  int nearest = -1;
+  for (int i = 0; i < lanes; ++i) {
+    const real_t sx = r.org[0] - (b.center_x[i] + r.time * b.velocity_x[i]);
+    const real_t sy = r.org[1] - (b.center_y[i] + r.time * b.velocity_y[i]);
+    const real_t sz = r.org[2] - (b.center_z[i] + r.time * b.velocity_z[i]);
+    const real_t B = 2 * (r.dir[0] * sx + r.dir[1] * sy + r.dir[2] * sz);
+    const real_t C = sx * sx + sy * sy + sz * sz - b.radius[i] * b.radius[i];
+    const real_t discriminant = B * B - 4 * r.a * C;
+    if (!(discriminant >= 0))
+      continue;
+    const real_t root = (-B - sqrt(discriminant)) / (2 * r.a);
+    if (root >= t_min && root <= t_max) {
+      t_max = root;
+      nearest = i;
+    }
+  }
+  t = t_max;
+  return nearest;
+#endif
+}
+
+}  // namespace
+
+void sphere_soa::add(const point3& center0, const point3& center1,
+                     real_t time0, real_t time1, real_t radius,
+                     std::shared_ptr<material> mat) {
+  const vec3 velocity =
+    time1 > time0 ? (center1 - center0) / (time1 - time0) : vec3(0, 0, 0);
+  const point3 center = center0 - time0 * velocity;
+
+  auto [it, inserted] = material_ids.try_emplace(
+    mat.get(), static_cast<uint32_t>(materials.size()));
+  if (inserted)
+    materials.push_back(std::move(mat));
+
+  if (count % lanes == 0)
+    blocks.push_back(empty_block());
+  auto& block = blocks.back();
+  const int lane = count % lanes;
+  block.center_x[lane] = center.x();
+  block.center_y[lane] = center.y();
+  block.center_z[lane] = center.z();
+  block.velocity_x[lane] = velocity.x();
+  block.velocity_y[lane] = velocity.y();
+  block.velocity_z[lane] = velocity.z();
+  block.radius[lane] = radius;
+  block.material[lane] = it->second;
+  ++count;
+}
+
+void sphere_soa::build(real_t time0, real_t time1, thread_pool* pool) {
+  std::vector<std::shared_ptr<hittable>> refs;
+  refs.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    const auto& b = blocks[i / lanes];
+    const int lane = i % lanes;
+    refs.push_back(std::make_shared<sphere_ref>(
+      point3(b.center_x[lane], b.center_y[lane], b.center_z[lane]),
+      vec3(b.velocity_x[lane], b.velocity_y[lane], b.velocity_z[lane]),
+      b.radius[lane], static_cast<uint32_t>(i)));
+  }
+
+  // The binned builder prices a leaf by its sphere count, but a block of
+  // spheres costs about one intersection.
+  auto root = bvh_node::build(refs, time0, time1, lanes, pool);
+  bvh = linear_bvh(*root);
+  bvh.merge_leaves(lanes);
+  bvh.compute_motion(time0, time1);
+
+  // Copy the spheres into leaf order, every leaf starting on a new block.
+  std::vector<sphere_soa_block> sorted;
+  for (auto& node : bvh.nodes) {
+    if (node.prim_count == 0)
+      continue;
+    const auto first = static_cast<uint32_t>(sorted.size() * lanes);
+    for (uint32_t i = 0; i < node.prim_count; ++i) {
+      if (i % lanes == 0)
+        sorted.push_back(empty_block());
+      const auto index =
+        static_cast<const sphere_ref*>(bvh.prims[node.first_prim + i])->index;
+      copy_sphere(blocks[index / lanes], index % lanes, sorted.back(),
+                  i % lanes);
+    }
+    node.first_prim = first;
+  }
+  blocks = std::move(sorted);
+  bvh.prims.clear();
+}
+
+bool sphere_soa::hit(const ray& r, real_t t_min, real_t t_max,
+                     hit_record& rec) const {
+  const soa_ray sr(r);
+  size_t nearest = 0;
+  real_t nearest_t = t_max;
+  auto leaf_hit = [&](uint32_t first, uint32_t count, real_t& t_far) {
+    bool found = false;
+    for (uint32_t i = first; i < first + count; i += lanes) {
+      real_t t;
+      int lane = hit_block(blocks[i / lanes], sr, t_min, t_far, t);
+      if (lane >= 0) {
+        found = true;
+        t_far = nearest_t = t;
+        nearest = i + lane;
+      }
+    }
+    return found;
+  };
+  if (!bvh.traverse(r, t_min, t_max, leaf_hit))
+    return false;
+  rec.t = nearest_t;
+  rec.object = this;
+  rec.prim = static_cast<uint32_t>(nearest);
+  return true;
+}
+
+uint64_t sphere_soa::hit_packet(const ray_packet& packet,
+                                uint64_t ray_lanes, real_t t_min,
+                                hit_record* recs) const {
+  // The spheres of a leaf are tested one ray at a time, block by block.
+  auto leaf_hit = [&](uint32_t first, uint32_t count, uint64_t leaf_lanes) {
+    uint64_t hits = 0;
+    for (; leaf_lanes; leaf_lanes &= leaf_lanes - 1) {
+      const int lane = std::countr_zero(leaf_lanes);
+      const soa_ray sr(packet.rays[lane]);
+      hit_record& rec = recs[lane];
+      for (uint32_t i = first; i < first + count; i += lanes) {
+        real_t t;
+        const int hit = hit_block(blocks[i / lanes], sr, t_min, rec.t, t);
+        if (hit >= 0) {
+          hits |= uint64_t(1) << lane;
+          rec.t = t;
+          rec.object = this;
+          rec.prim = i + hit;
+        }
+      }
+    }
+    return hits;
+  };
+  return bvh.traverse_packet(packet, ray_lanes, t_min, recs, leaf_hit);
+}
+
+void sphere_soa::finish_hit(const ray& r, hit_record& rec) const {
+  const auto& b = blocks[rec.prim / lanes];
+  const int lane = rec.prim % lanes;
+  rec.p = r.at(rec.t);
+  vec3 outward_normal = (rec.p - center(rec.prim, r.time())) / b.radius[lane];
+  rec.set_face_normal(r, outward_normal);
+  get_sphere_uv(outward_normal, rec.u, rec.v);
+  rec.mat = materials[b.material[lane]].get();
+}
+
+bool sphere_soa::occluded(const ray& r, real_t t_min, real_t t_max) const {
+  const soa_ray sr(r);
+  return bvh.traverse<true>(
+    r, t_min, t_max, [&](uint32_t first, uint32_t count, real_t& t_far) {
+      for (uint32_t i = first; i < first + count; i += lanes) {
+        real_t t;
+        if (hit_block(blocks[i / lanes], sr, t_min, t_far, t) >= 0)
+          return true;
+      }
+      return false;
+    });
+}
+
+bool sphere_soa::bounding_box(real_t time0, real_t time1,
+                              aabb& output_box) const {
+  return bvh.bounding_box(time0, time1, output_box);
+}
+
+point3 sphere_soa::center(size_t i, real_t time) const {
+  const auto& b = blocks[i / lanes];
+  const int lane = i % lanes;
+  return point3(b.center_x[lane] + time * b.velocity_x[lane],
+                b.center_y[lane] + time * b.velocity_y[lane],
+                b.center_z[lane] + time * b.velocity_z[lane]);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "linear_bvh.h"
+#include "object.h"
+
+// stl
+#include <cstdint>
+#include <unordered_map>
+
+// Spheres of one group stored lane by lane, so that a leaf is intersected with
+// one SIMD instruction stream for up to `lanes` spheres at a time.
+struct sphere_soa_block {
+#if defined(__AVX512F__)
+  static constexpr int lanes = 8;
+#else
+  static constexpr int lanes = 4;
+#endif
+
+  alignas(64) real_t center_x[lanes];  // At time 0
+  real_t center_y[lanes];
+  real_t center_z[lanes];
+  real_t velocity_x[lanes];  // Per unit of ray time
+  real_t velocity_y[lanes];
+  real_t velocity_z[lanes];
+  real_t radius[lanes];
+  uint32_t material[lanes];  // Index into sphere_soa::materials
+};
+
+// Many spheres in a single primitive: centers, radii and material ids live in
+// aligned structure of arrays blocks rather than in one heap object per
+// sphere, and the spheres get their own BVH whose leaves are spans of those
+// arrays. Each leaf starts on a block boundary; unused lanes hold NaN centers
+// and never hit. Spheres may move linearly, like moving_sphere.
+//
+// Add all spheres, then call build() before intersecting.
+struct sphere_soa : hittable {
+  static constexpr int lanes = sphere_soa_block::lanes;
+
+  void add(const point3& center, real_t radius, std::shared_ptr<material> mat) {
+    add(center, center, 0, 1, radius, std::move(mat));
+  }
+
+  // A sphere moving from center0 at time0 to center1 at time1.
+  void add(const point3& center0, const point3& center1, real_t time0,
+           real_t time1, real_t radius, std::shared_ptr<material> mat);
+
+  // Builds the BVH over the spheres for rays in [time0, time1] and lays the
+  // arrays out in leaf order.
+  void build(real_t time0, real_t time1, class thread_pool* pool = nullptr);
+
+  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
+                   hit_record& rec) const override;
+
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual uint64_t hit_packet(const ray_packet& packet, uint64_t lanes,
+                              real_t t_min, hit_record* recs) const override;
+
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
+
+  virtual bool bounding_box(real_t time0, real_t time1,
+                            aabb& output_box) const override;
+
+  size_t size() const { return count; }
+
+  size_t memory_usage() const {
+    return blocks.size() * sizeof(sphere_soa_block) + bvh.memory_usage();
+  }
+
+  std::vector<sphere_soa_block> blocks;
+  std::vector<std::shared_ptr<material>> materials;
+  linear_bvh bvh;  // prims is empty; leaves index spheres in blocks
+
+ protected:
+  point3 center(size_t i, real_t time) const;
+
+  size_t count = 0;
+  std::unordered_map<const material*, uint32_t> material_ids;
+};
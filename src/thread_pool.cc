@@ -53,10 +53,16 @@ void thread_pool::worker(uint32_t thread_id) {
       tasks.pop();
     }
     task();
-    if (task_count != 0) {
-      --task_count;
+    // cancel() may have reset the count while the task ran, so only decrement
+    // a non-zero count.
+    uint64_t count = task_count.load();
+    while (count != 0 &&
+           !task_count.compare_exchange_weak(count, count - 1)) {
     }
-    if (task_count == 0) {
+    if (count <= 1) {
+      // Notify under the lock, or wait() could miss it between checking the
+      // count and going to sleep.
+      std::unique_lock lock(wait_mutex);
       wait_cond.notify_all();
     }
   }
@@ -68,5 +74,16 @@ void thread_pool::cancel() {
     tasks.pop();
   }
   task_count = 0;
+  std::unique_lock wait_lock(wait_mutex);
   wait_cond.notify_all();
-}
\ No newline at end of file
+}
+
+std::unique_ptr<thread_pool> make_temporary_pool(size_t item_count,
+                                                 size_t thread_count) {
+  if (thread_count <= 1 || item_count < parallel_threshold)
+    return nullptr;
+  auto pool =
+    std::make_unique<thread_pool>(static_cast<uint32_t>(thread_count));
+  pool->start();
+  return pool;
+}
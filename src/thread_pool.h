@@ -3,6 +3,7 @@
 #include <atomic>
 #include <condition_variable>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
@@ -38,4 +39,13 @@ protected:
   std::mutex wait_mutex;
   std::condition_variable wait_cond;
   std::atomic_uint64_t task_count = 0;
-};
\ No newline at end of file
+};
+
+// Below this many items, starting the threads of a temporary pool costs more
+// than the parallel work saves.
+constexpr size_t parallel_threshold = 4096;
+
+// Returns a started pool of thread_count threads for work on item_count items,
+// or nullptr when it would not pay off; the work then runs on the caller.
+std::unique_ptr<thread_pool> make_temporary_pool(size_t item_count,
+                                                 size_t thread_count);
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "aabb.h"
+#include "common.h"
+#include "vec.h"
+
+// An affine transform, stored as the top three rows of a 4x4 matrix whose
+// last row is implicitly (0, 0, 0, 1).
+struct mat3x4 {
+  mat3x4() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+  static mat3x4 translation(const vec3& offset) {
+    mat3x4 t;
+    t.m[0][3] = offset.x();
+    t.m[1][3] = offset.y();
+    t.m[2][3] = offset.z();
+    return t;
+  }
+
+  // Positive angles turn +x towards -z.
+  static mat3x4 rotation_y(real_t degrees) {
+    auto radians = deg2rad(degrees);
+    auto s = sin(radians);
+    auto c = cos(radians);
+    mat3x4 t;
+    t.m[0][0] = c;
+    t.m[0][2] = s;
+    t.m[2][0] = -s;
+    t.m[2][2] = c;
+    return t;
+  }
+
+  static mat3x4 scaling(const vec3& scale) {
+    mat3x4 t;
+    t.m[0][0] = scale.x();
+    t.m[1][1] = scale.y();
+    t.m[2][2] = scale.z();
+    return t;
+  }
+
+  // The transform that applies rhs first, then this.
+  mat3x4 operator*(const mat3x4& rhs) const {
+    mat3x4 t;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        t.m[i][j] = m[i][0] * rhs.m[0][j] + m[i][1] * rhs.m[1][j] +
+                    m[i][2] * rhs.m[2][j] + (j == 3 ? m[i][3] : 0.0);
+      }
+    }
+    return t;
+  }
+
+  mat3x4 inverse() const {
+    // Invert the linear part with the adjugate, then the translation.
+    const auto& a = m;
+    real_t c00 = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+    real_t c01 = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+    real_t c02 = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+    real_t det = a[0][0] * c00 + a[0][1] * c01 + a[0][2] * c02;
+    real_t inv_det = 1.0 / det;
+
+    mat3x4 t;
+    t.m[0][0] = c00 * inv_det;
+    t.m[0][1] = (a[0][2] * a[2][1] - a[0][1] * a[2][2]) * inv_det;
+    t.m[0][2] = (a[0][1] * a[1][2] - a[0][2] * a[1][1]) * inv_det;
+    t.m[1][0] = c01 * inv_det;
+    t.m[1][1] = (a[0][0] * a[2][2] - a[0][2] * a[2][0]) * inv_det;
+    t.m[1][2] = (a[0][2] * a[1][0] - a[0][0] * a[1][2]) * inv_det;
+    t.m[2][0] = c02 * inv_det;
+    t.m[2][1] = (a[0][1] * a[2][0] - a[0][0] * a[2][1]) * inv_det;
+    t.m[2][2] = (a[0][0] * a[1][1] - a[0][1] * a[1][0]) * inv_det;
+    for (int i = 0; i < 3; ++i) {
+      t.m[i][3] =
+        -(t.m[i][0] * a[0][3] + t.m[i][1] * a[1][3] + t.m[i][2] * a[2][3]);
+    }
+    return t;
+  }
+
+  point3 apply_point(const point3& p) const {
+    return point3(
+      m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+      m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+      m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+  }
+
+  vec3 apply_vector(const vec3& v) const {
+    return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+  }
+
+  // Multiplies by the transpose of the linear part. Called on the inverse of
+  // a transform, this maps normals through that transform.
+  vec3 apply_transpose(const vec3& v) const {
+    return vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+  }
+
+  // Bounds of the transformed box (Arvo, Graphics Gems 1990).
+  aabb apply(const aabb& box) const {
+    point3 min(m[0][3], m[1][3], m[2][3]);
+    point3 max = min;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        real_t a = m[i][j] * box.min[j];
+        real_t b = m[i][j] * box.max[j];
+        min[i] += std::min(a, b);
+        max[i] += std::max(a, b);
+      }
+    }
+    return aabb(min, max);
+  }
+
+  real_t m[3][4];
+};
@@ -0,0 +1,386 @@
+#include "triangle_mesh.h"
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// stl
+#include <bit>
+#include <cmath>
+
+namespace {
+
+#if defined(__AVX__)
+constexpr int lanes = 4;
+#else
+constexpr int lanes = 1;
+#endif
+
+// Stands in for one triangle while the BVH is built.
+struct triangle_ref : hittable {
+  triangle_ref(const aabb& box, uint32_t index) : box(box), index(index) {}
+
+  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
+                   hit_record& rec) const override {
+    return false;
+  }
+
+  virtual bool bounding_box(real_t time0, real_t time1,
+                            aabb& out) const override {
+    out = box;
+    return true;
+  }
+
+  aabb box;
+  uint32_t index;
+};
+
+#if defined(__AVX__)
+// Vertex coordinates of four triangles, in the axis order of the ray:
+// p[vertex][axis][lane]. Unused lanes are all zero, a degenerate triangle.
+struct triangle_lanes {
+  alignas(16) float p[3][3][lanes];
+};
+
+// hit_triangle on four triangles. Returns the lane of the nearest hit, or -1.
+int hit_triangles(const watertight_ray& r, const triangle_lanes& tris,
+                  real_t t_min, real_t t_max, triangle_hit& hit) {
+  const __m128 org[3] = {_mm_set1_ps(r.org[r.kx]), _mm_set1_ps(r.org[r.ky]),
+                         _mm_set1_ps(r.org[r.kz])};
+  const __m128 sx = _mm_set1_ps(r.sx);
+  const __m128 sy = _mm_set1_ps(r.sy);
+  const __m128 sz = _mm_set1_ps(r.sz);
+  __m256d x[3], y[3], z[3];
+  for (int v = 0; v < 3; ++v) {
+    const __m128 ax = _mm_sub_ps(_mm_load_ps(tris.p[v][0]), org[0]);
+    const __m128 ay = _mm_sub_ps(_mm_load_ps(tris.p[v][1]), org[1]);
+    const __m128 az = _mm_sub_ps(_mm_load_ps(tris.p[v][2]), org[2]);
+    x[v] = _mm256_cvtps_pd(_mm_sub_ps(ax, _mm_mul_ps(sx, az)));
+    y[v] = _mm256_cvtps_pd(_mm_sub_ps(ay, _mm_mul_ps(sy, az)));
+    z[v] = _mm256_cvtps_pd(_mm_mul_ps(sz, az));
+  }
+  auto edge = [&](int a, int b) {
+    return _mm256_sub_pd(_mm256_mul_pd(x[a], y[b]), _mm256_mul_pd(y[a], x[b]));
+  };
+  const __m256d u = edge(2, 1);
+  const __m256d v = edge(0, 2);
+  const __m256d w = edge(1, 0);
+
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d negative = _mm256_or_pd(
+    _mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_LT_OQ),
+                 _mm256_cmp_pd(v, zero, _CMP_LT_OQ)),
+    _mm256_cmp_pd(w, zero, _CMP_LT_OQ));
+  const __m256d positive = _mm256_or_pd(
+    _mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_GT_OQ),
+                 _mm256_cmp_pd(v, zero, _CMP_GT_OQ)),
+    _mm256_cmp_pd(w, zero, _CMP_GT_OQ));
+  const __m256d det = _mm256_add_pd(_mm256_add_pd(u, v), w);
+  int mask = _mm256_movemask_pd(_mm256_andnot_pd(
+    _mm256_and_pd(negative, positive), _mm256_cmp_pd(det, zero, _CMP_NEQ_OQ)));
+  if (!mask)
+    return -1;
+
+  const __m256d t_scaled = _mm256_add_pd(
+    _mm256_add_pd(_mm256_mul_pd(u, z[0]), _mm256_mul_pd(v, z[1])),
+    _mm256_mul_pd(w, z[2]));
+  const __m256d t = _mm256_div_pd(t_scaled, det);
+  mask &= _mm256_movemask_pd(
+    _mm256_and_pd(_mm256_cmp_pd(t, _mm256_set1_pd(t_min), _CMP_GE_OQ),
+                  _mm256_cmp_pd(t, _mm256_set1_pd(t_max), _CMP_LE_OQ)));
+  if (!mask)
+    return -1;
+
+  alignas(32) real_t ts[lanes], vs[lanes], ws[lanes], dets[lanes];
+  _mm256_store_pd(ts, t);
+  _mm256_store_pd(vs, v);
+  _mm256_store_pd(ws, w);
+  _mm256_store_pd(dets, det);
+  int nearest = -1;
+  for (; mask; mask &= mask - 1) {
+    const int i = std::countr_zero(static_cast<unsigned>(mask));
+    if (nearest < 0 || ts[i] < ts[nearest])
+      nearest = i;
+  }
+  hit.t = ts[nearest];
+  hit.b1 = vs[nearest] / dets[nearest];
+  hit.b2 = ws[nearest] / dets[nearest];
+  return nearest;
+}
+
+// Loads the triangles order[i, i + min(n, lanes)) of mesh in the axis order
+// of the ray.
+void gather_triangles(const triangle_mesh& mesh, const watertight_ray& wr,
+                      uint32_t i, uint32_t n, triangle_lanes& tris) {
+  const int axes[3] = {wr.kx, wr.ky, wr.kz};
+  tris = {};
+  n = std::min<uint32_t>(n, lanes);
+  for (uint32_t lane = 0; lane < n; ++lane) {
+    for (int corner = 0; corner < 3; ++corner) {
+      const float* p = mesh.vertex(mesh.order[i + lane], corner);
+      for (int a = 0; a < 3; ++a)
+        tris.p[corner][a][lane] = p[axes[a]];
+    }
+  }
+}
+#endif
+
+}  // namespace
+
+watertight_ray::watertight_ray(const ray& r) {
+  const vec3 dir = r.direction();
+  for (int a = 0; a < 3; ++a) {
+    org[a] = static_cast<float>(r.origin()[a]);
+  }
+  kz = 0;
+  for (int a = 1; a < 3; ++a) {
+    if (std::abs(dir[a]) > std::abs(dir[kz]))
+      kz = a;
+  }
+  kx = (kz + 1) % 3;
+  ky = (kx + 1) % 3;
+  // Keep the winding, and so the sign of the edge functions, unchanged.
+  if (dir[kz] < 0)
+    std::swap(kx, ky);
+  sx = static_cast<float>(dir[kx] / dir[kz]);
+  sy = static_cast<float>(dir[ky] / dir[kz]);
+  sz = static_cast<float>(1.0 / dir[kz]);
+}
+
+bool hit_triangle(const watertight_ray& r, const float* p0, const float* p1,
+                  const float* p2, real_t t_min, real_t t_max,
+                  triangle_hit& hit) {
+  const float* p[3] = {p0, p1, p2};
+  double x[3], y[3], z[3];
+  for (int v = 0; v < 3; ++v) {
+    const float ax = p[v][r.kx] - r.org[r.kx];
+    const float ay = p[v][r.ky] - r.org[r.ky];
+    const float az = p[v][r.kz] - r.org[r.kz];
+    x[v] = ax - r.sx * az;
+    y[v] = ay - r.sy * az;
+    z[v] = r.sz * az;
+  }
+  const double u = x[2] * y[1] - y[2] * x[1];
+  const double v = x[0] * y[2] - y[0] * x[2];
+  const double w = x[1] * y[0] - y[1] * x[0];
+  if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+    return false;
+  const double det = u + v + w;
+  if (det == 0)
+    return false;
+  const double t = (u * z[0] + v * z[1] + w * z[2]) / det;
+  if (!(t >= t_min && t <= t_max))
+    return false;
+  hit.t = t;
+  hit.b1 = v / det;
+  hit.b2 = w / det;
+  return true;
+}
+
+triangle_mesh::triangle_mesh(mesh_data data, std::shared_ptr<material> mat)
+    : hittable(std::move(mat)) {
+  auto owned = std::make_shared<mesh_data>(std::move(data));
+  positions = owned->positions;
+  normals = owned->normals;
+  uvs = owned->uvs;
+  indices = owned->indices;
+  storage = std::move(owned);
+}
+
+triangle_mesh::triangle_mesh(std::span<const float> positions,
+                             std::span<const float> normals,
+                             std::span<const float> uvs,
+                             std::span<const uint32_t> indices,
+                             std::shared_ptr<const void> storage,
+                             std::shared_ptr<material> mat)
+    : hittable(std::move(mat)),
+      positions(positions),
+      normals(normals),
+      uvs(uvs),
+      indices(indices),
+      storage(std::move(storage)) {}
+
+void triangle_mesh::build(size_t thread_count) {
+  std::vector<std::shared_ptr<hittable>> refs;
+  refs.reserve(triangle_count());
+  for (uint32_t i = 0; i < triangle_count(); ++i) {
+    aabb box = aabb::empty();
+    for (int corner = 0; corner < 3; ++corner) {
+      const float* p = vertex(i, corner);
+      const point3 q(p[0], p[1], p[2]);
+      box = box.surrounding(aabb(q, q));
+    }
+    refs.push_back(std::make_shared<triangle_ref>(box, i));
+  }
+
+  auto pool = make_temporary_pool(refs.size(), thread_count);
+  auto root = bvh_node::build(refs, 0, 1, 4, pool.get());
+  bvh = linear_bvh(*root);
+  if (lanes > 1)
+    bvh.merge_leaves(lanes);
+
+  owned_order.resize(bvh.prims.size());
+  for (size_t i = 0; i < bvh.prims.size(); ++i) {
+    owned_order[i] = static_cast<const triangle_ref*>(bvh.prims[i])->index;
+  }
+  order = owned_order;
+  bvh.prims.clear();
+}
+
+bool triangle_mesh::hit_leaf(const watertight_ray& wr, uint32_t first,
+                             uint32_t count, real_t t_min, real_t& t_max,
+                             triangle_hit& nearest,
+                             uint32_t& nearest_triangle) const {
+  bool found = false;
+#if defined(__AVX__)
+  for (uint32_t i = first; i < first + count; i += lanes) {
+    triangle_lanes tris;
+    gather_triangles(*this, wr, i, first + count - i, tris);
+    triangle_hit h;
+    const int lane = hit_triangles(wr, tris, t_min, t_max, h);
+    if (lane >= 0) {
+      found = true;
+      t_max = h.t;
+      nearest = h;
+      nearest_triangle = order[i + lane];
+    }
+  }
+#else
+  for (uint32_t i = first; i < first + count; ++i) {
+    const uint32_t tri = order[i];
+    triangle_hit h;
+    if (hit_triangle(wr, vertex(tri, 0), vertex(tri, 1), vertex(tri, 2),
+                     t_min, t_max, h)) {
+      found = true;
+      t_max = h.t;
+      nearest = h;
+      nearest_triangle = tri;
+    }
+  }
+#endif
+  return found;
+}
+
+bool triangle_mesh::hit(const ray& r, real_t t_min, real_t t_max,
+                        hit_record& rec) const {
+  const watertight_ray wr(r);
+  triangle_hit nearest{};
+  uint32_t nearest_triangle = 0;
+  auto leaf_hit = [&](uint32_t first, uint32_t count, real_t& t_far) {
+    return hit_leaf(wr, first, count, t_min, t_far, nearest, nearest_triangle);
+  };
+  if (!bvh.traverse(r, t_min, t_max, leaf_hit))
+    return false;
+  rec.t = nearest.t;
+  rec.u = nearest.b1;
+  rec.v = nearest.b2;
+  rec.object = this;
+  rec.prim = nearest_triangle;
+  return true;
+}
+
+uint64_t triangle_mesh::hit_packet(const ray_packet& packet,
+                                   uint64_t ray_lanes, real_t t_min,
+                                   hit_record* recs) const {
+  watertight_ray wrs[ray_packet::max_size];
+  for (uint64_t l = ray_lanes; l; l &= l - 1) {
+    const int lane = std::countr_zero(l);
+    wrs[lane] = watertight_ray(packet.rays[lane]);
+  }
+  auto record = [&](uint64_t& hits, int lane, const triangle_hit& h,
+                    uint32_t triangle) {
+    hits |= uint64_t(1) << lane;
+    recs[lane].t = h.t;
+    recs[lane].u = h.b1;
+    recs[lane].v = h.b2;
+    recs[lane].object = this;
+    recs[lane].prim = triangle;
+  };
+  auto leaf_hit = [&](uint32_t first, uint32_t count, uint64_t leaf_lanes) {
+    uint64_t hits = 0;
+#if defined(__AVX__)
+    // The rays of a coherent packet share their axis order, so the
+    // triangles are gathered once for all of them.
+    for (uint32_t i = first; i < first + count; i += lanes) {
+      triangle_lanes tris;
+      int gathered_kz = -1, gathered_kx = -1;
+      for (uint64_t l = leaf_lanes; l; l &= l - 1) {
+        const int lane = std::countr_zero(l);
+        const watertight_ray& wr = wrs[lane];
+        if (wr.kz != gathered_kz || wr.kx != gathered_kx) {
+          gather_triangles(*this, wr, i, first + count - i, tris);
+          gathered_kz = wr.kz;
+          gathered_kx = wr.kx;
+        }
+        triangle_hit h;
+        const int hit = hit_triangles(wr, tris, t_min, recs[lane].t, h);
+        if (hit >= 0)
+          record(hits, lane, h, order[i + hit]);
+      }
+    }
+#else
+    for (uint64_t l = leaf_lanes; l; l &= l - 1) {
+      const int lane = std::countr_zero(l);
+      triangle_hit h;
+      uint32_t triangle;
+      if (hit_leaf(wrs[lane], first, count, t_min, recs[lane].t, h, triangle))
+        record(hits, lane, h, triangle);
+    }
+#endif
+    return hits;
+  };
+  return bvh.traverse_packet(packet, ray_lanes, t_min, recs, leaf_hit);
+}
+
+void triangle_mesh::finish_hit(const ray& r, hit_record& rec) const {
+  const uint32_t triangle = rec.prim;
+  const real_t b1 = rec.u, b2 = rec.v;
+  const real_t weights[3] = {1 - b1 - b2, b1, b2};
+  auto interpolate = [&](std::span<const float> attribute, int size, int k) {
+    real_t value = 0;
+    for (int corner = 0; corner < 3; ++corner) {
+      const size_t v = indices[3 * size_t(triangle) + corner];
+      value += weights[corner] * attribute[size * v + k];
+    }
+    return value;
+  };
+  rec.p = r.at(rec.t);
+  vec3 outward_normal;
+  if (!normals.empty()) {
+    outward_normal = vec3(interpolate(normals, 3, 0),
+                          interpolate(normals, 3, 1),
+                          interpolate(normals, 3, 2));
+  } else {
+    const float* p0 = vertex(triangle, 0);
+    const float* p1 = vertex(triangle, 1);
+    const float* p2 = vertex(triangle, 2);
+    const vec3 e1(p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]);
+    const vec3 e2(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+    outward_normal = e1.cross(e2);
+  }
+  rec.set_face_normal(r, outward_normal.normalized());
+  if (!uvs.empty()) {
+    rec.u = interpolate(uvs, 2, 0);
+    rec.v = interpolate(uvs, 2, 1);
+  }
+  rec.mat = mat.get();
+}
+
+bool triangle_mesh::occluded(const ray& r, real_t t_min,
+                             real_t t_max) const {
+  const watertight_ray wr(r);
+  return bvh.traverse<true>(
+    r, t_min, t_max, [&](uint32_t first, uint32_t count, real_t& t_far) {
+      triangle_hit h;
+      uint32_t triangle;
+      return hit_leaf(wr, first, count, t_min, t_far, h, triangle);
+    });
+}
+
+bool triangle_mesh::bounding_box(real_t time0, real_t time1,
+                                 aabb& output_box) const {
+  return bvh.bounding_box(time0, time1, output_box);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "linear_bvh.h"
+#include "object.h"
+
+// stl
+#include <cstdint>
+#include <span>
+#include <thread>
+
+// Vertex and index buffers as produced by the mesh loaders.
+struct mesh_data {
+  std::vector<float> positions;   // x, y, z per vertex
+  std::vector<float> normals;     // Optional, x, y, z per vertex
+  std::vector<float> uvs;         // Optional, u, v per vertex
+  std::vector<uint32_t> indices;  // Three vertices per triangle
+};
+
+// A ray prepared for the watertight ray/triangle test of Woop, Benthin and
+// Wald (2013): the axes are permuted so that z is the dominant direction and
+// a shear maps the ray onto the z axis.
+struct watertight_ray {
+  watertight_ray() = default;
+  explicit watertight_ray(const ray& r);
+
+  float org[3];
+  int kx, ky, kz;
+  float sx, sy, sz;
+};
+
+struct triangle_hit {
+  real_t t;
+  real_t b1, b2;  // Barycentric weights of the second and third vertex
+};
+
+// Vertices are transformed in single precision and the edge functions
+// evaluated in double, where the products of floats are exact. Their signs
+// are therefore exact too, so rays never slip through the shared edge of two
+// triangles.
+bool hit_triangle(const watertight_ray& r, const float* p0, const float* p1,
+                  const float* p2, real_t t_min, real_t t_max,
+                  triangle_hit& hit);
+
+// Triangles sharing vertex and index buffers, with one material. The mesh has
+// its own BVH, whose leaves are spans of the triangle order array; leaves are
+// tested four triangles at a time where AVX is available. The buffers are
+// either owned or views into memory kept alive by `storage`, such as a mapped
+// mesh file.
+struct triangle_mesh : hittable {
+  triangle_mesh(mesh_data data, std::shared_ptr<material> mat);
+
+  triangle_mesh(std::span<const float> positions,
+                std::span<const float> normals, std::span<const float> uvs,
+                std::span<const uint32_t> indices,
+                std::shared_ptr<const void> storage,
+                std::shared_ptr<material> mat);
+
+  // Builds the BVH over the triangles. Large meshes are built on a temporary
+  // pool of thread_count threads.
+  void build(size_t thread_count = std::thread::hardware_concurrency());
+
+  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
+                   hit_record& rec) const override;
+
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual uint64_t hit_packet(const ray_packet& packet, uint64_t lanes,
+                              real_t t_min, hit_record* recs) const override;
+
+  virtual void finish_hit(const ray& r, hit_record& rec) const override;
+
+  virtual bool bounding_box(real_t time0, real_t time1,
+                            aabb& output_box) const override;
+
+  size_t vertex_count() const { return positions.size() / 3; }
+  size_t triangle_count() const { return indices.size() / 3; }
+
+  const float* vertex(uint32_t triangle, int corner) const {
+    const size_t v = indices[3 * size_t(triangle) + corner];
+    return positions.data() + 3 * v;
+  }
+
+  std::span<const float> positions;
+  std::span<const float> normals;  // Empty, or one per vertex
+  std::span<const float> uvs;      // Empty, or one per vertex
+  std::span<const uint32_t> indices;
+  std::span<const uint32_t> order;  // Triangles in BVH leaf order
+  linear_bvh bvh;  // prims is empty; leaves index order
+  std::shared_ptr<const void> storage;
+
+ protected:
+  // Finds the nearest hit among the triangles order[first, first + count)
+  // and lowers t_max to it.
+  bool hit_leaf(const watertight_ray& wr, uint32_t first, uint32_t count,
+                real_t t_min, real_t& t_max, triangle_hit& nearest,
+                uint32_t& nearest_triangle) const;
+
+  std::vector<uint32_t> owned_order;
+};
@@ -0,0 +1,174 @@
+#include "wavefront.h"
+
+#include "ray_tracer.h"
+
+// stl
+#include <algorithm>
+#include <typeinfo>
+
+void wavefront::ray_queue::clear() {
+  ox.clear();
+  oy.clear();
+  oz.clear();
+  dx.clear();
+  dy.clear();
+  dz.clear();
+  time.clear();
+  path.clear();
+}
+
+void wavefront::ray_queue::push(const ray& r, uint32_t path_index) {
+  ox.push_back(r.orig.x());
+  oy.push_back(r.orig.y());
+  oz.push_back(r.orig.z());
+  dx.push_back(r.dir.x());
+  dy.push_back(r.dir.y());
+  dz.push_back(r.dir.z());
+  time.push_back(r.time());
+  path.push_back(path_index);
+}
+
+void wavefront::render(const ray_tracer& rt, size_t x0, size_t x1, size_t y0,
+                       size_t y1) {
+  this->x0 = x0;
+  this->y0 = y0;
+  rows = y1 - y0;
+  const size_t pixels = (x1 - x0) * rows;
+  const size_t samples = std::max<size_t>(rt.sample_count, 1);
+  const size_t batch_pixels = std::max<size_t>(batch_paths / samples, 1);
+  colors.assign(pixels, color(0, 0, 0));
+  for (size_t first = 0; first < pixels; first += batch_pixels) {
+    const size_t last = std::min(first + batch_pixels, pixels);
+    generate(rt, first, last);
+    for (size_t depth = 0; depth < rt.max_depth && rays.size() > 0; ++depth) {
+      extend(rt);
+      shade(rt, depth);
+      connect(rt);
+      std::swap(rays, next_rays);
+    }
+    // Paths still going at max_depth add nothing, as in ray_tracer::trace.
+    rays.clear();
+
+    for (size_t p = first; p < last; ++p) {
+      color sum(0, 0, 0);
+      for (size_t s = 0; s < samples; ++s)
+        sum += radiance[(p - first) * samples + s];
+      colors[p] = sum / samples;
+    }
+  }
+}
+
+void wavefront::generate(const ray_tracer& rt, size_t first, size_t last) {
+  const size_t samples = std::max<size_t>(rt.sample_count, 1);
+  const size_t paths = (last - first) * samples;
+  throughput.assign(paths, color(1, 1, 1));
+  radiance.assign(paths, color(0, 0, 0));
+  lights_sampled.assign(paths, 0);
+  rays.clear();
+  // Paths are numbered pixel by pixel, sample by sample.
+  uint32_t path = 0;
+  for (size_t p = first; p < last; ++p) {
+    const vec2 uv = rt.get_uv(x0 + p / rows, y0 + p % rows);
+    for (size_t s = 0; s < samples; ++s) {
+      vec2 uvp(uv.x() + random_real() * rt.pixel_width,
+               uv.y() + random_real() * rt.pixel_height);
+      rays.push(rt.camera.ray_to(uvp), path++);
+    }
+  }
+}
+
+void wavefront::extend(const ray_tracer& rt) {
+  const size_t n = rays.size();
+  hits.resize(n);
+  order.clear();
+  for (size_t i = 0; i < n; ++i) {
+    hit_record& rec = hits[i];
+    rec.object = nullptr;
+    if (rt.world.hit(rays.at(i), 0.001, INFINITY, rec)) {
+      order.push_back(static_cast<uint32_t>(i));
+    } else {
+      const uint32_t path = rays.path[i];
+      radiance[path] += throughput[path] * rt.background;
+    }
+  }
+}
+
+void wavefront::shade(const ray_tracer& rt, size_t depth) {
+  // Attributes first, which gives every hit its material.
+  for (uint32_t i : order) {
+    if (hits[i].object)
+      hits[i].object->finish_hit(rays.at(i), hits[i]);
+  }
+  // Then the hits grouped by material type, in ray order within a type, so
+  // that runs of hits go through the same scatter(). A scene has a handful
+  // of material types, so this is a counting sort.
+  material_types.clear();
+  type_of.resize(order.size());
+  for (size_t k = 0; k < order.size(); ++k) {
+    const size_t type = typeid(*hits[order[k]].mat).hash_code();
+    auto it = std::find(material_types.begin(), material_types.end(), type);
+    type_of[k] = static_cast<uint32_t>(it - material_types.begin());
+    if (it == material_types.end())
+      material_types.push_back(type);
+  }
+  std::vector<uint32_t> starts(material_types.size() + 1, 0);
+  for (uint32_t t : type_of)
+    ++starts[t + 1];
+  for (size_t t = 1; t < starts.size(); ++t)
+    starts[t] += starts[t - 1];
+  sorted.resize(order.size());
+  for (size_t k = 0; k < order.size(); ++k)
+    sorted[starts[type_of[k]]++] = order[k];
+  std::swap(order, sorted);
+
+  next_rays.clear();
+  shadow_rays.clear();
+  shadow_t_max.clear();
+  shadow_light.clear();
+  for (uint32_t i : order) {
+    const hit_record& rec = hits[i];
+    const ray r = rays.at(i);
+    const uint32_t path = rays.path[i];
+    if (!lights_sampled[path] || !rt.is_sampled_light(rec.mat)) {
+      radiance[path] +=
+        throughput[path] * rec.mat->emitted(rec.u, rec.v, rec.p);
+    }
+    color attenuation;
+    ray scattered;
+    if (!rec.mat->scatter(r, rec, attenuation, scattered))
+      continue;
+    color& beta = throughput[path];
+    // Next-event estimation as in ray_tracer::trace, the shadow ray left for
+    // connect().
+    lights_sampled[path] = !rt.lights.empty() && rec.mat->diffuse() &&
+                           depth + 1 < rt.max_depth;
+    if (lights_sampled[path]) {
+      ray shadow;
+      real_t t_max;
+      color light;
+      if (rt.sample_light(rec, attenuation, r.time(), shadow, t_max, light)) {
+        shadow_rays.push(shadow, path);
+        shadow_t_max.push_back(t_max);
+        shadow_light.push_back(beta * light);
+      }
+    }
+    beta = beta * attenuation;
+    // The same Russian roulette as ray_tracer::trace.
+    if (depth + 1 >= rt.roulette_depth) {
+      const real_t survive = std::max({beta.x(), beta.y(), beta.z()});
+      if (survive < 1) {
+        if (random_real() >= survive)
+          continue;
+        beta /= survive;
+      }
+    }
+    next_rays.push(scattered, path);
+  }
+}
+
+void wavefront::connect(const ray_tracer& rt) {
+  for (size_t i = 0; i < shadow_rays.size(); ++i) {
+    if (!rt.occluded(shadow_rays.at(i), shadow_t_max[i]))
+      radiance[shadow_rays.path[i]] += shadow_light[i];
+  }
+}
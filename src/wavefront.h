@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ray.h"
+
+// stl
+#include <vector>
+
+// Breadth-first path tracing. Instead of following each sample to the end,
+// a batch of paths advances one bounce at a time through separate stages:
+// camera rays are generated for the whole batch, all of them are intersected,
+// and the hits are then shaded in order of material, so that each stage is a
+// loop doing one kind of work over many rays. Rays wait between stages in
+// struct-of-arrays queues. The shadow rays of next-event estimation are
+// traced in a stage of their own after shading.
+//
+// One wavefront belongs to one thread; it keeps its queues between batches.
+struct wavefront {
+  // Paths in flight per batch. Their rays and hit records then stay in the
+  // L2 cache between stages; batches of 64K paths ran 30% slower than
+  // depth-first tracing, where 8K are within a few percent of it.
+  static constexpr size_t batch_paths = 1 << 13;
+
+  // Renders rt.sample_count samples for the pixels in columns [x0, x1) and
+  // rows [y0, y1) into colors.
+  void render(const struct ray_tracer& rt, size_t x0, size_t x1, size_t y0,
+              size_t y1);
+
+  std::vector<color> colors;  // Of the last render(), column by column
+
+ protected:
+  struct ray_queue {
+    void clear();
+    void push(const ray& r, uint32_t path);
+    ray at(size_t i) const {
+      return ray(point3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]),
+                 time[i]);
+    }
+    size_t size() const { return path.size(); }
+
+    std::vector<real_t> ox, oy, oz;
+    std::vector<real_t> dx, dy, dz;
+    std::vector<real_t> time;
+    std::vector<uint32_t> path;
+  };
+
+  // Camera rays for pixels [first, last) of the current block, counted
+  // column by column.
+  void generate(const ray_tracer& rt, size_t first, size_t last);
+  void extend(const ray_tracer& rt);
+  void shade(const ray_tracer& rt, size_t depth);
+  void connect(const ray_tracer& rt);  // Traces the shadow rays
+
+  // The block being rendered
+  size_t x0 = 0, y0 = 0, rows = 0;
+
+  // Per path
+  std::vector<color> throughput;
+  std::vector<color> radiance;
+  std::vector<uint8_t> lights_sampled;  // At the last hit, see trace()
+
+  ray_queue rays;       // To be intersected
+  ray_queue next_rays;  // Scattered by shade()
+  std::vector<hit_record> hits;  // Per ray; object is null on a miss
+  std::vector<uint32_t> order;   // Rays that hit, sorted by material
+  ray_queue shadow_rays;          // Towards the lights, from shade()
+  std::vector<real_t> shadow_t_max;
+  std::vector<color> shadow_light;  // Added to the path if not occluded
+  // For the sort
+  std::vector<size_t> material_types;
+  std::vector<uint32_t> type_of;
+  std::vector<uint32_t> sorted;
+};
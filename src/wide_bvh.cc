@@ -0,0 +1,308 @@
+#include "wide_bvh.h"
+
+#include "bvh_simd.h"
+#include "linear_bvh.h"
+
+#include <array>
+
+namespace {
+
+template <int W>
+struct slab_planes {
+  slab_planes(const wide_bvh_node<W>& n, const float_ray& r) {
+    const float* mins[3] = {n.min_x, n.min_y, n.min_z};
+    const float* maxs[3] = {n.max_x, n.max_y, n.max_z};
+    for (int a = 0; a < 3; ++a) {
+      near[a] = r.negative[a] ? maxs[a] : mins[a];
+      far[a] = r.negative[a] ? mins[a] : maxs[a];
+    }
+  }
+
+  const float* near[3];
+  const float* far[3];
+};
+
+#ifdef RTIOW_SSE
+// Tests the four children starting at offset, returns the hit mask.
+template <int W>
+unsigned slab_test4(const slab_planes<W>& p, const float_ray& r, int offset,
+                    float t_min, float t_max, float* t_near) {
+  __m128 tn = _mm_set1_ps(t_min);
+  __m128 tf = _mm_set1_ps(t_max);
+  for (int a = 0; a < 3; ++a) {
+    const __m128 org = _mm_set1_ps(r.org[a]);
+    const __m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+    __m128 t0 =
+      _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(p.near[a] + offset), org), inv_dir);
+    __m128 t1 =
+      _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(p.far[a] + offset), org), inv_dir);
+    // Operand order matters: a NaN from 0 * inf is dropped, not propagated.
+    tn = _mm_max_ps(t0, tn);
+    tf = _mm_min_ps(t1, tf);
+  }
+  tf = _mm_mul_ps(tf, _mm_set1_ps(robust_scale));
+  _mm_storeu_ps(t_near + offset, tn);
+  return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(tn, tf)));
+}
+#endif
+
+template <int W>
+unsigned slab_test(const wide_bvh_node<W>& node, const float_ray& r,
+                   float t_min, float t_max, float* t_near) {
+  slab_planes<W> p(node, r);
+#if defined(__AVX__)
+  if constexpr (W == 8) {
+    __m256 tn = _mm256_set1_ps(t_min);
+    __m256 tf = _mm256_set1_ps(t_max);
+    for (int a = 0; a < 3; ++a) {
+      const __m256 org = _mm256_set1_ps(r.org[a]);
+      const __m256 inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+      __m256 t0 =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(p.near[a]), org), inv_dir);
+      __m256 t1 =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(p.far[a]), org), inv_dir);
+      tn = _mm256_max_ps(t0, tn);
+      tf = _mm256_min_ps(t1, tf);
+    }
+    tf = _mm256_mul_ps(tf, _mm256_set1_ps(robust_scale));
+    _mm256_storeu_ps(t_near, tn);
+    return static_cast<unsigned>(
+      _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ)));
+  }
+#endif
+#ifdef RTIOW_SSE
+  unsigned mask = 0;
+  for (int offset = 0; offset < W; offset += 4) {
+    mask |= slab_test4(p, r, offset, t_min, t_max, t_near) << offset;
+  }
+  return mask;
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < W; ++i) {
+    float tn = t_min;
+    float tf = t_max;
+    for (int a = 0; a < 3; ++a) {
+      float t0 = (p.near[a][i] - r.org[a]) * r.inv_dir[a];
+      float t1 = (p.far[a][i] - r.org[a]) * r.inv_dir[a];
+      tn = t0 > tn ? t0 : tn;
+      tf = t1 < tf ? t1 : tf;
+    }
+    t_near[i] = tn;
+    if (tn <= tf * robust_scale)
+      mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+}  // namespace
+
+template <int W>
+wide_bvh<W>::wide_bvh(const linear_bvh& bvh) : prims(bvh.prims) {
+  if (bvh.nodes.empty())
+    return;
+  bvh.bounding_box(0, 0, bounds);
+  const auto& root = bvh.nodes[0];
+  if (root.prim_count == 0) {
+    collapse(bvh, 0);
+    return;
+  }
+  // A single leaf still needs a node to hang off.
+  auto& node = nodes.emplace_back();
+  for (int i = 0; i < W; ++i) {
+    node.min_x[i] = node.min_y[i] = node.min_z[i] = INFINITY;
+    node.max_x[i] = node.max_y[i] = node.max_z[i] = -INFINITY;
+    node.child[i] = 0;
+    node.prim_count[i] = 0;
+  }
+  node.min_x[0] = root.min[0], node.min_y[0] = root.min[1];
+  node.min_z[0] = root.min[2], node.max_x[0] = root.max[0];
+  node.max_y[0] = root.max[1], node.max_z[0] = root.max[2];
+  node.child[0] = root.first_prim;
+  node.prim_count[0] = root.prim_count;
+}
+
+template <int W>
+uint32_t wide_bvh<W>::collapse(const linear_bvh& bvh, uint32_t index) {
+  // Open the interior child with the largest surface area until all W slots
+  // are used or only leaves are left.
+  std::array<uint32_t, W> children;
+  int count = 2;
+  children[0] = index + 1;
+  children[1] = bvh.nodes[index].second_child;
+  while (count < W) {
+    int best = -1;
+    real_t best_area = -1;
+    for (int i = 0; i < count; ++i) {
+      const auto& c = bvh.nodes[children[i]];
+      if (c.prim_count > 0)
+        continue;
+      real_t area = c.box().surface_area();
+      if (area > best_area) {
+        best = i;
+        best_area = area;
+      }
+    }
+    if (best == -1)
+      break;
+    uint32_t opened = children[best];
+    children[best] = opened + 1;
+    children[count++] = bvh.nodes[opened].second_child;
+  }
+
+  const auto out = static_cast<uint32_t>(nodes.size());
+  nodes.emplace_back();
+  for (int i = 0; i < W; ++i) {
+    auto& node = nodes[out];
+    node.child[i] = 0;
+    node.prim_count[i] = 0;
+    if (i >= count) {
+      node.min_x[i] = node.min_y[i] = node.min_z[i] = INFINITY;
+      node.max_x[i] = node.max_y[i] = node.max_z[i] = -INFINITY;
+      continue;
+    }
+    const auto& c = bvh.nodes[children[i]];
+    node.min_x[i] = c.min[0], node.min_y[i] = c.min[1];
+    node.min_z[i] = c.min[2], node.max_x[i] = c.max[0];
+    node.max_y[i] = c.max[1], node.max_z[i] = c.max[2];
+    if (c.prim_count > 0) {
+      node.child[i] = c.first_prim;
+      node.prim_count[i] = c.prim_count;
+    }
+  }
+  for (int i = 0; i < count; ++i) {
+    if (bvh.nodes[children[i]].prim_count == 0) {
+      // Assign through the index, collapse() grows the node vector.
+      uint32_t sub = collapse(bvh, children[i]);
+      nodes[out].child[i] = sub;
+    }
+  }
+  return out;
+}
+
+template <int W>
+void wide_bvh<W>::refit(real_t time0, real_t time1) {
+  // Children always come after their parent, so a reverse sweep visits them
+  // first. Unused slots keep their inverted bounds.
+  for (size_t i = nodes.size(); i-- > 0;) {
+    auto& node = nodes[i];
+    for (int c = 0; c < W; ++c) {
+      if (node.prim_count[c] > 0) {
+        node.set_box(c, linear_bvh::leaf_box(&prims[node.child[c]],
+                                             node.prim_count[c], time0,
+                                             time1));
+      } else if (node.child[c] != 0) {
+        const auto& child = nodes[node.child[c]];
+        aabb box = aabb::empty();
+        for (int k = 0; k < W; ++k)
+          box = box.surrounding(child.box(k));
+        node.set_box(c, box);
+      }
+    }
+  }
+  bounds = aabb::empty();
+  for (int c = 0; !nodes.empty() && c < W; ++c)
+    bounds = bounds.surrounding(nodes[0].box(c));
+}
+
+template <int W>
+bool wide_bvh<W>::bounding_box(real_t time0, real_t time1,
+                               aabb& output_box) const {
+  output_box = bounds;
+  return !nodes.empty();
+}
+
+template <int W>
+template <bool any_hit, typename LeafHit>
+bool wide_bvh<W>::traverse(const ray& r, real_t t_min, real_t t_max,
+                           const LeafHit& leaf_hit) const {
+  if (nodes.empty())
+    return false;
+
+  struct entry {
+    uint32_t child;
+    uint16_t prim_count;
+    float t;
+  };
+  // Every level pushes at most W - 1 entries beyond the one it pops.
+  constexpr size_t stack_capacity = linear_bvh::max_depth * (W - 1) + 1;
+  entry stack[stack_capacity];
+  size_t stack_size = 0;
+  stack[stack_size++] = {0, 0, static_cast<float>(t_min)};
+
+  const float_ray fr(r);
+  bool hit_anything = false;
+  while (stack_size > 0) {
+    const entry e = stack[--stack_size];
+    if (e.t > t_max * robust_scale)
+      continue;
+
+    if (e.prim_count > 0) {
+      if (leaf_hit(e.child, e.prim_count, t_max)) {
+        if constexpr (any_hit)
+          return true;
+        hit_anything = true;
+      }
+      continue;
+    }
+
+    const auto& node = nodes[e.child];
+    alignas(32) float t_near[W];
+    unsigned mask = slab_test(node, fr, static_cast<float>(t_min),
+                              static_cast<float>(t_max), t_near);
+    if (mask == 0)
+      continue;
+
+    // Sort the children that were hit nearest first, then push them in
+    // reverse so the nearest one is popped next.
+    entry hits[W];
+    int hit_count = 0;
+    for (int i = 0; i < W; ++i) {
+      if (!(mask & (1u << i)))
+        continue;
+      entry h = {node.child[i], node.prim_count[i], t_near[i]};
+      int j = hit_count++;
+      while (j > 0 && hits[j - 1].t > h.t) {
+        hits[j] = hits[j - 1];
+        --j;
+      }
+      hits[j] = h;
+    }
+    for (int i = hit_count - 1; i >= 0; --i) {
+      stack[stack_size++] = hits[i];
+    }
+  }
+  return hit_anything;
+}
+
+template <int W>
+bool wide_bvh<W>::hit(const ray& r, real_t t_min, real_t t_max,
+                      hit_record& rec) const {
+  return traverse<false>(r, t_min, t_max,
+                         [&](uint32_t first, uint32_t count, real_t& t_far) {
+                           bool hit_anything = false;
+                           for (uint32_t i = 0; i < count; ++i) {
+                             if (prims[first + i]->hit(r, t_min, t_far, rec)) {
+                               hit_anything = true;
+                               t_far = rec.t;
+                             }
+                           }
+                           return hit_anything;
+                         });
+}
+
+template <int W>
+bool wide_bvh<W>::occluded(const ray& r, real_t t_min,
+                           real_t t_max) const {
+  return traverse<true>(r, t_min, t_max,
+                        [&](uint32_t first, uint32_t count, real_t& t_far) {
+                          for (uint32_t i = 0; i < count; ++i) {
+                            if (prims[first + i]->occluded(r, t_min, t_far))
+                              return true;
+                          }
+                          return false;
+                        });
+}
+
+template struct wide_bvh<4>;
+template struct wide_bvh<8>;
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "object.h"
+
+// stl
+#include <cstdint>
+
+// A node with up to W children whose bounds are stored as structure of arrays,
+// so that one SIMD slab test checks the ray against all of them. Unused slots
+// have inverted bounds and never pass the test.
+template <int W>
+struct alignas(32) wide_bvh_node {
+  float min_x[W], min_y[W], min_z[W];
+  float max_x[W], max_y[W], max_z[W];
+  uint32_t child[W];       // Node index, or first primitive for leaves
+  uint16_t prim_count[W];  // Zero for interior children
+
+  aabb box(int i) const {
+    return aabb(point3(min_x[i], min_y[i], min_z[i]),
+                point3(max_x[i], max_y[i], max_z[i]));
+  }
+
+  void set_box(int i, const aabb& box) {
+    min_x[i] = float_down(box.min[0]), min_y[i] = float_down(box.min[1]);
+    min_z[i] = float_down(box.min[2]), max_x[i] = float_up(box.max[0]);
+    max_y[i] = float_up(box.max[1]), max_z[i] = float_up(box.max[2]);
+  }
+};
+
+// A BVH with W children per node, collapsed from a binary linear_bvh by
+// repeatedly opening the child with the largest surface area. Fewer, wider
+// nodes mean a shallower traversal and fewer dependent memory accesses. The
+// primitives are not owned; they have to outlive the wide_bvh.
+template <int W>
+struct wide_bvh : hittable {
+  static_assert(W == 4 || W == 8, "wide_bvh supports 4 or 8 children");
+
+  explicit wide_bvh(const struct linear_bvh& bvh);
+
+  virtual bool hit(const ray& r, real_t t_min, real_t t_max,
+                   hit_record& rec) const override;
+
+  virtual bool occluded(const ray& r, real_t t_min,
+                        real_t t_max) const override;
+
+  virtual bool bounding_box(real_t time0, real_t time1,
+                            aabb& output_box) const override;
+
+  // Recomputes the child bounds bottom-up from the current primitive bounds,
+  // keeping the topology, as linear_bvh::refit does.
+  void refit(real_t time0, real_t time1);
+
+  size_t memory_usage() const {
+    return nodes.size() * sizeof(wide_bvh_node<W>) +
+           prims.size() * sizeof(hittable*);
+  }
+
+  std::vector<wide_bvh_node<W>> nodes;
+  std::vector<hittable*> prims;
+  aabb bounds = aabb::empty();
+
+ protected:
+  // Stack traversal nearest child first, calling leaf_hit(first_prim,
+  // prim_count, t_max) on the leaves as linear_bvh::traverse does.
+  template <bool any_hit, typename LeafHit>
+  bool traverse(const ray& r, real_t t_min, real_t t_max,
+                const LeafHit& leaf_hit) const;
+
+  uint32_t collapse(const struct linear_bvh& bvh, uint32_t index);
+};
+
+extern template struct wide_bvh<4>;
+extern template struct wide_bvh<8>;